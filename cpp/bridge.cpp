@@ -3,30 +3,41 @@
 #include <string>
 #include <cstring>
 #include <fstream>
+#include <sstream>
+#include <chrono>
 #include <vector>
 #include <random>
 #include <thread>
 #include <tuple>
+#include <deque>
+#include <list>
+#include <future>
+#include <atomic>
+#include <memory>
 #include <unordered_map>
 #include <unordered_set>
 #include <shared_mutex>
+#include <condition_variable>
+#include <filesystem>
 
 #include "ggml.h"
 #include "ggml-common.h"
 #include "ggml-backend.h"
+#define LLAMA_API_INTERNAL // grammar internals are needed to cache token masks
 #include "llama.h"
 
 #include "bridge.h"
 #include "janus.h"
+#include "common/ngram-cache.h"
+#include "common/json-schema-to-grammar.h"
 
-char * debug; // debug level = "cuda|tokenizer", etc
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
-static llama_context           ** g_ctx;
-static llama_model             ** g_model;
-static gpt_params               * g_params;
-static std::vector<llama_token> * g_input_tokens;
-static std::vector<llama_token> * g_output_tokens;
-static bool is_interacting = false;
+char * debug; // debug level = "cuda|tokenizer", etc
 
 // FIXME ASAP - do not allow longer context when reading session file
 
@@ -36,34 +47,80 @@ static bool is_interacting = false;
 // ggml_new_tensor_impl: not enough space in the scratch memory pool (needed 877775360, available 536870912)
 // fatal error: unexpected signal during runtime execution
 
-// Shared map for storing pairs of [UUID] -> [Output] while processing within C++ side
-// After returning final result to Go side, we can safely remove the current result from the map
+// Job records storing [UUID] -> [Output and stats] while processing within C++ side
+// The table is split into shards by job ID, so pollers of different jobs rarely meet on the same lock.
+// Serving loop holds the pointer to the record of each running job and never touches the table itself.
+// Records are removed with releaseJob() or automatically after JOB_TTL seconds since the job was finished
+
+#define JOB_SHARDS 16
+#define JOB_TTL    3600
+
+#define LOOKUP_SAVE_INTERVAL 60 // seconds between saves of the dynamic n-gram cache
+#define WINDOW_SINK 4 // min tokens at the start of the sliding window never evicted
+#define PREFILL_MIN 16 // min prompt tokens evaluated per step, so prefill never stalls behind the budget of decoding slots
+
+struct llama_job_record {
+    std::shared_mutex mutex; // guards all the fields below
+
+    std::string output; // generated text
+
+    int64_t promptTokenCount = 0;
+    int64_t outputTokenCount = 0;
 
-std::shared_mutex mutex;
+    int64_t promptEval = 0; // PROMPT token evaluation timing [ in milliseconds ]
+    int64_t timing     = 0; // OUTPUT token evaluation timing [ in milliseconds ]
+    uint32_t seed      = 0; // seed for RNG
 
-// NB! Always use mutex to access map thread-safe way
+    int64_t draftTokenCount    = 0; // tokens proposed by the draft model
+    int64_t acceptedTokenCount = 0; // drafted tokens accepted by the main model
 
-// https://www.geeksforgeeks.org/map-vs-unordered_map-c/
-// https://github.com/bdasgupta02/dynamap/issues/1
-// https://github.com/tsixta/tsmap
-// https://github.com/kshk123/hashMap
+    bool aborted = false; // the job was stopped or hit its deadline before the output was complete
+    std::string error;    // why the job could not be started at all, empty otherwise
 
-std::unordered_map<std::string, std::string> jobs;
+    int64_t t_finished_us = 0; // zero while the job is running
+};
 
-// Map of vectors storing PROMPT token evaluation timings [ in milliseconds ]
-std::unordered_map<std::string, int64_t> promptEvals;
+struct llama_job_shard {
+    std::shared_mutex mutex; // NB! Pollers need only shared lock to find the record
+    std::unordered_map<std::string, std::shared_ptr<llama_job_record>> records;
+};
 
-// Map of vectors storing OUTPUT token evaluation timings [ in milliseconds ]
-std::unordered_map<std::string, int64_t> timings;
+llama_job_shard shards[JOB_SHARDS];
 
-// Map of vectors storing seeds for RNG
-std::unordered_map<std::string, uint32_t> seeds;
+static llama_job_shard & job_shard(const std::string & jobID) {
+    return shards[std::hash<std::string>{}(jobID) % JOB_SHARDS];
+}
+
+// Create the new record for the job, dropping expired records of the same shard along the way
+static std::shared_ptr<llama_job_record> create_job(const std::string & jobID) {
+    auto record = std::make_shared<llama_job_record>();
+    auto & shard = job_shard(jobID);
+    const int64_t t_expired_us = ggml_time_us() - (int64_t) JOB_TTL * 1000 * 1000;
+
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+
+    for (auto it = shard.records.begin(); it != shard.records.end(); ) {
+        std::shared_lock<std::shared_mutex> lockRecord(it->second->mutex);
+        const int64_t t_finished_us = it->second->t_finished_us;
+        lockRecord.unlock();
+
+        if (t_finished_us > 0 && t_finished_us < t_expired_us) {
+            it = shard.records.erase(it);
+        } else {
+            ++it;
+        }
+    }
 
-// Map of vectors storing PROMPT token count
-std::unordered_map<std::string, int64_t> promptTokenCount;
+    shard.records[jobID] = record;
+    return record;
+}
 
-// Map of vectors storing OUTPUT token count
-std::unordered_map<std::string, int64_t> outputTokenCount;
+static std::shared_ptr<llama_job_record> find_job(const std::string & jobID) {
+    auto & shard = job_shard(jobID);
+    std::shared_lock<std::shared_mutex> lock(shard.mutex);
+    auto it = shard.records.find(jobID);
+    return it != shard.records.end() ? it->second : nullptr;
+}
 
 // Suspend stdout / stderr messaging
 // https://stackoverflow.com/questions/70371091/silencing-stdout-stderr
@@ -95,578 +152,2824 @@ llama_sampling_params sparams[8]; // sampling params
 llama_model * models[8];          // models
 llama_context * contexts[8];      // contexts
 
-// Flags to stop particular inference thread from the Go code
+llama_model * draftModels[8];     // optional draft models for speculative decoding
+llama_context * draftContexts[8]; // draft contexts, NULL when the pod does not speculate
 
-bool stopInferenceFlags[8];
+// --- Continuous batching
+//     Each pod owns one context and serves up to n_parallel jobs at once. Every job occupies its own slot
+//     with a dedicated llama_seq_id, so all active sequences are decoded together within the same llama_batch.
+//     New jobs join on the next decode step and finished ones leave without stalling the others.
 
-// Directory where session data files will be held. Emtpy string if sessions are disabled
+struct llama_job {
+    std::string jobID;
+    std::string sessionID;
+    std::string prompt;
+    std::string grammar; // optional GBNF grammar to constrain the output
+    std::string schema;  // optional JSON schema of the output, converted into the grammar
 
-std::string path_session;
+    int priority = 0;    // jobs of higher priority go first and might preempt running jobs of lower priority
+    std::string tenant;  // jobs of the same priority share the pod between tenants according to their weights
+    float weight = 1.0f; // fair-share weight of the tenant
+    int64_t t_queued_us = 0;
+    int64_t t_deadline_us = 0; // the job is aborted wherever it is after that time [ zero = no deadline ]
 
-// -- init_context
+    std::shared_ptr<struct llama_parked> parked; // state of the preempted job waiting to be resumed
 
-struct llama_context * init_context(int idx) {
+    std::string parentID;              // the job this one was forked from, stopping the parent stops all its choices
+    std::vector<llama_job *> branches; // jobs of other choices waiting to be forked from this one after the prefill
 
-    auto modelName = params[idx].model.c_str();
+    std::shared_ptr<llama_job_record> record; // output and stats available for pollers
 
-    // -- initialize the model
+    std::promise<int64_t> done; // total number of tokens processed [ prompt + output ]
+};
 
-    // WAS: llama_model_params settings = llama_model_default_params();
-    llama_model_params /* model_params */ settings = llama_model_params_from_gpt_params(::params[idx]);
+struct llama_slot {
+    llama_seq_id id = 0;
+    llama_job * job = nullptr; // NULL when the slot is idle
 
-    settings.main_gpu     = ::params[idx].main_gpu;
-    settings.n_gpu_layers = ::params[idx].n_gpu_layers;
-    settings.tensor_split = ::params[idx].tensor_split;
+    std::vector<llama_token> embd_inp;     // prompt tokens
+    ring_buffer<llama_token> last_tokens;  // we still need to maintain this for Janus Sampling
+    std::vector<llama_token> cache_tokens; // tokens of the sequence held within KV cache, kept between jobs for prefix reuse
 
-    llama_model * model = llama_load_model_from_file(modelName, settings);
-    if (model == NULL) {
-        fprintf(stderr, "%s: error: failed to load model '%s'\n", __func__, modelName);
-        // return std::make_tuple(nullptr, nullptr);
-        return NULL;
-    }
+    std::string pending; // output bytes of the incomplete UTF-8 character
 
-    models[idx] = model;
+    struct llama_sampling_context * ctx_sampling = nullptr;
 
-    // -- initialize the context
+    llama_token sampled  = 0;  // the last sampled token waiting to be decoded
+    int32_t i_batch      = -1; // index of the slot logits within the current batch [ -1 = not sampling this step ]
 
-    // WAS: auto defaults = llama_context_default_params();
-    llama_context_params /* ctx_params */ defaults = llama_context_params_from_gpt_params(params[idx]);
+    int n_past     = 0;
+    int n_consumed = 0;
+    int n_remain   = 0;
+    int n_keep     = 0;
+    int n_output   = 0;
+    int n_cached   = 0; // prompt tokens reused from KV cache without evaluation
+    int n_evicted  = 0; // tokens evicted after n_keep first ones since the cached sequence was started
 
-    defaults.n_ctx           = ::params[idx].n_ctx;
-    defaults.seed            = ::params[idx].seed;
-    defaults.n_threads       = ::params[idx].n_threads;
-    defaults.n_threads_batch = ::params[idx].n_threads_batch;
+    int n_past_batch     = 0; // n_past and n_consumed before tokens of the current batch were added,
+    int n_consumed_batch = 0; // so the slot is rolled back when the decode was aborted
 
-    // TODO: Determine best batch size for GPU (and maybe different depending on VRAM size)
-    // NB! It crashes with batch of 32/64 and go loop with 128. So use batching of 256 or more
+    bool shared = false; // KV cells of the sequence might be shared with sequences forked from the same prompt
 
-    bool isGPU = ::params[idx].n_gpu_layers > 0 ? true : false;
+    // speculative decoding state
+    std::vector<llama_token> draft_tokens; // tokens of the sequence held within draft KV cache
+    std::vector<llama_token> drafted;      // tokens proposed by the draft model for the current step
 
-    if (::params[idx].n_batch > 0 && ::params[idx].n_batch <= ::params[idx].n_ctx) {
-        defaults.n_batch = ::params[idx].n_batch;
-    } else if (isGPU) {
-        defaults.n_batch = 512;
-    } else {
-        defaults.n_batch = ::params[idx].n_ctx;
-    }
+    std::vector<llama_token> lookup_inp;   // prompt and output tokens for n-gram lookup, only appended to
+    llama_ngram_cache ngram_context;       // n-grams of lookup_inp
+    int n_drafted  = 0;
+    int n_accepted = 0;
 
-    llama_context * ctx = llama_new_context_with_model(model, defaults);
-    if (ctx == NULL) {
-        fprintf(stderr, "%s: error: failed to create context with model '%s'\n", __func__, modelName);
-        llama_free_model(model);
-        // return std::make_tuple(nullptr, nullptr);
-        return NULL;
-    }
+    // group-attention state
+    // number of grouped KV tokens so far (used only if params.grp_attn_n > 1)
+    int ga_i = 0;
 
-    contexts[idx] = ctx;
+    int64_t t_start_us  = 0; // when the job was admitted into the slot
+    int64_t t_prompt_us = 0; // when the first token was sampled [ the whole prompt was evaluated ]
+    int64_t t_last_us   = 0; // when the slot was used last time
+};
 
-    // return std::make_tuple(model, lctx);
-    return ctx;
-}
+// Texts waiting to be embedded by the serving loop of the pod
+struct llama_embed_request {
+    const char * const * texts;
+    int n;
+    float * out;
+    std::promise<int64_t> done; // total number of tokens evaluated or -1 on failure
+};
 
-// Process prompt and compute output, return total number of tokens processed
-// idx - index of pod / context / params to do processing within
-int64_t do_inference(
+struct llama_pod {
+    std::mutex mutex; // guards the queue, embedding requests, stop requests and shutdown
+    std::condition_variable ready;
 
-    int idx, 
-    struct llama_context * ctx, 
-    const std::string & jobID, 
-    const std::string & sessionID, 
-    const std::string & prompt
+    std::deque<llama_job *> queue;              // jobs waiting for an idle slot, new and preempted ones
+    std::deque<llama_embed_request *> embeds;   // embedding requests served between batches
+    std::unordered_set<std::string> stops;      // IDs of running and preempted jobs which should be stopped
+    bool shutdown = false;                      // the serving loop exits as soon as there is nothing to do
+    std::thread server;                         // the serving loop, joined by free_context()
 
-) {
+    std::unordered_map<std::string, double> shares; // tokens processed for each tenant divided by its weight
 
-    llama_reset_timings(ctx);
-    stopInferenceFlags[idx] = false;
+    // NB! Flags are polled by all compute threads of ggml right in the middle of llama_decode()
+    std::atomic<bool> abort{false};        // some running job was stopped
+    std::atomic<bool> armed{false};        // the main model is decoding the batch, safe to abort
+    std::atomic<bool> fired{false};        // the callback asked to abort, so it keeps returning true for all threads
+    std::atomic<int64_t> t_deadline_us{0}; // the nearest deadline of jobs within the batch [ zero = none ]
 
-    bool isGPU     = ::params[idx].n_gpu_layers > 0 ? true : false;
-    auto model     = models[idx];
-    ///// auto vocabSize = llama_n_vocab(model);
+    std::vector<llama_slot> slots; // NB! Slots are accessed only from the serving thread of the pod
 
-    gpt_params & params = ::params[idx];
-    llama_sampling_params & sparams = ::sparams[idx];
+    std::vector<int> cpus;                  // CPUs for all threads of the pod [ empty = any ]
+    ggml_threadpool * threadpool = nullptr; // compute threads of all contexts of the pod, the serving thread is the first one
 
-    // fprintf(stderr, "\n GLOBAL DEBUG = %s", debug); // DEBUG
-    initJanus(ctx, sparams, debug); // NB!
-
-    llama_context * ctx_guidance = NULL;
-    g_model = &model;
-    g_ctx = &ctx;
-    g_params = &params;
-    const int n_ctx = llama_n_ctx(ctx);
-    std::string path_session = ::params[idx].path_prompt_cache;
-    std::vector<llama_token> session_tokens;
-
-    std::string sessionFile;
-    if (!isGPU &&
-        !path_session.empty() && 
-        !sessionID.empty()) {
-
-        sessionFile = path_session + '/' + sessionID;
-    }
-
-    // TODO: Do not always use RANDOM seed ?!
-    // if (params.seed == LLAMA_DEFAULT_SEED) {
-    auto seed = time(NULL);
-    llama_set_rng_seed(ctx, seed);
-    mutex.lock();
-    ::params[idx].seed = seed;
-    ::seeds[jobID] = seed;
-    mutex.unlock();
-    
-    // --- SESSIONS ---
-/*
-    //std::string path_session = "./session.data.bin";
-    //std::string path_session = "./"; // FIXME: params.path_prompt_cache;
-    std::vector<llama_token> session_tokens;
-
-    // NB! Do not store sessions for fast GPU-machines
-    if (!isGPU && 
-        !sessionFile.empty()) {
-
-        fprintf(stderr, "%s: attempting to load saved session from '%s'\n", __func__, sessionFile.c_str());
-
-        // fopen to check for existing session
-        FILE * fp = std::fopen(sessionFile.c_str(), "rb");
-        if (fp != NULL) {
-            std::fclose(fp);
-
-            session_tokens.resize(params.n_ctx);
-            //fprintf(stderr, "%s: session_tokens capacity = %d tokens\n", __func__, (int) session_tokens.capacity());
-
-            size_t n_token_count_out = 0;
-            if (!llama_load_session_file(ctx, sessionFile.c_str(), session_tokens.data(), session_tokens.capacity(), &n_token_count_out)) {
-                fprintf(stderr, "%s: error: failed to load session file '%s'\n", __func__, sessionFile.c_str());
-                //return 1;
-
-                // FIXME: The possible problem - mismatch between models
-                // llama_load_session_file_internal : model hparams didn't match from session file!
-                // Just ignore the problem for now, session file will be rewritten soon within C++ 
-                // and then possibly again (if Go code has another value of token counter) after 2K limit will be reached
-                // The better solution is to create new file and sync this event between Go / C++ parts
-            }
-            session_tokens.resize(n_token_count_out);
+    llama_context * embed_ctx = nullptr; // created with the first embedding request, used by the serving thread only
 
-            //fprintf(stderr, "%s: %d tokens were restored\n", __func__, n_token_count_out);
+    std::shared_ptr<const llama_janus_tables> janus; // token tables shared by all pods with the same model
 
-            fprintf(stderr, "%s: loaded a session with prompt size of %d tokens\n", __func__, (int) session_tokens.size());
-        } else {
-            fprintf(stderr, "%s: session file does not exist, will create\n", __func__);
+    bool lookup = false;            // draft tokens with n-gram lookup when there no draft model
+    llama_ngram_cache ngramDynamic; // n-grams of previous jobs of the pod, persisted to params.lookup_cache_dynamic
+    llama_ngram_cache ngramStatic;  // n-grams of a large corpus prepared in advance, never changed
+    int64_t t_lookup_saved_us = 0;  // when the dynamic cache was saved last time [ zero to save after the first job ]
+
+    // NB! Pods which were not freed are left serving till the very exit of the process, as it was with detached threads
+    ~llama_pod() {
+        if (server.joinable()) {
+            server.detach();
         }
     }
-*/
-    // tokenize the prompt
-    const bool add_bos = llama_should_add_bos_token(model);
-    std::vector<llama_token> embd_inp;
-    embd_inp = ::llama_tokenize(ctx, prompt, add_bos, true);
+};
 
-    // Should not run without any tokens
-    if (embd_inp.empty()) {
-        embd_inp.push_back(llama_token_bos(model)); // FIXME
+llama_pod pods[8];
+
+// Abort callback of the pod context: stop computing the graph as soon as possible when any job within the batch
+// was stopped or hit its deadline. Once fired, it keeps returning true until the decode is over
+static bool abort_decode(void * data) {
+    llama_pod & pod = *(llama_pod *) data;
+    if (!pod.armed.load(std::memory_order_relaxed)) {
+        return false;
+    }
+    if (pod.fired.load(std::memory_order_relaxed)) {
+        return true;
+    }
+    const int64_t t_deadline_us = pod.t_deadline_us.load(std::memory_order_relaxed);
+    if (pod.abort.load(std::memory_order_relaxed) || (t_deadline_us > 0 && ggml_time_us() > t_deadline_us)) {
+        pod.fired.store(true, std::memory_order_relaxed);
+        return true;
     }
+    return false;
+}
 
-    // number of tokens to keep when resetting context
-    if (params.n_keep < 0 || params.n_keep > (int) embd_inp.size() /* || params.instruct || params.chatml */ ) {
-        params.n_keep = (int) embd_inp.size();
-    } else {
-        params.n_keep += add_bos; // always keep the BOS token
+// The whole state of the preempted job, so it's resumed later exactly where it was stopped
+struct llama_parked {
+    llama_slot slot;                  // slot fields of the job, the sequence ID is not preserved
+    std::vector<uint8_t> state;       // sequence copied out of the KV cache
+    std::vector<uint8_t> draft_state; // the same for the draft model
+};
+
+std::mutex tenantsMutex;
+std::unordered_map<std::string, float> tenantWeights; // fair-share weights [ 1.0 for tenants not listed ]
+
+// --- Shared models
+//     Pods configured with the same GGUF file and load settings reuse the single llama_model instance.
+//     Each of them creates only its own llama_context on top of it, so weights and vocab are loaded once per host.
+
+struct llama_shared_model {
+    llama_model * model = nullptr;
+    int refs = 0; // how many pods are using the model
+};
+
+std::mutex modelsMutex;
+std::unordered_map<std::string, llama_shared_model> sharedModels; // [ path + load params ] -> model
+
+// The key should differ for every set of params which affects how the weights are loaded
+static std::string model_key(const gpt_params & params) {
+    std::string key = params.model;
+    key += "|gpu="   + std::to_string(params.n_gpu_layers);
+    key += "|main="  + std::to_string(params.main_gpu);
+    key += "|mode="  + std::to_string(params.split_mode);
+    key += "|split=";
+    for (size_t i = 0; i < llama_max_devices(); i++) {
+        key += std::to_string(params.tensor_split[i]) + ",";
     }
-/*
-    // DEBUG
-    fprintf(stderr, "\n\nADD_BOS: %d\n\n", add_bos);
-    fprintf(stderr, "\n\nTOKENS: [ ");
-    for(int i = 0; i < embd_inp.size(); i++) {
-         fprintf(stderr, "%d, ", embd_inp.data()[i]);
+    key += "|mmap="  + std::to_string(params.use_mmap);
+    key += "|mlock=" + std::to_string(params.use_mlock);
+    key += "|rpc="   + params.rpc_servers;
+    key += "|numa="  + std::to_string(params.numa_node);
+    return key;
+}
+
+// Load the model or return the one already loaded with the same params, increasing its ref counter
+static llama_model * acquire_model(const gpt_params & params, const llama_model_params & settings) {
+    std::lock_guard<std::mutex> lock(modelsMutex);
+
+    auto & shared = sharedModels[model_key(params)];
+    if (shared.model == NULL) {
+        shared.model = llama_load_model_from_file(params.model.c_str(), settings);
+        if (shared.model == NULL) {
+            sharedModels.erase(model_key(params));
+            return NULL;
+        }
     }
-    fprintf(stderr, "]");
-*/
-/*
-    auto tokens = ::llama_tokenize(ctx, doc, true); 
-    std::unordered_map<llama_token, size_t> tokmap;
-    for(int i = 0; i < tokens.size(); i++) {
-        auto id = tokens[i];
-        tokmap[id]++;
-    }
-    std::vector<llama_token_data> candidates;
-    candidates.clear();
-    for(const auto& elem : tokmap)
-    {
-        //fprintf(stderr, "\nID %d | \"%s\" | P %d", elem.first, llama_token_to_str(ctx, elem.first).c_str(), elem.second);
-        //std::cout << elem.first << " " << elem.second.first << " " << elem.second.second << "\n";
-        candidates.emplace_back(llama_token_data{elem.first, (float)elem.second, 0.0f});
-    }
-    std::sort(
-        candidates.data(), 
-        candidates.data() + candidates.size(), 
-        [](const llama_token_data & a, const llama_token_data & b) { 
-            return a.logit > b.logit; 
-        }
-    );
-    fprintf(stderr, "\n\n==== TOKENS %d ====", tokens.size());
-    fprintf(stderr, "\n\n==== TOKMAP ====\n");
-    for (size_t i = 0; i < candidates.size(); i++) {
-        auto id =candidates.data()[i].id;
-        auto logit = candidates.data()[i].logit;
-        fprintf(stderr, 
-            "\n  -- %5d [ %.1f ~ %.2f ] \"%s\"", 
-            id,
-            logit,
-            logit / tokens.size(),
-            llama_token_to_str(ctx, id).c_str()
-        );
-    }    
-    exit(1);
-*/    
-    
-    // -- DEBUG
 
-    if (strstr(::debug, "tokenizer")) {
+    shared.refs++;
+    return shared.model;
+}
 
-        // DEBUG JANUS
-        // fprintf(stderr, "\n\n === JANUS ===");
-        // fprintf(stderr, "\n * janus = %d", ::sparams[idx].janus);
-        // fprintf(stderr, "\n * depth = %d", ::sparams[idx].depth);
-        // fprintf(stderr, "\n * scale = %f", ::sparams[idx].scale);
-        // fprintf(stderr, "\n * lo = %f", ::sparams[idx].lo);
-        // fprintf(stderr, "\n * hi = %f", ::sparams[idx].hi);
+// Decrease the ref counter and free the model when there no more pods using it
+static void release_model(llama_model * model) {
+    std::lock_guard<std::mutex> lock(modelsMutex);
 
-        fprintf(stderr, "\n\n=== ADD_BOS = %d ===", add_bos);
-        fprintf(stderr, "\n\n=== PROMPT ===\n\n%s", prompt.c_str());
+    for (auto it = sharedModels.begin(); it != sharedModels.end(); ++it) {
+        if (it->second.model != model) continue;
+        if (--it->second.refs == 0) {
+            llama_free_model(model);
+            sharedModels.erase(it);
+        }
+        return;
+    }
+}
 
-        fprintf(stderr, "\n\n=== IDS ===\n\n");
-        for(size_t i = 0; i < embd_inp.size(); i++) {
-            fprintf(stderr, "%d, ", embd_inp.data()[i]);
+// --- NUMA
+//     The pod bound to the NUMA node runs all its threads on CPUs of the node. Weights of the pod are loaded without mmap
+//     by the thread bound there too, so pages of the model and KV cache are first touched within the node memory.
+//     Each node gets its own replica of the model shared by all pods of the node, the same way as shared models above.
+//     NB! NUMA strategies of ggml are process-wide and reset the affinity of the calling thread after each graph,
+//         so they are left disabled and the binding is done here per pod
+
+// CPUs listed like "0-15,32-47"
+static std::vector<int> parse_cpus(const std::string & list) {
+    std::vector<int> cpus;
+    std::stringstream ranges(list);
+    std::string range;
+    while (std::getline(ranges, range, ',')) {
+        int first = 0, last = 0;
+        const int n = sscanf(range.c_str(), "%d-%d", &first, &last);
+        if (n < 1 || first < 0) continue;
+        for (int cpu = first; cpu <= (n == 2 ? last : first); cpu++) {
+            cpus.push_back(cpu);
         }
+    }
+    return cpus;
+}
 
-        fprintf(stderr, "\n\n=== TOKENS ===\n\n");
-        for(size_t i = 0; i < embd_inp.size(); i++) {
-            auto id = embd_inp.data()[i];
-            fprintf(stderr, " #%d ", id);
-            if (id == 13) fprintf(stderr, "{\\n}\n");
-            else if (id == 271) fprintf(stderr, "{\\n\\n}\n\n");
-            else if (id == 1) fprintf(stderr, "{ BOS #1 }");
-            else if (id == 2) fprintf(stderr, "{ EOS #2 }");
-            else if (id == 128000) fprintf(stderr, "<|begin_of_text|>");
-            else if (id == 128001) fprintf(stderr, "<|end_of_text|>");
-            else if (id == 128006) fprintf(stderr, "<|start_header_id|>");
-            else if (id == 128007) fprintf(stderr, "<|end_header_id|>");
-            else if (id == 128009) fprintf(stderr, "<|eot_id|>");
-            else if (id >= 128000) fprintf(stderr, "{ #%d }", id);
-            else fprintf(stderr, "{%s}",  llama_token_to_piece(ctx, embd_inp.data()[i]).c_str());
+// CPUs of the NUMA node, empty when there no such node
+static std::vector<int> numa_cpus(int node) {
+    std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+    std::string list;
+    if (!std::getline(file, list)) {
+        return {};
+    }
+    return parse_cpus(list);
+}
+
+// CPUs the calling thread is allowed to run on, empty when unknown
+static std::vector<int> thread_affinity() {
+    std::vector<int> cpus;
+#if defined(__linux__)
+    cpu_set_t affinity;
+    if (!pthread_getaffinity_np(pthread_self(), sizeof(affinity), &affinity)) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &affinity)) cpus.push_back(cpu);
         }
     }
+#endif
+    return cpus;
+}
 
-    // const int n_ctx = llama_n_ctx(ctx); // TODO: Set it from ::params[idx] ?
-    promptTokenCount[jobID] = embd_inp.size();
+// Bind the calling thread to CPUs, threads started by it later inherit the same affinity
+static bool bind_thread(const std::vector<int> & cpus) {
+#if defined(__linux__)
+    if (cpus.empty()) {
+        return false;
+    }
+    cpu_set_t affinity;
+    CPU_ZERO(&affinity);
+    for (int cpu : cpus) {
+        if (cpu < CPU_SETSIZE) CPU_SET(cpu, &affinity);
+    }
+    return !pthread_setaffinity_np(pthread_self(), sizeof(affinity), &affinity);
+#else
+    (void) cpus;
+    return false;
+#endif
+}
 
-    // FIXME: Process the longer context properly and return some meaningful HTTP code to the front-end
+// Directory where session data files will be held. Emtpy string if sessions are disabled
 
-    if ((int) embd_inp.size() > (n_ctx - 4)) {
-    //if (sessionFile.empty() && ((int) embd_inp.size() > n_ctx - 4)) {  
-        fprintf(stderr, "%s: error: prompt is too long (%d tokens, max %d)\n", __func__, (int) embd_inp.size(), n_ctx - 4);
-        return 0;
+std::string path_session;
+int64_t swapLimit = 0; // disk budget for session files in bytes, 0 = unlimited
+
+// --- Session swap
+//     When the job of some session is finished, the KV cache of its sequence is saved into the swap dir with llama_state_seq_save_file().
+//     Files are named by the model fingerprint and the hash of the cached tokens. Each file is also indexed by hashes of its token prefixes
+//     taken every SWAP_ANCHOR tokens, so any later prompt starting with the same tokens could restore the longest matching part of the state
+//     from disk instead of evaluating the whole history again. Least recently used files are pruned to keep the total size within the budget.
+
+#define SWAP_ANCHOR 256 // step in tokens between prefixes indexed for each snapshot
+
+struct llama_snapshot {
+    std::string path;
+    std::vector<std::pair<uint64_t, size_t>> anchors; // [ prefix hash, prefix length ]
+    size_t size    = 0;
+    int64_t t_used = 0;
+};
+
+struct llama_swap {
+    std::unordered_map<uint64_t, llama_snapshot> files;  // [ hash of all tokens ] -> snapshot file
+    std::unordered_multimap<uint64_t, uint64_t> anchors; // [ hash of tokens prefix ] -> snapshot key
+};
+
+std::mutex swapMutex; // guards all the snapshot structures below
+std::unordered_map<std::string, llama_swap> swaps; // [ model fingerprint ] -> snapshots of the model
+std::unordered_map<std::string, std::pair<std::string, uint64_t>> sessionSnapshots; // [ session ID ] -> the latest snapshot of the session
+int64_t swapSize = 0; // total size of known snapshot files
+
+static const uint64_t HASH_SEED = 0xcbf29ce484222325ULL;
+
+// FNV-1a over token IDs, the order of tokens matters
+static uint64_t hash_token(uint64_t hash, llama_token token) {
+    const uint8_t * bytes = (const uint8_t *) &token;
+    for (size_t i = 0; i < sizeof(token); i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
     }
-/*
-    // debug message about similarity of saved session, if applicable
-    size_t n_matching_session_tokens = 0;
-    if (!isGPU && 
-        session_tokens.size()) {
+    return hash;
+}
 
-        for (llama_token id : session_tokens) {
-            if (n_matching_session_tokens >= embd_inp.size() || id != embd_inp[n_matching_session_tokens]) {
+// Hashes of the token prefixes at every SWAP_ANCHOR tokens and of the whole sequence
+static std::vector<std::pair<uint64_t, size_t>> snapshot_anchors(const llama_token * tokens, size_t n_tokens) {
+    std::vector<std::pair<uint64_t, size_t>> anchors;
+    uint64_t hash = HASH_SEED;
+    for (size_t i = 0; i < n_tokens; i++) {
+        hash = hash_token(hash, tokens[i]);
+        if ((i + 1) % SWAP_ANCHOR == 0 || i + 1 == n_tokens) {
+            anchors.push_back({ hash, i + 1 });
+        }
+    }
+    return anchors;
+}
+
+// Snapshots are valid only for the same model weights and the same KV cache layout
+static std::string model_fingerprint(int idx) {
+    char desc[128];
+    llama_model_desc(models[idx], desc, sizeof(desc));
+
+    std::string key = desc;
+    key += "|" + std::to_string(llama_model_n_params(models[idx]));
+    key += "|" + std::to_string(llama_model_size(models[idx]));
+    key += "|" + std::to_string(llama_n_vocab(models[idx]));
+    key += "|" + std::to_string(llama_n_embd(models[idx]));
+    key += "|" + std::to_string(llama_n_layer(models[idx]));
+    key += "|" + std::to_string(llama_n_ctx_train(models[idx]));
+    key += "|" + ::params[idx].cache_type_k + "|" + ::params[idx].cache_type_v;
+
+    uint64_t hash = HASH_SEED;
+    for (char c : key) {
+        hash = hash_token(hash, c);
+    }
+
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long) hash);
+    return hex;
+}
+
+static void add_snapshot(llama_swap & swap, uint64_t key, llama_snapshot && snapshot) {
+    for (auto & anchor : snapshot.anchors) {
+        swap.anchors.insert({ anchor.first, key });
+    }
+    ::swapSize += snapshot.size;
+    swap.files[key] = std::move(snapshot);
+}
+
+static void remove_snapshot(llama_swap & swap, uint64_t key) {
+    auto file = swap.files.find(key);
+    if (file == swap.files.end()) {
+        return;
+    }
+
+    for (auto & anchor : file->second.anchors) {
+        auto range = swap.anchors.equal_range(anchor.first);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (it->second == key) {
+                swap.anchors.erase(it);
                 break;
             }
-            n_matching_session_tokens++;
-        }
-        if (params[idx].prompt.empty() && n_matching_session_tokens == embd_inp.size()) {
-            fprintf(stderr, "%s: using full prompt from session file\n", __func__);
-        } else if (n_matching_session_tokens >= embd_inp.size()) {
-            fprintf(stderr, "%s: session file has exact match for prompt!\n", __func__);
-        } else if (n_matching_session_tokens < (embd_inp.size() / 2)) {
-            fprintf(stderr, "%s: warning: session file has low similarity to prompt (%zu / %zu tokens); will mostly be reevaluated\n",
-                __func__, n_matching_session_tokens, embd_inp.size());
-        } else {
-            fprintf(stderr, "%s: session file matches %zu / %zu tokens of prompt\n",
-                __func__, n_matching_session_tokens, embd_inp.size());
+        }
+    }
+
+    std::error_code err;
+    std::filesystem::remove(file->second.path, err);
+    ::swapSize -= file->second.size;
+    swap.files.erase(file);
+}
+
+// Remove least recently used files until the total size fits the budget
+static void prune_snapshots() {
+    while (::swapLimit > 0 && ::swapSize > ::swapLimit) {
+
+        llama_swap * oldestSwap = nullptr;
+        uint64_t oldest = 0;
+        int64_t t_oldest = INT64_MAX;
+
+        for (auto & swap : swaps) {
+            for (auto & file : swap.second.files) {
+                if (file.second.t_used < t_oldest) {
+                    oldestSwap = &swap.second;
+                    oldest = file.first;
+                    t_oldest = file.second.t_used;
+                }
+            }
         }
 
-        // remove any "future" tokens that we might have inherited from the previous session
-        // WAS: llama_kv_cache_tokens_rm(ctx, n_matching_session_tokens, -1);
-        llama_kv_cache_seq_rm(ctx, -1, n_matching_session_tokens, -1);
+        if (!oldestSwap) break;
+        remove_snapshot(*oldestSwap, oldest);
     }
+}
 
-    // if we will use the cache for the full prompt without reaching the end of the cache, force
-    // reevaluation of the last token token to recalculate the cached logits
-    if (!isGPU && 
-        !embd_inp.empty() && 
-        n_matching_session_tokens == embd_inp.size() &&
-        session_tokens.size() > embd_inp.size()) {
+// Build the index of snapshots already stored on disk for the model
+static llama_swap & model_swap(const std::string & fingerprint) {
 
-        session_tokens.resize(embd_inp.size() - 1);
+    auto it = swaps.find(fingerprint);
+    if (it != swaps.end()) {
+        return it->second;
     }
-*/
-    // group-attention state
-    // number of grouped KV tokens so far (used only if params.grp_attn_n > 1)
-    int ga_i = 0;
 
-    const int ga_n = ::params[idx].grp_attn_n;
-    const int ga_w = ::params[idx].grp_attn_w;
+    auto & swap = swaps[fingerprint];
 
-    if (ga_n != 1 && ga_n <= 0) return 0; // ERR: grp_attn_n must be positive
-    if (ga_n != 1 && (ga_w % ga_n != 0)) return 0; // ERR: grp_attn_w must be a multiple of grp_attn_n
+    std::error_code err;
+    const auto t_now = std::filesystem::file_time_type::clock::now();
 
-    // TODO: replace with ring-buffer
-    std::vector<llama_token> last_tokens(n_ctx);
-    std::fill(last_tokens.begin(), last_tokens.end(), 0);
+    for (auto & entry : std::filesystem::directory_iterator(::path_session, err)) {
 
-    int n_past             = 0;
-    int n_consumed         = 0;
-    ///// int n_session_consumed = 0;
-    ///// int n_past_guidance    = 0;
-    int guidance_offset    = 0; // TODO: Implement guidance
+        const std::string name = entry.path().filename().string();
+        if (name.size() != 16 + 1 + 16 + 3 || name.compare(0, 16, fingerprint) || name.compare(name.size() - 3, 3, ".kv")) {
+            continue;
+        }
 
-    ///// int n_batch            = ::params[idx].n_batch;
-    int n_remain           = ::params[idx].n_predict;
+        // header: magic, version and the number of tokens followed by tokens
+        FILE * file = fopen(entry.path().string().c_str(), "rb");
+        if (!file) continue;
 
-    std::vector<int>   input_tokens;  g_input_tokens  = &input_tokens;
-    std::vector<int>   output_tokens; g_output_tokens = &output_tokens;
-    ///// FIXME std::ostringstream output_ss;     g_output_ss     = &output_ss;
+        uint32_t header[3] = { 0, 0, 0 };
+        std::vector<llama_token> tokens;
 
-    std::vector<llama_token> embd;
-    std::vector<llama_token> embd_guidance;
+        bool ok = fread(header, sizeof(header), 1, file) == 1 && header[0] == LLAMA_STATE_SEQ_MAGIC && header[1] == LLAMA_STATE_SEQ_VERSION;
+        if (ok) {
+            tokens.resize(header[2]);
+            ok = fread(tokens.data(), sizeof(llama_token), tokens.size(), file) == tokens.size();
+        }
+        fclose(file);
 
-    struct llama_sampling_context * ctx_sampling = llama_sampling_init((const struct llama_sampling_params) sparams);
+        if (!ok || tokens.empty()) {
+            continue;
+        }
 
-    // -- fix hallucinations from previously polluted cache 
-    llama_kv_cache_clear(ctx);
+        llama_snapshot snapshot;
+        snapshot.path    = entry.path().string();
+        snapshot.anchors = snapshot_anchors(tokens.data(), tokens.size());
+        snapshot.size    = entry.file_size(err);
 
-    // -- MAIN LOOP --
+        // NB! Files from previous runs are older than anything used since the start, so their time is negative
+        snapshot.t_used  = -std::chrono::duration_cast<std::chrono::microseconds>(t_now - entry.last_write_time(err)).count();
 
-    while (n_remain && 
-        // n_past < (n_ctx - 4) && // FIXME
-        !stopInferenceFlags[idx]) { 
+        add_snapshot(swap, snapshot.anchors.back().first, std::move(snapshot));
+    }
 
-        // predict
-        if (!embd.empty()) {
+    prune_snapshots();
+    return swap;
+}
 
-            // Note: (n_ctx - 4) here is to match the logic for commandline prompt handling via
-            // --prompt or --file which uses the same value.
-            int max_embd_size = n_ctx - 4;
+// Find the snapshot with the longest prefix of tokens, if it is longer than n_min tokens
+// NB! Anchors of the file which is not known anymore are just skipped
+static llama_snapshot * find_snapshot(llama_swap & swap, const std::vector<llama_token> & tokens, size_t n_min, size_t & n_found) {
+    llama_snapshot * best = nullptr;
+    for (auto & anchor : snapshot_anchors(tokens.data(), tokens.size())) {
+        if (anchor.second <= n_min) continue;
+        auto range = swap.anchors.equal_range(anchor.first);
+        for (auto it = range.first; it != range.second; ++it) {
+            auto file = swap.files.find(it->second);
+            if (file == swap.files.end()) continue;
+            best    = &file->second;
+            n_found = anchor.second;
+        }
+    }
+    return best;
+}
 
-            // Ensure the input doesn't exceed the context size by truncating embd if necessary.
-            if ((int) embd.size() > max_embd_size) {
-                ///// const int skipped_tokens = (int) embd.size() - max_embd_size;
-                embd.resize(max_embd_size);
-            }
+// Restore the state with the longest prefix of tokens from disk, if it is longer than n_min tokens we already have in memory
+// The cache is updated with tokens of the restored sequence, which might be longer than the matched prefix
+// Returns true if the cache was replaced [ even with nothing, when the file was broken ]
+static bool load_snapshot(int idx, llama_seq_id seq, const std::vector<llama_token> & tokens, size_t n_min, std::vector<llama_token> & cache) {
 
-            if (ga_n == 1) {
+    if (::path_session.empty()) {
+        return false;
+    }
 
-                // infinite text generation via context shifting
-                // if we run out of context:
-                // - take the n_keep first tokens from the original prompt (via n_past)
-                // - take half of the last (n_ctx - n_keep) tokens and recompute the logits in batches
+    const std::string fingerprint = model_fingerprint(idx);
+    std::string path;
+    size_t n_found = 0;
 
-                if (n_past + (int) embd.size() + std::max<int>(0, guidance_offset) > n_ctx) {
+    {
+        std::lock_guard<std::mutex> lock(swapMutex);
+        auto & swap = model_swap(fingerprint);
 
-                    if (params.n_predict == -2) {
-                        break;
-                    }
+        auto file = find_snapshot(swap, tokens, n_min, n_found);
+        if (!file) {
+            return false;
+        }
 
-                    // WAS: const int n_left    = n_past - params.n_keep - 1;
-                    const int n_left    = n_past - params.n_keep;
-                    const int n_discard = n_left/2;
+        path = file->path;
+        file->t_used = ggml_time_us();
+    }
 
-                    llama_kv_cache_seq_rm (ctx, 0, params.n_keep            , params.n_keep + n_discard);
-                    llama_kv_cache_seq_add(ctx, 0, params.n_keep + n_discard, n_past, -n_discard);
+    std::error_code err;
+    std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), err);
 
-                    n_past -= n_discard;
+    llama_context * ctx = contexts[idx];
+    std::vector<llama_token> restored(llama_n_ctx(ctx) / ::pods[idx].slots.size());
+    size_t n_restored = 0;
 
-                    ///// if (ctx_guidance) {
-                    /////    n_past_guidance -= n_discard;
-                    ///// }
+    llama_kv_cache_seq_rm(ctx, seq, -1, -1);
+    cache.clear();
 
-                    path_session.clear();
-                }
+    // NB! Check tokens too, just in case of hash collisions
+    if (!llama_state_seq_load_file(ctx, path.c_str(), seq, restored.data(), restored.size(), &n_restored) ||
+        n_restored < n_found || !std::equal(restored.begin(), restored.begin() + n_found, tokens.begin())) {
 
-            } else {    
+        fprintf(stderr, "%s: error: failed to restore session state from '%s'\n", __func__, path.c_str());
+        llama_kv_cache_seq_rm(ctx, seq, -1, -1);
+        return true;
+    }
 
-                // context extension via Self-Extend
-                while (n_past >= ga_i + ga_w) {
-                    const int ib = (ga_n*ga_i)/ga_w;
-                    const int bd = (ga_w/ga_n)*(ga_n - 1);
-                    const int dd = (ga_w/ga_n) - ib*bd - ga_w;
+    restored.resize(n_restored);
+    cache = std::move(restored);
+    return true;
+}
 
-                    llama_kv_cache_seq_add(ctx, 0, ga_i,                n_past,              ib*bd);
-                    llama_kv_cache_seq_div(ctx, 0, ga_i + ib*bd,        ga_i + ib*bd + ga_w, ga_n);
-                    llama_kv_cache_seq_add(ctx, 0, ga_i + ib*bd + ga_w, n_past + ib*bd,      dd);
+// Save the slot sequence state held within KV cache to disk, replacing the previous snapshot of the same session
+static void save_snapshot(int idx, llama_seq_id seq, const std::string & sessionID, const std::vector<llama_token> & cache) {
 
-                    n_past -= bd;
+    if (::path_session.empty() || sessionID.empty() || cache.empty()) {
+        return;
+    }
 
-                    ga_i += ga_w/ga_n;
-                }
-            }
-/*
-            // try to reuse a matching prefix from the loaded session instead of re-eval (via n_past)
-            if (n_session_consumed < (int) session_tokens.size()) {
-                size_t i = 0;
-                for ( ; i < embd.size(); i++) {
-                    if (embd[i] != session_tokens[n_session_consumed]) {
-                        session_tokens.resize(n_session_consumed);
-                        break;
-                    }
+    const std::string fingerprint = model_fingerprint(idx);
 
-                    n_past++;
-                    n_session_consumed++;
+    llama_snapshot snapshot;
+    snapshot.anchors = snapshot_anchors(cache.data(), cache.size());
 
-                    if (n_session_consumed >= (int) session_tokens.size()) {
-                        ++i;
-                        break;
-                    }
-                }
-                if (i > 0) {
-                    embd.erase(embd.begin(), embd.begin() + i);
-                }
-            }
-*/ 
-            for (int i = 0; i < (int) embd.size(); i += params.n_batch) {
-                
-                int n_eval = (int) embd.size() - i;
-                if (n_eval > params.n_batch) {
-                    n_eval = params.n_batch;
-                }
+    const uint64_t key = snapshot.anchors.back().first;
 
-                if (llama_decode(ctx, llama_batch_get_one(&embd[i], n_eval, n_past, 0))) {
-                    return 1;
-                }
+    char name[64];
+    snprintf(name, sizeof(name), "%s-%016llx.kv", fingerprint.c_str(), (unsigned long long) key);
+    snapshot.path = (std::filesystem::path(::path_session) / name).string();
 
-                n_past += n_eval;
+    std::lock_guard<std::mutex> lock(swapMutex);
+    auto & swap = model_swap(fingerprint);
 
-                // Display total tokens alongside total time
-                if (params.n_print > 0 && n_past % params.n_print == 0) {
-                }
-            }
-/*
-            if (!embd.empty() && !path_session.empty()) {
-                session_tokens.insert(session_tokens.end(), embd.begin(), embd.end());
-                n_session_consumed = session_tokens.size();
-            } */
-        }
+    // the same tokens are already there
+    remove_snapshot(swap, key);
 
-        embd.clear();
-        embd_guidance.clear();
+    snapshot.size = llama_state_seq_save_file(contexts[idx], snapshot.path.c_str(), seq, cache.data(), cache.size());
+    if (!snapshot.size) {
+        fprintf(stderr, "%s: error: failed to save session state into '%s'\n", __func__, snapshot.path.c_str());
+        return;
+    }
 
-        if ((int) embd_inp.size() <= n_consumed && !is_interacting) {
-/*            
-            // optionally save the session on first sample (for faster prompt loading next time)
-            if (!path_session.empty() && need_to_save_session && !params.prompt_cache_ro) {
-                need_to_save_session = false;
-                llama_save_session_file(ctx, path_session.c_str(), session_tokens.data(), session_tokens.size());
+    snapshot.t_used = ggml_time_us();
+    add_snapshot(swap, key, std::move(snapshot));
 
-                LOG("saved session to %s\n", path_session.c_str());
-            }
-*/
-            llama_token id;
-            if (sparams.janus) {
-                id = sample_janus_token(
-                    ctx,
-                    sparams,
-                    last_tokens,
-                    embd_inp.size(),
-                    n_past,
-                    ::params[idx].n_predict);
-            } else {
-                id = llama_sampling_sample(ctx_sampling, ctx, ctx_guidance);
-            }
+    // the newer state of the session continues the previous one, so the older file is not needed anymore
+    auto prev = sessionSnapshots.find(sessionID);
+    if (prev != sessionSnapshots.end() && prev->second.second != key) {
+        remove_snapshot(swaps[prev->second.first], prev->second.second);
+    }
 
-            // we still need to maintain this for Janus Sampling
-            last_tokens.erase(last_tokens.begin());
-            last_tokens.push_back(id);
+    sessionSnapshots[sessionID] = { fingerprint, key };
+    prune_snapshots();
+}
 
-            llama_sampling_accept(ctx_sampling, ctx, id, true);
+static void serve_pod(int idx);
+static void save_lookup(int idx);
 
-            embd.push_back(id); // add it to the context
-            --n_remain; // decrement remaining sampling budget
+// -- init_draft
 
-        } else {
+static void init_draft(int idx, llama_context_params defaults) {
 
-            // some user input remains from prompt or interaction, forward it to processing
-            while ((int) embd_inp.size() > n_consumed) {
-                embd.push_back(embd_inp[n_consumed]);
+    gpt_params draftParams = ::params[idx];
+    draftParams.model = ::params[idx].model_draft;
+    if (::params[idx].n_gpu_layers_draft >= 0) {
+        draftParams.n_gpu_layers = ::params[idx].n_gpu_layers_draft;
+    }
 
-                // push the prompt in the sampling context in order to apply repetition penalties later
-                // for the prompt, we don't apply grammar rules
-                llama_sampling_accept(ctx_sampling, ctx, embd_inp[n_consumed], false);
+    llama_model_params settings = llama_model_params_from_gpt_params(draftParams);
 
-                ++n_consumed;
-                if ((int) embd.size() >= params.n_batch) {
-                    break;
-                }
-            }
-        }
+    settings.main_gpu     = draftParams.main_gpu;
+    settings.n_gpu_layers = draftParams.n_gpu_layers;
+    settings.tensor_split = draftParams.tensor_split;
 
-        // -- update job text buffer
-        mutex.lock();
-        for (auto id : embd) {
-            jobs[jobID] = jobs[jobID] + llama_token_to_piece(ctx, id);
-        }
-        mutex.unlock();
+    llama_model * model = acquire_model(draftParams, settings);
+    if (model == NULL) {
+        fprintf(stderr, "%s: error: failed to load draft model '%s'\n", __func__, draftParams.model.c_str());
+        return;
+    }
 
-        // end of text token
-        if (!embd.empty() && llama_token_is_eog(model, embd.back())) {
-            break;
-        }
+    // drafts are verified by token IDs, so both models should tokenize the text the same way
+    auto target = models[idx];
+    if (llama_n_vocab(model) != llama_n_vocab(target) ||
+        llama_token_bos(model) != llama_token_bos(target) ||
+        llama_token_eos(model) != llama_token_eos(target)) {
+        fprintf(stderr, "%s: error: draft model '%s' vocab does not match the main model\n", __func__, draftParams.model.c_str());
+        release_model(model);
+        return;
     }
-/*
-    if (!path_session.empty() && params.prompt_cache_all && !params.prompt_cache_ro) {
-        LOG_TEE("\n%s: saving final output to session file '%s'\n", __func__, path_session.c_str());
-        llama_save_session_file(ctx, path_session.c_str(), session_tokens.data(), session_tokens.size());
+
+    if (::params[idx].n_threads_draft > 0) {
+        defaults.n_threads       = ::params[idx].n_threads_draft;
+        defaults.n_threads_batch = ::params[idx].n_threads_draft;
     }
-*/ 
-    const llama_timings timings = llama_get_timings(ctx);
 
-    mutex.lock();
-    promptEvals[jobID] = timings.t_p_eval_ms / timings.n_p_eval;
-    ::timings[jobID] = timings.t_eval_ms / timings.n_eval;
-    mutex.unlock();
+    llama_context * ctx = llama_new_context_with_model(model, defaults);
+    if (ctx == NULL) {
+        fprintf(stderr, "%s: error: failed to create context with draft model '%s'\n", __func__, draftParams.model.c_str());
+        release_model(model);
+        return;
+    }
 
-    return timings.n_p_eval + timings.n_eval;
+    draftModels[idx] = model;
+    draftContexts[idx] = ctx;
 }
 
-// lock() is safer that lock_shared() - https://stackoverflow.com/questions/59809405/shared-mutex-in-c
+// -- init_lookup
 
-const char * statusCPP(const std::string & jobID) {
-    mutex.lock();
-    const char * res = jobs[jobID].c_str();
-    mutex.unlock();
-    return res;
+static void init_lookup(int idx) {
+
+    // NB! The static cache might be huge, so it's mapped into memory read-only instead of loading
+    auto load = [](const std::string & path, llama_ngram_cache & cache, bool map) {
+        if (path.empty() || !std::filesystem::exists(path)) return;
+        try {
+            cache = map ? llama_ngram_cache_map(path) : llama_ngram_cache_load(path);
+        } catch (const std::exception & err) {
+            fprintf(stderr, "init_lookup: error: failed to load n-gram cache '%s': %s\n", path.c_str(), err.what());
+        }
+    };
+
+    load(::params[idx].lookup_cache_static, ::pods[idx].ngramStatic, true);
+    load(::params[idx].lookup_cache_dynamic, ::pods[idx].ngramDynamic, false);
+}
+
+// -- init_context
+
+struct llama_context * init_context(int idx) {
+
+    auto modelName = params[idx].model.c_str();
+
+    // -- initialize the model
+
+    // WAS: llama_model_params settings = llama_model_default_params();
+    llama_model_params /* model_params */ settings = llama_model_params_from_gpt_params(::params[idx]);
+
+    settings.main_gpu     = ::params[idx].main_gpu;
+    settings.n_gpu_layers = ::params[idx].n_gpu_layers;
+    settings.tensor_split = ::params[idx].tensor_split;
+
+    llama_model * model = acquire_model(::params[idx], settings);
+    if (model == NULL) {
+        fprintf(stderr, "%s: error: failed to load model '%s'\n", __func__, modelName);
+        // return std::make_tuple(nullptr, nullptr);
+        return NULL;
+    }
+
+    models[idx] = model;
+
+    // -- initialize the context
+
+    // WAS: auto defaults = llama_context_default_params();
+    llama_context_params /* ctx_params */ defaults = llama_context_params_from_gpt_params(params[idx]);
+
+    // NB! Each slot has its own part of context with the full size requested for the pod
+    defaults.n_ctx           = ::params[idx].n_ctx * ::params[idx].n_parallel;
+    defaults.n_seq_max       = ::params[idx].n_parallel;
+    defaults.seed            = ::params[idx].seed;
+    defaults.n_threads       = ::params[idx].n_threads;
+    defaults.n_threads_batch = ::params[idx].n_threads_batch;
+
+    // TODO: Determine best batch size for GPU (and maybe different depending on VRAM size)
+    // NB! It crashes with batch of 32/64 and go loop with 128. So use batching of 256 or more
+
+    bool isGPU = ::params[idx].n_gpu_layers > 0 ? true : false;
+
+    if (::params[idx].n_batch > 0 && ::params[idx].n_batch <= ::params[idx].n_ctx) {
+        defaults.n_batch = ::params[idx].n_batch;
+    } else if (isGPU) {
+        defaults.n_batch = 512;
+    } else {
+        defaults.n_batch = ::params[idx].n_ctx;
+    }
+
+    llama_context * ctx = llama_new_context_with_model(model, defaults);
+    if (ctx == NULL) {
+        fprintf(stderr, "%s: error: failed to create context with model '%s'\n", __func__, modelName);
+        release_model(model);
+        models[idx] = NULL;
+        // return std::make_tuple(nullptr, nullptr);
+        return NULL;
+    }
+
+    contexts[idx] = ctx;
+
+    // NB! Only the CPU backend polls the callback, GPU backends finish the whole graph anyway
+    llama_set_abort_callback(ctx, abort_decode, &::pods[idx]);
+
+    // -- optional draft model for speculative decoding, it should share the vocab with the main one
+    //    NB! Self-Extend moves tokens within the cache, so it's not compatible with drafting
+
+    if (!::params[idx].model_draft.empty() && ::params[idx].grp_attn_n == 1) {
+        init_draft(idx, defaults);
+    }
+
+    // -- compute threads are started once for the pod instead of each graph, both contexts are used
+    //    by the serving thread only, so they share the same pool
+
+    int n_threads = std::max(::params[idx].n_threads, ::params[idx].n_threads_batch);
+    if (draftContexts[idx]) {
+        n_threads = std::max(n_threads, ::params[idx].n_threads_draft);
+    }
+
+    // NB! The pool is NULL on Windows, then contexts are attached to nothing and compute graphs the old way
+    auto & cpus = ::pods[idx].cpus;
+    ::pods[idx].threadpool = ggml_threadpool_new(n_threads, cpus.empty() ? NULL : cpus.data(), (int) cpus.size());
+    llama_attach_threadpool(ctx, ::pods[idx].threadpool);
+    if (draftContexts[idx]) {
+        llama_attach_threadpool(draftContexts[idx], ::pods[idx].threadpool);
+    }
+
+    // -- n-gram caches for lookup decoding, the draft model is preferred when both are configured
+
+    if (draftContexts[idx]) {
+        ::pods[idx].lookup = false;
+    }
+
+    if (::pods[idx].lookup) {
+        init_lookup(idx);
+    }
+
+    // -- Janus tables are prepared once here instead of within each request
+    //    NB! Tables are cached next to the model file and reused after restart if the vocab is the same
+
+    if (::sparams[idx].janus) {
+        ::pods[idx].janus = acquireJanus(model, ::sparams[idx], ::params[idx].model + ".janus", debug);
+    }
+
+    // -- start serving loop for all slots of the pod
+
+    ::pods[idx].slots.resize(::params[idx].n_parallel);
+    for (int i = 0; i < ::params[idx].n_parallel; i++) {
+        ::pods[idx].slots[i].id = i;
+    }
+
+    ::pods[idx].server = std::thread(serve_pod, idx);
+
+    // return std::make_tuple(model, lctx);
+    return ctx;
+}
+
+// Stop the serving loop of the pod once it has nothing to do, then free its contexts, compute threads and models
+void free_context(int idx) {
+    llama_pod & pod = ::pods[idx];
+    if (!pod.server.joinable()) {
+        return;
+    }
+
+    pod.mutex.lock();
+    pod.shutdown = true;
+    pod.mutex.unlock();
+    pod.ready.notify_one();
+    pod.server.join();
+
+    if (pod.lookup && !::params[idx].lookup_cache_dynamic.empty()) {
+        save_lookup(idx);
+    }
+
+    // NB! Contexts are freed before the pool they are attached to
+    if (pod.embed_ctx) {
+        llama_free(pod.embed_ctx);
+        pod.embed_ctx = nullptr;
+    }
+    if (draftContexts[idx]) {
+        llama_free(draftContexts[idx]);
+        release_model(draftModels[idx]);
+        draftContexts[idx] = NULL;
+        draftModels[idx] = NULL;
+    }
+    llama_free(contexts[idx]);
+    contexts[idx] = NULL;
+
+    ggml_threadpool_free(pod.threadpool);
+    pod.threadpool = nullptr;
+
+    release_model(models[idx]);
+    models[idx] = NULL;
+    pod.janus.reset();
+}
+
+// Place the job into the pod queue, the serving loop sets its promise when the job is done
+static void queue_job(int idx, llama_job * job, int64_t timeout) {
+    tenantsMutex.lock();
+    auto weight = tenantWeights.find(job->tenant);
+    if (weight != tenantWeights.end()) {
+        job->weight = weight->second;
+    }
+    tenantsMutex.unlock();
+
+    job->t_queued_us = ggml_time_us();
+    if (timeout > 0) {
+        job->t_deadline_us = job->t_queued_us + timeout * 1000;
+    }
+
+    ::pods[idx].mutex.lock();
+    ::pods[idx].queue.push_back(job);
+    ::pods[idx].mutex.unlock();
+    ::pods[idx].ready.notify_one();
+}
+
+// Place the job into the pod queue and wait while the serving loop will process it
+// idx - index of pod / context / params to do processing within
+// choices - number of outputs sampled from the same prompt, others are available as jobID#1, jobID#2, etc
+// timeout - milliseconds for the job to be done, it's aborted after that [ zero = no limit ]
+// Returns total number of tokens processed for the first choice [ prompt + output ]
+int64_t do_inference(
+
+    int idx, 
+    struct llama_context * ctx, 
+    const std::string & jobID, 
+    const std::string & sessionID, 
+    const std::string & prompt,
+    const std::string & grammar,
+    const std::string & schema,
+    int priority,
+    const std::string & tenant,
+    int choices,
+    int64_t timeout
+
+) {
+
+    (void) ctx; // the pod context is owned by the serving loop
+
+    llama_job job;
+    job.jobID     = jobID;
+    job.sessionID = sessionID;
+    job.prompt    = prompt;
+    job.grammar   = grammar;
+    job.schema    = schema;
+    job.priority  = priority;
+    job.tenant    = tenant;
+    job.record    = create_job(jobID);
+
+    // other choices are forked into other slots of the same pod, so there can't be more of them than slots
+    // NB! The job asking for more is refused as aborted rather than served with fewer choices silently
+    if (choices > (int) ::pods[idx].slots.size()) {
+        fprintf(stderr, "%s: error: job '%s' asks for %d choices, while the pod has only %d slots\n",
+            __func__, jobID.c_str(), choices, (int) ::pods[idx].slots.size());
+        std::lock_guard<std::shared_mutex> lock(job.record->mutex);
+        job.record->aborted = true;
+        job.record->t_finished_us = ggml_time_us();
+        return 0;
+    }
+
+    std::vector<std::unique_ptr<llama_job>> branches;
+    std::vector<std::future<int64_t>> forked;
+    for (int k = 1; k < choices; k++) {
+        auto branch = std::make_unique<llama_job>();
+        branch->jobID    = jobID + "#" + std::to_string(k);
+        branch->parentID = jobID;
+        branch->record   = create_job(branch->jobID);
+        forked.push_back(branch->done.get_future());
+        job.branches.push_back(branch.get());
+        branches.push_back(std::move(branch));
+    }
+
+    auto result = job.done.get_future();
+    queue_job(idx, &job, timeout);
+
+    const int64_t n_tokens = result.get();
+
+    // NB! Branches live here until the serving loop is done with all of them
+    for (auto & done : forked) {
+        done.get();
+    }
+
+    return n_tokens;
+}
+
+// Length of the text prefix without the trailing incomplete UTF-8 sequence
+static size_t utf8_complete(const std::string & text) {
+    const size_t size = text.size();
+    for (size_t i = 1; i <= 4 && i <= size; i++) {
+        const uint8_t c = text[size - i];
+        if ((c & 0xC0) == 0x80) continue; // continuation byte
+        const size_t len = (c & 0x80) == 0x00 ? 1 : (c & 0xE0) == 0xC0 ? 2 : (c & 0xF0) == 0xE0 ? 3 : (c & 0xF8) == 0xF0 ? 4 : 1;
+        return len > i ? size - i : size;
+    }
+    return size;
+}
+
+// Append the piece of the output token to the job text buffer
+// NB! Bytes of multi-byte UTF-8 characters split between tokens are held within the slot until the character is complete,
+//     so readers always see valid text. Only the appending itself is done under the lock
+static void update_job(const llama_model * model, llama_slot & slot, llama_token id) {
+
+    // pieces are copied right from the vocab cache, the buffer is enough for almost any token
+    char piece[128];
+    const int n_piece = llama_token_to_piece(model, id, piece, sizeof(piece), true);
+    if (n_piece >= 0) {
+        slot.pending.append(piece, n_piece);
+    } else {
+        std::vector<char> buf(-n_piece);
+        llama_token_to_piece(model, id, buf.data(), buf.size(), true);
+        slot.pending.append(buf.data(), buf.size());
+    }
+
+    const size_t n_ready = utf8_complete(slot.pending);
+
+    auto & record = *slot.job->record;
+    record.mutex.lock();
+    if (n_ready > 0) {
+        record.output.append(slot.pending, 0, n_ready);
+    }
+    record.outputTokenCount++;
+    record.mutex.unlock();
+
+    slot.pending.erase(0, n_ready);
+}
+
+// Length of the common prefix of two token sequences
+static size_t common_prefix(const std::vector<llama_token> & a, const std::vector<llama_token> & b) {
+    size_t i = 0;
+    while (i < a.size() && i < b.size() && a[i] == b[i]) {
+        i++;
+    }
+    return i;
+}
+
+// Common prefix of the cached sequence and the prompt with n_evicted tokens after n_keep first ones dropped,
+// the same way they were dropped from the sliding window of the slot
+static size_t window_prefix(const std::vector<llama_token> & cache, const std::vector<llama_token> & prompt, size_t n_keep, size_t n_evicted) {
+    if (common_prefix(cache, prompt) < n_keep || n_keep + n_evicted > prompt.size()) {
+        return 0;
+    }
+    size_t i = n_keep;
+    while (i < cache.size() && i + n_evicted < prompt.size() && cache[i] == prompt[i + n_evicted]) {
+        i++;
+    }
+    return i;
+}
+
+// --- Compiled grammars
+//     Most clients send the same few grammars or JSON schemas again and again, so they are converted and parsed once.
+//     Recently used ones are kept within LRU cache keyed by the hash of the source text
+
+#define GRAMMAR_CACHE 64 // max compiled grammars kept in memory
+
+struct llama_compiled_grammar {
+    std::string source;                 // grammar or JSON schema the entry was compiled from
+    std::string gbnf;                   // grammar text [ converted from the schema ]
+    grammar_parser::parse_state parsed;
+    llama_grammar * grammar = nullptr;  // initial state, never changed and copied for each job
+
+    ~llama_compiled_grammar() {
+        if (grammar) llama_grammar_free(grammar);
+    }
+};
+
+std::mutex compiledMutex;
+std::list<std::shared_ptr<const llama_compiled_grammar>> compiledList; // most recently used first
+std::unordered_map<uint64_t, std::list<std::shared_ptr<const llama_compiled_grammar>>::iterator> compiledGrammars; // [ source hash ] -> entry
+
+// Returns NULL if the grammar can't be parsed or the schema is not supported
+static std::shared_ptr<const llama_compiled_grammar> compile_grammar(const std::string & grammar, const std::string & schema) {
+
+    // schemas and grammars should never meet within the same key
+    const std::string source = schema.empty() ? "gbnf:" + grammar : "json:" + schema;
+    const uint64_t hash = std::hash<std::string>{}(source);
+
+    {
+        std::lock_guard<std::mutex> lock(compiledMutex);
+        auto it = compiledGrammars.find(hash);
+        if (it != compiledGrammars.end() && (*it->second)->source == source) {
+            compiledList.splice(compiledList.begin(), compiledList, it->second);
+            return *it->second;
+        }
+    }
+
+    auto compiled = std::make_shared<llama_compiled_grammar>();
+    compiled->source = source;
+
+    try {
+        compiled->gbnf = schema.empty() ? grammar : json_schema_to_grammar(nlohmann::ordered_json::parse(schema));
+    } catch (const std::exception & err) {
+        fprintf(stderr, "%s: error: failed to convert JSON schema: %s\n", __func__, err.what());
+        return nullptr;
+    }
+
+    compiled->parsed = grammar_parser::parse(compiled->gbnf.c_str());
+
+    // will be empty (default) if there are parse errors
+    if (compiled->parsed.rules.empty() || compiled->parsed.symbol_ids.count("root") == 0) {
+        fprintf(stderr, "%s: error: failed to parse grammar\n", __func__);
+        return nullptr;
+    }
+
+    std::vector<const llama_grammar_element *> rules(compiled->parsed.c_rules());
+
+    try {
+        compiled->grammar = llama_grammar_init(rules.data(), rules.size(), compiled->parsed.symbol_ids.at("root"));
+    } catch (const std::exception & err) {
+        fprintf(stderr, "%s: error: %s\n", __func__, err.what());
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(compiledMutex);
+
+    auto it = compiledGrammars.find(hash);
+    if (it != compiledGrammars.end()) {
+        compiledList.erase(it->second);
+    } else if (compiledList.size() >= GRAMMAR_CACHE) {
+        compiledGrammars.erase(std::hash<std::string>{}(compiledList.back()->source));
+        compiledList.pop_back();
+    }
+
+    compiledList.push_front(compiled);
+    compiledGrammars[hash] = compiledList.begin();
+
+    return compiled;
+}
+
+static std::shared_ptr<llama_grammar_masks> acquire_masks(const llama_model * model, const std::string & grammar);
+static int64_t embed_texts(int idx, const char * const * texts, int n, float * out);
+static bool evict_slot(int idx, llama_slot & slot, int n_discard);
+static void release_branches(llama_job * job);
+
+// Mark the job which could not be started at all, pollers see it as finished without any output
+static void fail_job(llama_job * job, const char * error) {
+    std::lock_guard<std::shared_mutex> lock(job->record->mutex);
+    job->record->error = error;
+    job->record->t_finished_us = ggml_time_us();
+}
+
+// Each job gets its own RNG seed, so jobs started within the same second never sample the same stream
+static uint32_t job_seed() {
+    static const uint32_t base = std::random_device{}() ^ (uint32_t) time(NULL);
+    static std::atomic<uint32_t> counter{0};
+    return base + counter.fetch_add(1) * 0x9E3779B9u;
+}
+
+// Tokenize the job prompt and place it into the idle slot, returns false if the job can't be done
+// NB! The slot with the longest prompt prefix already held within KV cache is preferred,
+//     so the next turn of the same chat evaluates only new tokens instead of the whole history
+static bool start_slot(int idx, llama_job * job) {
+
+    llama_context * ctx = contexts[idx];
+    auto model = models[idx];
+
+    gpt_params & params = ::params[idx];
+    llama_sampling_params & sparams = ::sparams[idx];
+
+    const int n_ctx = llama_n_ctx(ctx) / ::pods[idx].slots.size(); // context size of each slot
+
+    const uint32_t seed = job_seed();
+    job->record->mutex.lock();
+    job->record->seed = seed;
+    job->record->mutex.unlock();
+
+    // tokenize the prompt
+    const bool add_bos = llama_should_add_bos_token(model);
+    std::vector<llama_token> embd_inp;
+    embd_inp = ::llama_tokenize(ctx, job->prompt, add_bos, true);
+
+    // Should not run without any tokens
+    if (embd_inp.empty()) {
+        embd_inp.push_back(llama_token_bos(model)); // FIXME
+    }
+
+    // number of tokens to keep when resetting context
+    int n_keep = params.n_keep;
+    if (n_keep < 0 || n_keep > (int) embd_inp.size() /* || params.instruct || params.chatml */ ) {
+        n_keep = (int) embd_inp.size();
+    } else {
+        n_keep += add_bos; // always keep the BOS token
+    }
+
+    // a few first tokens are attended heavily anyway, the sliding window would break the model without them
+    if (params.n_window > 0) {
+        n_keep = std::min(std::max(n_keep, WINDOW_SINK), (int) embd_inp.size());
+    }
+
+    // -- DEBUG
+
+    if (strstr(::debug, "tokenizer")) {
+
+        fprintf(stderr, "\n\n=== ADD_BOS = %d ===", add_bos);
+        fprintf(stderr, "\n\n=== PROMPT ===\n\n%s", job->prompt.c_str());
+
+        fprintf(stderr, "\n\n=== IDS ===\n\n");
+        for(size_t i = 0; i < embd_inp.size(); i++) {
+            fprintf(stderr, "%d, ", embd_inp.data()[i]);
+        }
+
+        fprintf(stderr, "\n\n=== TOKENS ===\n\n");
+        for(size_t i = 0; i < embd_inp.size(); i++) {
+            auto id = embd_inp.data()[i];
+            fprintf(stderr, " #%d ", id);
+            if (id == 13) fprintf(stderr, "{\\n}\n");
+            else if (id == 271) fprintf(stderr, "{\\n\\n}\n\n");
+            else if (id == 1) fprintf(stderr, "{ BOS #1 }");
+            else if (id == 2) fprintf(stderr, "{ EOS #2 }");
+            else if (id == 128000) fprintf(stderr, "<|begin_of_text|>");
+            else if (id == 128001) fprintf(stderr, "<|end_of_text|>");
+            else if (id == 128006) fprintf(stderr, "<|start_header_id|>");
+            else if (id == 128007) fprintf(stderr, "<|end_header_id|>");
+            else if (id == 128009) fprintf(stderr, "<|eot_id|>");
+            else if (id >= 128000) fprintf(stderr, "{ #%d }", id);
+            else fprintf(stderr, "{%s}",  llama_token_to_piece(ctx, embd_inp.data()[i]).c_str());
+        }
+    }
+
+    job->record->mutex.lock();
+    job->record->promptTokenCount = embd_inp.size();
+    job->record->mutex.unlock();
+
+    // FIXME: Process the longer context properly and return some meaningful HTTP code to the front-end
+
+    if ((int) embd_inp.size() > (n_ctx - 4) && (params.n_window <= 0 || params.grp_attn_n != 1 || n_keep > n_ctx/2)) {
+        fprintf(stderr, "%s: error: prompt is too long (%d tokens, max %d)\n", __func__, (int) embd_inp.size(), n_ctx - 4);
+        fail_job(job, "prompt is too long");
+        return false;
+    }
+
+    const int ga_n = params.grp_attn_n;
+    const int ga_w = params.grp_attn_w;
+
+    if (ga_n != 1 && ga_n <= 0) { fail_job(job, "grp_attn_n must be positive"); return false; }
+    if (ga_n != 1 && (ga_w % ga_n != 0)) { fail_job(job, "grp_attn_w must be a multiple of grp_attn_n"); return false; }
+
+    // -- select the idle slot with the longest cached prefix, or the least recently used one
+    // NB! The sliding window of the slot might have lost the older part of the chat, so the prompt is matched without it
+
+    llama_slot * best = nullptr;
+    size_t n_best = 0;
+    bool windowed = false;
+
+    for (auto & candidate : ::pods[idx].slots) {
+        if (candidate.job) continue;
+        size_t n_common = common_prefix(candidate.cache_tokens, embd_inp);
+        bool evicted = false;
+        if (candidate.n_evicted > 0) {
+            const size_t n_window = window_prefix(candidate.cache_tokens, embd_inp, n_keep, candidate.n_evicted);
+            if (n_window > n_common) {
+                n_common = n_window;
+                evicted = true;
+            }
+        }
+        if (!best || n_common > n_best || (n_common == n_best && candidate.t_last_us < best->t_last_us)) {
+            best = &candidate;
+            n_best = n_common;
+            windowed = evicted;
+        }
+    }
+
+    if (!best) { fail_job(job, "no idle slots"); return false; } // should never happen while admitting no more jobs than idle slots
+    llama_slot & slot = *best;
+
+    size_t n_dropped = 0; // tokens dropped from the prompt after n_keep first ones
+    if (windowed) {
+        embd_inp.erase(embd_inp.begin() + n_keep, embd_inp.begin() + n_keep + slot.n_evicted);
+        n_dropped = slot.n_evicted;
+    } else {
+        slot.n_evicted = 0;
+    }
+
+    // -- the long chat does not fit the sliding window anymore, so the oldest messages are evicted in whole window steps
+    //    and the cached part of the slot is shifted the same way instead of evaluating the whole window again
+
+    if ((int) embd_inp.size() > (n_ctx - 4)) {
+        const int n_over = (int) embd_inp.size() - (n_ctx - 4);
+        const int n_discard = std::min((n_over + params.n_window - 1) / params.n_window * params.n_window, (int) embd_inp.size() - n_keep - 1);
+
+        bool evicted = false;
+        if ((int) n_best > n_keep + n_discard) {
+            slot.n_keep = n_keep;
+            evicted = evict_slot(idx, slot, n_discard);
+        }
+
+        if (evicted) {
+            llama_kv_cache_defrag(ctx); // the new part of the prompt needs contiguous cells, so the hole should be closed
+        } else {
+            slot.n_evicted += n_discard;
+        }
+
+        embd_inp.erase(embd_inp.begin() + n_keep, embd_inp.begin() + n_keep + n_discard);
+        n_dropped += n_discard;
+        n_best = common_prefix(slot.cache_tokens, embd_inp);
+    }
+
+    // -- grammars and schemas are compiled once and cached, each job gets only its own copy of the grammar state
+
+    std::shared_ptr<const llama_compiled_grammar> compiled;
+    if (!job->grammar.empty() || !job->schema.empty()) {
+        compiled = compile_grammar(job->grammar, job->schema);
+        if (!compiled) {
+            fail_job(job, "wrong grammar or schema");
+            return false;
+        }
+    }
+
+    auto ctx_sampling = llama_sampling_init(sparams);
+
+    if (compiled) {
+        ctx_sampling->grammar = llama_grammar_copy(compiled->grammar);
+        ctx_sampling->masks = acquire_masks(model, compiled->gbnf);
+    }
+
+    // Self-Extend moves tokens within the cache, so positions do not match the tokens anymore
+    if (ga_n != 1) {
+        n_best = 0;
+    } else {
+        // the longer prefix might be still stored on disk after the session was evicted from memory
+        // NB! The restored sequence follows the prompt, so it has lost exactly the tokens dropped from it, whatever was evicted from the slot before
+        if (load_snapshot(idx, slot.id, embd_inp, n_best, slot.cache_tokens)) {
+            slot.n_evicted = n_dropped;
+        }
+        n_best = common_prefix(slot.cache_tokens, embd_inp);
+    }
+
+    // we need to evaluate at least the last token of the prompt to get logits
+    if (n_best >= embd_inp.size()) {
+        n_best = embd_inp.size() - 1;
+    }
+
+    slot.job      = job;
+    slot.embd_inp = std::move(embd_inp);
+    slot.n_keep   = n_keep;
+
+    if (::pods[idx].lookup) {
+        slot.lookup_inp = slot.embd_inp;
+        slot.ngram_context.clear();
+        llama_ngram_cache_update(slot.ngram_context, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, slot.lookup_inp, slot.lookup_inp.size(), false);
+    }
+
+    slot.last_tokens.assign(n_ctx, 0);
+
+    slot.ctx_sampling = ctx_sampling;
+    slot.ctx_sampling->rng.seed(seed);
+
+    slot.sampled    = 0;
+    slot.i_batch    = -1;
+    slot.n_past     = n_best;
+    slot.n_consumed = n_best;
+    slot.n_remain   = params.n_predict;
+    slot.n_output   = 0;
+    slot.n_cached   = n_best;
+    slot.ga_i       = 0;
+    slot.n_drafted  = 0;
+    slot.n_accepted = 0;
+
+    slot.t_start_us  = ggml_time_us();
+    slot.t_prompt_us = 0;
+    slot.t_last_us   = slot.t_start_us;
+
+    // -- drop the rest of the previous sequence from the cache, the common prefix is reused as is
+    llama_kv_cache_seq_rm(ctx, slot.id, n_best, -1);
+    slot.cache_tokens.resize(n_best);
+
+    // the reused prompt part is not evaluated again, but still counted for penalties
+    for (size_t i = 0; i < n_best; i++) {
+        llama_sampling_accept(slot.ctx_sampling, ctx, slot.embd_inp[i], false);
+    }
+
+    slot.pending.clear();
+
+    return true;
+}
+
+// Write the dynamic n-gram cache of the pod into the temp file first, so the file is never seen half-written
+static void save_lookup(int idx) {
+    std::string path = ::params[idx].lookup_cache_dynamic + ".tmp";
+    std::error_code err;
+    // NB! The disk might be full, the previous file is kept then and the next save is tried after the interval
+    if (!llama_ngram_cache_save(::pods[idx].ngramDynamic, path)) {
+        fprintf(stderr, "%s: error: failed to write n-gram cache '%s'\n", __func__, path.c_str());
+        std::filesystem::remove(path, err);
+    } else {
+        std::filesystem::rename(path, ::params[idx].lookup_cache_dynamic, err);
+        if (err) {
+            fprintf(stderr, "%s: error: failed to save n-gram cache '%s'\n", __func__, ::params[idx].lookup_cache_dynamic.c_str());
+        }
+    }
+    ::pods[idx].t_lookup_saved_us = ggml_time_us();
+}
+
+// Store job timings and wake up the waiting do_inference() call, the slot might be parked out of the pod already
+static void close_job(llama_slot & slot, int64_t t_end_us) {
+
+    const int n_prompt = slot.n_consumed;
+    const int n_eval = slot.n_consumed - slot.n_cached; // prompt tokens were actually evaluated
+
+    if (slot.t_prompt_us == 0) {
+        slot.t_prompt_us = t_end_us;
+    }
+
+    auto & record = *slot.job->record;
+    record.mutex.lock();
+    record.output += slot.pending; // whatever left of the incomplete character
+    record.promptEval = n_eval > 0 ? (slot.t_prompt_us - slot.t_start_us) / 1000.0 / n_eval : 0;
+    record.timing = slot.n_output > 0 ? (t_end_us - slot.t_prompt_us) / 1000.0 / slot.n_output : 0;
+    record.draftTokenCount = slot.n_drafted;
+    record.acceptedTokenCount = slot.n_accepted;
+    record.t_finished_us = t_end_us;
+    record.mutex.unlock();
+
+    llama_sampling_free(slot.ctx_sampling);
+    slot.ctx_sampling = nullptr;
+    slot.pending.clear();
+    slot.t_last_us = t_end_us;
+
+    // the job was stopped or failed before its prompt was evaluated
+    release_branches(slot.job);
+
+    slot.job->done.set_value(n_prompt + slot.n_output);
+    slot.job = nullptr;
+}
+
+// Release the slot of the finished or stopped job
+static void finish_slot(int idx, llama_slot & slot) {
+
+    const int64_t t_end_us = ggml_time_us();
+    const std::string sessionID = slot.job->sessionID;
+
+    close_job(slot, t_end_us);
+
+    // NB! Save the session after the job result was returned to not delay the response
+    if (::params[idx].grp_attn_n == 1) {
+        save_snapshot(idx, slot.id, sessionID, slot.cache_tokens);
+    }
+
+    // n-grams of the job will help with the next ones, the dynamic cache is persisted from time to time
+    if (::pods[idx].lookup && !::params[idx].lookup_cache_dynamic.empty()) {
+        llama_ngram_cache_merge(::pods[idx].ngramDynamic, slot.ngram_context);
+        if (t_end_us - ::pods[idx].t_lookup_saved_us > (int64_t) LOOKUP_SAVE_INTERVAL * 1000 * 1000) {
+            save_lookup(idx);
+        }
+    }
+
+    slot.ngram_context.clear();
+    slot.lookup_inp.clear();
+}
+
+// Mark the job as stopped or expired before it was done, pollers see the partial output and timings
+static void abort_job(llama_job * job) {
+    std::lock_guard<std::shared_mutex> lock(job->record->mutex);
+    job->record->aborted = true;
+}
+
+static bool expired_job(const llama_job * job, int64_t t_now_us) {
+    return job->t_deadline_us > 0 && t_now_us > job->t_deadline_us;
+}
+
+// --- Parallel choices
+//     The job asking for n choices is prefilled once within its own slot, then its sequence is forked into n - 1 idle
+//     slots with llama_kv_cache_seq_cp, which shares KV cells of the prompt between sequences instead of copying them.
+//     From that point each choice is the separate job with its own sampler state and RNG, so all of them are decoded
+//     together within the same batch. Idle slots for choices are reserved when the job is admitted
+
+// Stop requests are made for the whole job, so they stop all choices forked from it
+static bool stop_requested(const std::unordered_set<std::string> & stops, const llama_job * job) {
+    return stops.count(job->jobID) || (!job->parentID.empty() && stops.count(job->parentID));
+}
+
+// Choices not forked yet are finished along with the job, the same way aborted when the job itself was
+static void release_branches(llama_job * job) {
+    if (job->branches.empty()) {
+        return;
+    }
+    job->record->mutex.lock_shared();
+    const bool aborted = job->record->aborted;
+    job->record->mutex.unlock_shared();
+
+    for (auto branch : job->branches) {
+        if (aborted) {
+            abort_job(branch);
+        }
+        branch->done.set_value(0);
+    }
+    job->branches.clear();
+}
+
+// Each choice gets its own copy of the grammar state, the rest of the sampler state is copied as is
+static llama_sampling_context * clone_sampling(const llama_sampling_context * src) {
+    auto dst = new llama_sampling_context(*src);
+    if (src->grammar) {
+        dst->grammar = llama_grammar_copy(src->grammar);
+        // NB! Bases point into the rules of the parent grammar, so they are rebuilt for the copy
+        dst->grammar_bases.clear();
+    }
+    return dst;
+}
+
+// Restore the saved sequence into the cache, the cache full of holes might have no contiguous cells for it until it's compacted
+static bool restore_seq(llama_context * ctx, const std::vector<uint8_t> & state, llama_seq_id id) {
+    llama_kv_cache_seq_rm(ctx, id, -1, -1);
+    if (llama_state_seq_set_data(ctx, state.data(), id) == state.size()) {
+        return true;
+    }
+
+    llama_kv_cache_seq_rm(ctx, id, -1, -1);
+    llama_kv_cache_defrag(ctx);
+    llama_kv_cache_update(ctx);
+    if (llama_state_seq_set_data(ctx, state.data(), id) == state.size()) {
+        return true;
+    }
+
+    llama_kv_cache_seq_rm(ctx, id, -1, -1);
+    return false;
+}
+
+// Positions of shared cells can't be shifted for one sequence only, so the sequence gets its own copy of them first.
+// Returns false if the sequence was lost, then the slot cache is empty
+static bool unshare_slot(int idx, llama_slot & slot) {
+
+    if (!slot.shared) {
+        return true;
+    }
+    slot.shared = false;
+
+    bool restored = true;
+    for (auto ctx : { contexts[idx], draftContexts[idx] }) {
+
+        if (!ctx) continue;
+
+        std::vector<uint8_t> state(llama_state_seq_get_size(ctx, slot.id));
+        state.resize(llama_state_seq_get_data(ctx, state.data(), slot.id));
+        llama_kv_cache_seq_rm(ctx, slot.id, -1, -1);
+
+        if (restored && !restore_seq(ctx, state, slot.id)) {
+            if (ctx == contexts[idx]) {
+                fprintf(stderr, "%s: error: failed to copy the sequence of the slot %d\n", __func__, slot.id);
+                slot.cache_tokens.clear();
+                restored = false;
+            }
+            slot.draft_tokens.clear();
+        } else if (!restored) {
+            slot.draft_tokens.clear(); // the draft sequence is useless without the main one
+        }
+    }
+
+    return restored;
+}
+
+// Fork the slot which prompt was just evaluated into idle slots for other choices of its job
+// NB! All choices are sampled from the same logits at first, so the caller keeps the original ones for each of them
+static void fork_slot(int idx, llama_slot & slot) {
+
+    llama_context * ctx = contexts[idx];
+    llama_context * dctx = draftContexts[idx];
+    llama_job * job = slot.job;
+
+    job->record->mutex.lock_shared();
+    const uint32_t seed = job->record->seed;
+    const int64_t n_prompt = job->record->promptTokenCount;
+    job->record->mutex.unlock_shared();
+
+    for (size_t k = 0; k < job->branches.size(); k++) {
+
+        llama_job * branch = job->branches[k];
+
+        llama_slot * target = nullptr;
+        for (auto & candidate : ::pods[idx].slots) {
+            if (!candidate.job && (!target || candidate.t_last_us < target->t_last_us)) {
+                target = &candidate;
+            }
+        }
+
+        if (!target) { // should never happen while slots for choices are reserved
+            fprintf(stderr, "%s: error: no idle slot for the choice '%s'\n", __func__, branch->jobID.c_str());
+            abort_job(branch);
+            branch->done.set_value(0);
+            continue;
+        }
+
+        branch->priority      = job->priority;
+        branch->tenant        = job->tenant;
+        branch->weight        = job->weight;
+        branch->t_queued_us   = job->t_queued_us;
+        branch->t_deadline_us = job->t_deadline_us;
+
+        branch->record->mutex.lock();
+        branch->record->seed = seed + k + 1;
+        branch->record->promptTokenCount = n_prompt;
+        branch->record->mutex.unlock();
+
+        llama_kv_cache_seq_rm(ctx, target->id, -1, -1);
+        llama_kv_cache_seq_cp(ctx, slot.id, target->id, -1, -1);
+        if (dctx) {
+            llama_kv_cache_seq_rm(dctx, target->id, -1, -1);
+            llama_kv_cache_seq_cp(dctx, slot.id, target->id, -1, -1);
+        }
+
+        llama_slot & fork = *target;
+
+        fork.job          = branch;
+        fork.embd_inp     = slot.embd_inp;
+        fork.last_tokens  = slot.last_tokens;
+        fork.cache_tokens = slot.cache_tokens;
+        fork.draft_tokens = slot.draft_tokens;
+        fork.pending.clear();
+        fork.drafted.clear();
+
+        fork.ctx_sampling = clone_sampling(slot.ctx_sampling);
+        fork.ctx_sampling->rng.seed(seed + k + 1);
+
+        fork.sampled          = slot.sampled;
+        fork.i_batch          = slot.i_batch;
+        fork.n_past           = slot.n_past;
+        fork.n_consumed       = slot.n_consumed;
+        fork.n_remain         = slot.n_remain;
+        fork.n_keep           = slot.n_keep;
+        fork.n_output         = slot.n_output;
+        fork.n_cached         = slot.n_cached;
+        fork.n_evicted        = slot.n_evicted;
+        fork.n_past_batch     = slot.n_past_batch;
+        fork.n_consumed_batch = slot.n_consumed_batch;
+        fork.n_drafted        = 0;
+        fork.n_accepted       = 0;
+        fork.ga_i             = slot.ga_i;
+        fork.shared           = true;
+
+        fork.lookup_inp = slot.lookup_inp;
+        fork.ngram_context.clear();
+        if (::pods[idx].lookup) {
+            llama_ngram_cache_update(fork.ngram_context, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, fork.lookup_inp, fork.lookup_inp.size(), false);
+        }
+
+        fork.t_start_us  = slot.t_start_us;
+        fork.t_prompt_us = slot.t_prompt_us;
+        fork.t_last_us   = slot.t_last_us;
+
+        slot.shared = true;
+    }
+
+    job->branches.clear();
+}
+
+// The cache full of holes left by evicted and rejected tokens might have no contiguous cells for the batch,
+// so it's compacted lazily only when needed [ safe to retry while the batch was not split into several ubatches ]
+// NB! With the armed flag, the decode might be aborted by the callback of the context. K-shift and defrag
+//     are applied before that, because the cache moved only partially would be broken for all the slots
+static int decode_batch(llama_context * ctx, llama_batch & batch, std::atomic<bool> * armed = nullptr) {
+    auto decode = [&]() {
+        if (!armed) {
+            return llama_decode(ctx, batch);
+        }
+        llama_kv_cache_update(ctx);
+        armed->store(true);
+        const int ret = llama_decode(ctx, batch);
+        armed->store(false);
+        return ret;
+    };
+    int ret = decode();
+    if (ret == 1 && batch.n_tokens <= (int) llama_n_ubatch(ctx)) {
+        llama_kv_cache_defrag(ctx);
+        ret = decode();
+    }
+    return ret;
+}
+
+// Clean up after the aborted decode: KV cells of the whole batch hold garbage, so they are removed for all the slots.
+// Slots of stopped and expired jobs are rolled back and finished, tokens of others are kept to be decoded again
+static void abort_batch(int idx, llama_batch & batch, std::vector<llama_slot *> & batched) {
+
+    llama_pod & pod = ::pods[idx];
+    llama_context * ctx = contexts[idx];
+    const int64_t t_now_us = ggml_time_us();
+
+    std::unordered_set<llama_seq_id> aborted;
+    {
+        std::lock_guard<std::mutex> lock(pod.mutex);
+        pod.abort = false;
+        for (auto slot : batched) {
+            if (stop_requested(pod.stops, slot->job) || expired_job(slot->job, t_now_us)) {
+                aborted.insert(slot->id);
+            }
+        }
+    }
+
+    for (auto slot : batched) {
+        llama_kv_cache_seq_rm(ctx, slot->id, slot->n_past_batch, -1);
+        if (!aborted.count(slot->id)) {
+            continue;
+        }
+        slot->cache_tokens.resize(slot->cache_tokens.size() - (slot->n_past - slot->n_past_batch));
+        slot->n_past = slot->n_past_batch;
+        slot->n_consumed = slot->n_consumed_batch;
+        slot->i_batch = -1;
+        slot->drafted.clear();
+        abort_job(slot->job);
+        finish_slot(idx, *slot);
+    }
+
+    // -- compact the batch, logits of the rest slots move along with their tokens
+
+    std::vector<int32_t> moved(batch.n_tokens, -1);
+    int n_tokens = 0;
+    for (int i = 0; i < batch.n_tokens; i++) {
+        if (aborted.count(batch.seq_id[i][0])) {
+            continue;
+        }
+        batch.token[n_tokens]     = batch.token[i];
+        batch.pos[n_tokens]       = batch.pos[i];
+        batch.n_seq_id[n_tokens]  = batch.n_seq_id[i];
+        batch.seq_id[n_tokens][0] = batch.seq_id[i][0];
+        batch.logits[n_tokens]    = batch.logits[i];
+        moved[i] = n_tokens++;
+    }
+    batch.n_tokens = n_tokens;
+
+    batched.erase(std::remove_if(batched.begin(), batched.end(), [](const llama_slot * slot) { return !slot->job; }), batched.end());
+    for (auto slot : batched) {
+        if (slot->i_batch >= 0) {
+            slot->i_batch = moved[slot->i_batch];
+        }
+    }
+}
+
+// Evict n_discard oldest tokens of the slot right after the n_keep first ones, which are kept as attention sink,
+// returns false if the sequence was lost instead
+// NB! llama_kv_cache_seq_add only marks the cache, so RoPE of shifted keys is applied lazily by the next decode,
+//     once for the whole cache no matter how many slots were shifted within the step
+static bool evict_slot(int idx, llama_slot & slot, int n_discard) {
+
+    llama_context * ctx = contexts[idx];
+    const int n_keep = slot.n_keep;
+
+    if (!unshare_slot(idx, slot)) {
+        slot.n_evicted = 0;
+        return false;
+    }
+
+    llama_kv_cache_seq_rm (ctx, slot.id, n_keep, n_keep + n_discard);
+    llama_kv_cache_seq_add(ctx, slot.id, n_keep + n_discard, -1, -n_discard);
+
+    auto & cache = slot.cache_tokens;
+    cache.erase(cache.begin() + std::min(n_keep, (int) cache.size()), cache.begin() + std::min(n_keep + n_discard, (int) cache.size()));
+
+    slot.n_past    -= n_discard;
+    slot.n_evicted += n_discard;
+
+    // the draft cache is shifted the same way, otherwise the draft model would evaluate the whole window again
+    if (draftContexts[idx]) {
+        llama_kv_cache_seq_rm (draftContexts[idx], slot.id, n_keep, n_keep + n_discard);
+        llama_kv_cache_seq_add(draftContexts[idx], slot.id, n_keep + n_discard, -1, -n_discard);
+        auto & draft = slot.draft_tokens;
+        draft.erase(draft.begin() + std::min(n_keep, (int) draft.size()), draft.begin() + std::min(n_keep + n_discard, (int) draft.size()));
+    }
+
+    return true;
+}
+
+// Make room for the next n_tokens of the slot within its part of context, returns false if there no more space
+static bool shift_slot(int idx, llama_slot & slot, int n_tokens) {
+
+    llama_context * ctx = contexts[idx];
+    gpt_params & params = ::params[idx];
+
+    const int n_ctx = llama_n_ctx(ctx) / ::pods[idx].slots.size();
+
+    const int ga_n = params.grp_attn_n;
+    const int ga_w = params.grp_attn_w;
+
+    if (ga_n == 1) {
+
+        // infinite text generation via context shifting
+        // if we run out of context:
+        // - take the n_keep first tokens from the original prompt (via n_past)
+        // - take half of the last (n_ctx - n_keep) tokens and recompute the logits in batches
+        // - or evict only n_window oldest of them with the sliding window, so recent context is never lost at once
+
+        if (slot.n_past + n_tokens > n_ctx) {
+
+            if (params.n_predict == -2) {
+                return false;
+            }
+
+            // WAS: const int n_left    = n_past - params.n_keep - 1;
+            const int n_left = slot.n_past - slot.n_keep;
+            int n_discard = n_left/2;
+
+            if (params.n_window > 0) {
+                n_discard = std::min(n_left, std::max(params.n_window, slot.n_past + n_tokens - n_ctx));
+            }
+
+            // NB! The slot might still be short of space when the most of its tokens are kept
+            if (!evict_slot(idx, slot, n_discard) || slot.n_past + n_tokens > n_ctx) {
+                return false;
+            }
+        }
+
+    } else {    
+
+        // context extension via Self-Extend
+        if (slot.n_past >= slot.ga_i + ga_w && !unshare_slot(idx, slot)) {
+            return false;
+        }
+
+        while (slot.n_past >= slot.ga_i + ga_w) {
+            const int ib = (ga_n*slot.ga_i)/ga_w;
+            const int bd = (ga_w/ga_n)*(ga_n - 1);
+            const int dd = (ga_w/ga_n) - ib*bd - ga_w;
+
+            llama_kv_cache_seq_add(ctx, slot.id, slot.ga_i,                slot.n_past,              ib*bd);
+            llama_kv_cache_seq_div(ctx, slot.id, slot.ga_i + ib*bd,        slot.ga_i + ib*bd + ga_w, ga_n);
+            llama_kv_cache_seq_add(ctx, slot.id, slot.ga_i + ib*bd + ga_w, slot.n_past + ib*bd,      dd);
+
+            slot.n_past -= bd;
+
+            slot.ga_i += ga_w/ga_n;
+        }
+    }
+
+    return true;
+}
+
+// Generating slots close to the end of the sliding window are shifted together with the first one which has to be,
+// so a single K-shift of the cache serves all of them instead of the separate shift per slot on consecutive steps
+static void window_slots(int idx) {
+
+    llama_pod & pod = ::pods[idx];
+    gpt_params & params = ::params[idx];
+
+    if (params.n_window <= 0 || params.grp_attn_n != 1 || params.n_predict == -2) {
+        return;
+    }
+
+    const int n_ctx = llama_n_ctx(contexts[idx]) / pod.slots.size();
+
+    auto n_needed = [](const llama_slot & slot) {
+        if (!slot.job || slot.n_consumed < (int) slot.embd_inp.size()) return 0;
+        return 1 + (int) slot.drafted.size();
+    };
+
+    bool shift = false;
+    for (auto & slot : pod.slots) {
+        if (n_needed(slot) && slot.n_past + n_needed(slot) > n_ctx) {
+            shift = true;
+        }
+    }
+
+    if (!shift) {
+        return;
+    }
+
+    for (auto & slot : pod.slots) {
+        if (n_needed(slot) && slot.n_past + n_needed(slot) + params.n_window/2 > n_ctx) {
+            if (!shift_slot(idx, slot, n_needed(slot) + params.n_window/2)) {
+                finish_slot(idx, slot);
+            }
+        }
+    }
+}
+
+// --- Speculative decoding
+//     The draft model proposes next few tokens for every generating slot with greedy sampling, then the main model
+//     evaluates all of them at once within the same batch. The active sampler of the main model picks tokens as usual
+//     and drafts are accepted while they are the same, so the output distribution is not changed at all.
+//     Draft KV cache follows the main one lazily: only tokens diverged since the previous step are evaluated again
+
+// How many tokens the generating slot may draft on this step, zero if it should not speculate at all
+static int draft_limit(int idx, const llama_slot & slot) {
+
+    const int n_slots = ::pods[idx].slots.size();
+    const int n_ctx   = llama_n_ctx(contexts[idx]) / n_slots;
+
+    // every generating slot needs room for the sampled token and all its drafts within the main batch
+    int n_draft = std::min(::params[idx].n_draft, (int) llama_n_batch(contexts[idx]) / n_slots - 1);
+
+    // there no sense to draft beyond the budget of the job [ negative budget means infinite generation ]
+    if (slot.n_remain > 0) {
+        n_draft = std::min(n_draft, slot.n_remain - 1);
+    }
+
+    // do not bother drafting right before the context shift
+    if (n_draft <= 0 || slot.n_past + 1 + n_draft > n_ctx) {
+        return 0;
+    }
+
+    return n_draft;
+}
+
+static void draft_slots(int idx, llama_batch & dbatch) {
+
+    llama_pod & pod = ::pods[idx];
+    llama_context * dctx = draftContexts[idx];
+    auto model = draftModels[idx];
+
+    const int n_vocab = llama_n_vocab(model);
+    const int n_batch = llama_n_batch(dctx);
+
+    std::vector<llama_slot *> active;
+
+    for (auto & slot : pod.slots) {
+        slot.drafted.clear();
+        if (!slot.job || slot.n_consumed < (int) slot.embd_inp.size()) continue;
+        if (draft_limit(idx, slot) == 0) continue;
+        active.push_back(&slot);
+    }
+
+    if (active.empty()) {
+        return;
+    }
+
+    // drop all drafts and the draft cache of failed slots, it will be rebuilt on the next step
+    auto fail = [&]() {
+        fprintf(stderr, "%s: error: failed to decode the draft batch of %d tokens\n", __func__, dbatch.n_tokens);
+        for (auto slot : active) {
+            llama_kv_cache_seq_rm(dctx, slot->id, -1, -1);
+            slot->draft_tokens.clear();
+            slot->drafted.clear();
+        }
+    };
+
+    // -- catch up with the main sequence, all tokens except the sampled one which is drafted from
+
+    llama_batch_clear(dbatch);
+
+    for (auto slot : active) {
+
+        const size_t n_common = common_prefix(slot->draft_tokens, slot->cache_tokens);
+        llama_kv_cache_seq_rm(dctx, slot->id, n_common, -1);
+        slot->draft_tokens.resize(n_common);
+
+        for (size_t i = n_common; i < slot->cache_tokens.size(); i++) {
+            if (dbatch.n_tokens == n_batch) {
+                if (decode_batch(dctx, dbatch)) return fail();
+                llama_batch_clear(dbatch);
+            }
+            llama_batch_add(dbatch, slot->cache_tokens[i], i, { slot->id }, false);
+            slot->draft_tokens.push_back(slot->cache_tokens[i]);
+        }
+    }
+
+    if (dbatch.n_tokens > 0 && decode_batch(dctx, dbatch)) {
+        return fail();
+    }
+
+    // -- draft one token per step for all active slots together
+
+    while (!active.empty()) {
+
+        llama_batch_clear(dbatch);
+
+        for (auto slot : active) {
+            const llama_token id = slot->drafted.empty() ? slot->sampled : slot->drafted.back();
+            llama_batch_add(dbatch, id, slot->draft_tokens.size(), { slot->id }, true);
+            slot->draft_tokens.push_back(id);
+        }
+
+        if (decode_batch(dctx, dbatch)) {
+            return fail();
+        }
+
+        size_t n_active = 0;
+        for (size_t i = 0; i < active.size(); i++) {
+            auto slot = active[i];
+            const float * logits = llama_get_logits_ith(dctx, i);
+            const llama_token id = std::max_element(logits, logits + n_vocab) - logits;
+            slot->drafted.push_back(id);
+            // there no sense to draft after the end of text
+            if (llama_token_is_eog(model, id) || (int) slot->drafted.size() >= draft_limit(idx, *slot)) continue;
+            active[n_active++] = slot;
+        }
+        active.resize(n_active);
+    }
+}
+
+// --- Lookup decoding
+//     Without the draft model, tokens are drafted from n-grams already seen within the prompt and output of the job,
+//     then from n-grams of previous jobs of the pod. It costs nothing when the output copies the input a lot,
+//     like rewriting or fixing the code given within the prompt. Drafts are verified the same way as above
+
+static void lookup_slots(int idx) {
+
+    llama_pod & pod = ::pods[idx];
+
+    for (auto & slot : pod.slots) {
+
+        slot.drafted.clear();
+        if (!slot.job || slot.n_consumed < (int) slot.embd_inp.size()) continue;
+
+        const int n_draft = draft_limit(idx, slot);
+        if (n_draft == 0) continue;
+
+        std::vector<llama_token> draft = { slot.sampled };
+        llama_ngram_cache_draft(slot.lookup_inp, draft, n_draft, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX,
+            slot.ngram_context, pod.ngramDynamic, pod.ngramStatic);
+
+        slot.drafted.assign(draft.begin() + 1, draft.end());
+    }
+}
+
+// --- Scheduling
+//     Waiting jobs are admitted by priority first, then by the fair share of their tenants, then by arrival.
+//     When there no idle slot for the job of higher priority, the running job of the lowest priority is preempted:
+//     its sequence is copied out of the KV cache with llama_state_seq_get_data() and the job goes back into the queue,
+//     so later it's resumed exactly where it was stopped without evaluating anything again
+
+// Should the job a be admitted before the job b
+static bool schedule_before(llama_pod & pod, const llama_job * a, const llama_job * b) {
+    if (a->priority != b->priority) {
+        return a->priority > b->priority;
+    }
+    const double share_a = pod.shares[a->tenant];
+    const double share_b = pod.shares[b->tenant];
+    if (share_a != share_b) {
+        return share_a < share_b;
+    }
+    return a->t_queued_us < b->t_queued_us;
+}
+
+// Count tokens processed for the tenant of the job
+static void charge_job(llama_pod & pod, const llama_job * job, int n_tokens) {
+    pod.shares[job->tenant] += n_tokens / job->weight;
+}
+
+// The tenant idle for a long time would have taken the whole pod until its share catches up with others,
+// so it starts from the least share among running tenants
+static void level_share(llama_pod & pod, const llama_job * job) {
+    double least = -1;
+    for (auto & slot : pod.slots) {
+        if (slot.job && (least < 0 || pod.shares[slot.job->tenant] < least)) {
+            least = pod.shares[slot.job->tenant];
+        }
+    }
+    auto & share = pod.shares[job->tenant];
+    share = std::max(share, least);
+}
+
+// The running slot of the lowest priority to be preempted for the job, the latest started one among equals
+// NB! The job with choices not forked yet holds reserved slots, so it's never preempted
+static llama_slot * preempt_candidate(llama_pod & pod, const llama_job * job, const std::vector<llama_slot *> & preempted) {
+    llama_slot * victim = nullptr;
+    for (auto & slot : pod.slots) {
+        if (!slot.job || slot.job->priority >= job->priority || !slot.job->branches.empty()) continue;
+        if (std::find(preempted.begin(), preempted.end(), &slot) != preempted.end()) continue;
+        if (!victim || slot.job->priority < victim->job->priority ||
+            (slot.job->priority == victim->job->priority && slot.t_start_us > victim->t_start_us)) {
+            victim = &slot;
+        }
+    }
+    return victim;
+}
+
+// Copy the sequence of the slot out of the KV cache and release the slot, returns the job to be queued again
+static llama_job * park_slot(int idx, llama_slot & slot) {
+
+    llama_context * ctx = contexts[idx];
+    llama_context * dctx = draftContexts[idx];
+
+    auto parked = std::make_shared<llama_parked>();
+
+    parked->state.resize(llama_state_seq_get_size(ctx, slot.id));
+    parked->state.resize(llama_state_seq_get_data(ctx, parked->state.data(), slot.id));
+    llama_kv_cache_seq_rm(ctx, slot.id, -1, -1);
+
+    if (dctx) {
+        parked->draft_state.resize(llama_state_seq_get_size(dctx, slot.id));
+        parked->draft_state.resize(llama_state_seq_get_data(dctx, parked->draft_state.data(), slot.id));
+        llama_kv_cache_seq_rm(dctx, slot.id, -1, -1);
+    }
+
+    const llama_seq_id id = slot.id;
+    llama_job * job = slot.job;
+
+    slot.drafted.clear();
+    parked->slot = std::move(slot);
+
+    // the slot is left idle with the empty cache
+    slot = llama_slot();
+    slot.id = id;
+
+    job->parked = parked;
+    return job;
+}
+
+// Place the preempted job into the idle slot restoring its sequence, the job is finished if it can't be resumed
+static bool resume_slot(int idx, llama_job * job) {
+
+    llama_context * ctx = contexts[idx];
+    llama_context * dctx = draftContexts[idx];
+
+    llama_slot * best = nullptr;
+    for (auto & candidate : ::pods[idx].slots) {
+        if (!candidate.job && (!best || candidate.t_last_us < best->t_last_us)) {
+            best = &candidate;
+        }
+    }
+
+    auto parked = job->parked;
+    job->parked.reset();
+
+    if (!best) { // should never happen while admitting no more jobs than idle slots
+        close_job(parked->slot, ggml_time_us());
+        return false;
+    }
+
+    llama_slot & slot = *best;
+
+    // NB! Pollers should see the job was cut short, not just finished with the partial output
+    if (!restore_seq(ctx, parked->state, slot.id)) {
+        fprintf(stderr, "%s: error: failed to restore the sequence of the job '%s'\n", __func__, job->jobID.c_str());
+        slot.cache_tokens.clear();
+        abort_job(job);
+        close_job(parked->slot, ggml_time_us());
+        return false;
+    }
+
+    // the draft cache is not that important and will be rebuilt from scratch when it was not restored
+    if (dctx) {
+        if (parked->draft_state.empty() || !restore_seq(dctx, parked->draft_state, slot.id)) {
+            llama_kv_cache_seq_rm(dctx, slot.id, -1, -1);
+            parked->slot.draft_tokens.clear();
+        }
+    }
+
+    const llama_seq_id id = slot.id;
+    slot = std::move(parked->slot);
+    slot.id = id;
+    slot.shared = false; // the restored sequence has its own cells
+
+    return true;
+}
+
+// -- MAIN LOOP of the pod serving all its slots within the same batch
+
+static void serve_pod(int idx) {
+
+    llama_pod & pod = ::pods[idx];
+    llama_context * ctx = contexts[idx];
+    auto model = models[idx];
+
+    gpt_params & params = ::params[idx];
+    llama_sampling_params & sparams = ::sparams[idx];
+
+    // the serving thread computes graphs too, so it runs on the same CPUs as threads of the pool
+    if (!pod.cpus.empty()) {
+        bind_thread(pod.cpus);
+    }
+
+    const int n_batch = llama_n_batch(ctx);
+    llama_batch batch = llama_batch_init(n_batch, 0, 1);
+    llama_batch dbatch = llama_batch_init(draftContexts[idx] ? n_batch : 1, 0, 1);
+
+    for (;;) {
+
+        // -- admit waiting jobs into idle slots and collect stop requests
+        //    sleep while there nothing to do
+
+        std::vector<llama_job *> admitted;
+        std::vector<llama_slot *> preempted;
+        std::vector<llama_job *> dropped; // preempted jobs stopped while waiting and all jobs expired there
+        std::deque<llama_embed_request *> embeds;
+        std::unordered_set<std::string> stops;
+        int64_t t_now_us = 0;
+
+        {
+            std::unique_lock<std::mutex> lock(pod.mutex);
+
+            auto busy = [&pod] {
+                if (!pod.queue.empty() || !pod.embeds.empty()) return true;
+                for (auto & slot : pod.slots) if (slot.job) return true;
+                return false;
+            };
+
+            pod.ready.wait(lock, [&pod, &busy] { return pod.shutdown || busy(); });
+
+            if (!busy()) {
+                break; // shutdown
+            }
+
+            embeds.swap(pod.embeds);
+
+            stops.swap(pod.stops);
+            pod.abort = false;
+            t_now_us = ggml_time_us();
+
+            for (auto it = pod.queue.begin(); it != pod.queue.end(); ) {
+                if (((*it)->parked && stop_requested(stops, *it)) || expired_job(*it, t_now_us)) {
+                    dropped.push_back(*it);
+                    it = pod.queue.erase(it);
+                } else {
+                    it++;
+                }
+            }
+
+            // slots reserved for choices of jobs being prefilled are not idle
+            size_t n_idle = 0;
+            size_t n_reserved = 0;
+            for (auto & slot : pod.slots) {
+                if (!slot.job || stop_requested(stops, slot.job) || expired_job(slot.job, t_now_us)) {
+                    n_idle++;
+                } else {
+                    n_reserved += slot.job->branches.size();
+                }
+            }
+            n_idle -= std::min(n_idle, n_reserved);
+
+            size_t n_taken = 0; // slots taken by admitted jobs with all their choices
+            while (!pod.queue.empty()) {
+                auto next = std::min_element(pod.queue.begin(), pod.queue.end(), [&pod](const llama_job * a, const llama_job * b) {
+                    return schedule_before(pod, a, b);
+                });
+                const size_t n_slots = 1 + (*next)->branches.size();
+                const size_t n_preempted = preempted.size();
+                while (n_taken + n_slots > n_idle + preempted.size()) {
+                    llama_slot * victim = preempt_candidate(pod, *next, preempted);
+                    if (!victim) break;
+                    preempted.push_back(victim);
+                }
+                if (n_taken + n_slots > n_idle + preempted.size()) {
+                    preempted.resize(n_preempted); // the job waits for enough slots even with all preempted
+                    break;
+                }
+                n_taken += n_slots;
+                level_share(pod, *next);
+                admitted.push_back(*next);
+                pod.queue.erase(next);
+            }
+        }
+
+        // -- embeddings are computed between batches with the same compute threads, so they never compete for CPUs
+
+        for (auto request : embeds) {
+            request->done.set_value(embed_texts(idx, request->texts, request->n, request->out));
+        }
+
+        for (auto job : dropped) {
+            abort_job(job);
+            if (job->parked) {
+                close_job(job->parked->slot, ggml_time_us());
+                job->parked.reset();
+            } else {
+                release_branches(job);
+                job->done.set_value(0);
+            }
+        }
+
+        for (auto & slot : pod.slots) {
+            if (slot.job && (stop_requested(stops, slot.job) || expired_job(slot.job, t_now_us))) {
+                abort_job(slot.job);
+                finish_slot(idx, slot);
+            }
+        }
+
+        // -- preempted jobs go back into the queue with their sequences parked out of the KV cache
+
+        if (!preempted.empty()) {
+            std::vector<llama_job *> parked;
+            for (auto slot : preempted) {
+                if (slot->job) {
+                    parked.push_back(park_slot(idx, *slot));
+                }
+            }
+            std::lock_guard<std::mutex> lock(pod.mutex);
+            pod.queue.insert(pod.queue.end(), parked.begin(), parked.end());
+        }
+
+        for (auto job : admitted) {
+            if (job->parked) {
+                resume_slot(idx, job);
+            } else if (!start_slot(idx, job)) {
+                release_branches(job);
+                job->done.set_value(0);
+            }
+        }
+
+        // -- speculate next tokens of generating slots with the draft model
+
+        if (draftContexts[idx]) {
+            draft_slots(idx, dbatch);
+        } else if (pod.lookup) {
+            lookup_slots(idx);
+        }
+
+        window_slots(idx);
+
+        llama_batch_clear(batch);
+        std::vector<llama_slot *> batched; // slots with tokens within the batch
+
+        // -- first, add the last sampled token of every generating slot
+
+        for (auto & slot : pod.slots) {
+
+            if (!slot.job || slot.n_consumed < (int) slot.embd_inp.size()) {
+                continue;
+            }
+
+            if (!shift_slot(idx, slot, 1 + (int) slot.drafted.size())) {
+                finish_slot(idx, slot);
+                continue;
+            }
+
+            slot.n_past_batch = slot.n_past;
+            slot.n_consumed_batch = slot.n_consumed;
+            batched.push_back(&slot);
+
+            slot.i_batch = batch.n_tokens;
+            llama_batch_add(batch, slot.sampled, slot.n_past++, { slot.id }, true);
+            slot.cache_tokens.push_back(slot.sampled);
+
+            // drafted tokens are verified all together, so each of them needs logits
+            for (auto id : slot.drafted) {
+                llama_batch_add(batch, id, slot.n_past++, { slot.id }, true);
+                slot.cache_tokens.push_back(id);
+            }
+
+            charge_job(pod, slot.job, 1 + (int) slot.drafted.size());
+        }
+
+        // -- then fill the rest of the batch with pending prompt tokens of newly joined jobs
+        //    with the step budget, long prompts are evaluated by chunks interleaved with decoding of other slots,
+        //    so the single huge prompt does not stall the output of all others for seconds
+
+        int n_limit = n_batch;
+        if (params.n_budget > 0) {
+            n_limit = std::min(n_batch, std::max(params.n_budget, batch.n_tokens + PREFILL_MIN));
+        }
+
+        // the oldest job of the highest priority goes first and gets the most of the budget
+        std::vector<llama_slot *> prefill;
+        for (auto & slot : pod.slots) {
+            if (slot.job && slot.n_consumed < (int) slot.embd_inp.size()) {
+                prefill.push_back(&slot);
+            }
+        }
+
+        std::sort(prefill.begin(), prefill.end(), [](const llama_slot * a, const llama_slot * b) {
+            if (a->job->priority != b->job->priority) {
+                return a->job->priority > b->job->priority;
+            }
+            return a->t_start_us < b->t_start_us;
+        });
+
+        for (auto pslot : prefill) {
+
+            if (batch.n_tokens >= n_limit) {
+                break;
+            }
+
+            llama_slot & slot = *pslot;
+            const int n_eval = std::min(n_limit - batch.n_tokens, (int) slot.embd_inp.size() - slot.n_consumed);
+
+            // the prompt chunk which does not fit the slot would be written into cells of other slots
+            if (!shift_slot(idx, slot, n_eval)) {
+                fprintf(stderr, "%s: error: no room for the prompt of job '%s' within slot %d\n", __func__, slot.job->jobID.c_str(), slot.id);
+                abort_job(slot.job);
+                finish_slot(idx, slot);
+                continue;
+            }
+
+            slot.n_past_batch = slot.n_past;
+            slot.n_consumed_batch = slot.n_consumed;
+            batched.push_back(&slot);
+
+            const llama_token * tokens = slot.embd_inp.data() + slot.n_consumed;
+            for (int i = 0; i < n_eval; i++) {
+                // push the prompt in the sampling context in order to apply repetition penalties later
+                // for the prompt, we don't apply grammar rules
+                llama_sampling_accept(slot.ctx_sampling, ctx, tokens[i], false);
+                llama_batch_add(batch, tokens[i], slot.n_past++, { slot.id }, false);
+                slot.cache_tokens.push_back(tokens[i]);
+            }
+
+            slot.n_consumed += n_eval;
+            charge_job(pod, slot.job, n_eval);
+
+            // we need logits only for the last token of the prompt
+            if (slot.n_consumed == (int) slot.embd_inp.size()) {
+                slot.i_batch = batch.n_tokens - 1;
+                batch.logits[slot.i_batch] = true;
+            }
+        }
+
+        if (batch.n_tokens == 0) {
+            continue;
+        }
+
+        // -- decode the batch, when it was aborted midway, it's decoded again without stopped and expired jobs
+        //    NB! The pod is armed only around the decode of the main model, K-shift and drafting are never aborted
+
+        int ret = 0;
+        while (batch.n_tokens > 0) {
+            int64_t t_deadline_us = 0;
+            for (auto slot : batched) {
+                const int64_t t_job_us = slot->job->t_deadline_us;
+                if (t_job_us > 0 && (t_deadline_us == 0 || t_job_us < t_deadline_us)) {
+                    t_deadline_us = t_job_us;
+                }
+            }
+            pod.t_deadline_us = t_deadline_us;
+            pod.fired = false;
+
+            ret = decode_batch(ctx, batch, &pod.armed);
+            if (ret != 2) {
+                break;
+            }
+
+            abort_batch(idx, batch, batched);
+            ret = 0;
+        }
+
+        if (ret) {
+            fprintf(stderr, "%s: error: failed to decode the batch of %d tokens\n", __func__, batch.n_tokens);
+            for (auto & slot : pod.slots) {
+                llama_kv_cache_seq_rm(ctx, slot.id, -1, -1);
+                slot.cache_tokens.clear();
+                if (slot.job) {
+                    finish_slot(idx, slot);
+                }
+            }
+            continue;
+        }
+
+        // -- fork jobs with prompts just evaluated into choices, Janus kernels change logits in place,
+        //    so each choice starts from the copy of original ones
+
+        std::unordered_map<int32_t, std::vector<float>> forks; // original logits of forked slots by batch index
+
+        for (auto & slot : pod.slots) {
+            if (slot.job && slot.i_batch >= 0 && !slot.job->branches.empty()) {
+                const float * logits = llama_get_logits_ith(ctx, slot.i_batch);
+                forks[slot.i_batch].assign(logits, logits + llama_n_vocab(model));
+                fork_slot(idx, slot);
+            }
+        }
+
+        // -- sample next tokens for all slots which have logits within the batch
+
+        for (auto & slot : pod.slots) {
+
+            if (!slot.job || slot.i_batch < 0) {
+                continue;
+            }
+
+            if (slot.t_prompt_us == 0) {
+                slot.t_prompt_us = ggml_time_us();
+            }
+
+            auto fork = forks.find(slot.i_batch);
+            if (fork != forks.end()) {
+                std::copy(fork->second.begin(), fork->second.end(), llama_get_logits_ith(ctx, slot.i_batch));
+            }
+
+            // the main model samples after the last token and after each of drafted ones while they match its choice
+            const int n_drafted = slot.drafted.size();
+            const int n_past = slot.n_past - n_drafted; // position right after the last sampled token
+            int n_accepted = 0;
+            bool done = false;
+            llama_token id = 0;
+
+            for (int i = 0; i <= n_drafted; i++) {
+
+                // Janus knows nothing about grammars, so constrained jobs are sampled the regular way
+                if (sparams.janus && slot.ctx_sampling->grammar == NULL) {
+                    id = sample_janus_token(
+                        ctx,
+                        *pod.janus,
+                        sparams,
+                        slot.last_tokens,
+                        slot.embd_inp.size(),
+                        n_past + i,
+                        ::params[idx].n_predict,
+                        slot.i_batch + i,
+                        slot.ctx_sampling->rng);
+                } else {
+                    id = llama_sampling_sample(slot.ctx_sampling, ctx, NULL, slot.i_batch + i);
+                }
+
+                // we still need to maintain this for Janus Sampling
+                slot.last_tokens.push_back(id);
+
+                llama_sampling_accept(slot.ctx_sampling, ctx, id, true);
+
+                slot.n_output++;
+                --slot.n_remain; // decrement remaining sampling budget
+
+                // -- update job text buffer
+                update_job(model, slot, id);
+
+                // end of text token
+                if (llama_token_is_eog(model, id) || slot.n_remain == 0) {
+                    done = true;
+                    break;
+                }
+
+                if (i == n_drafted || id != slot.drafted[i]) {
+                    break;
+                }
+
+                n_accepted++;
+            }
+
+            slot.i_batch = -1;
+            slot.sampled = id;
+
+            if (pod.lookup) {
+                const int n_new = n_accepted + 1;
+                slot.lookup_inp.insert(slot.lookup_inp.end(), slot.drafted.begin(), slot.drafted.begin() + n_accepted);
+                slot.lookup_inp.push_back(id);
+                llama_ngram_cache_update(slot.ngram_context, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, slot.lookup_inp, n_new, false);
+            }
+
+            // -- drop rejected drafts from the cache, accepted ones are already evaluated there
+
+            if (n_drafted > 0) {
+                slot.n_past = n_past + n_accepted;
+                llama_kv_cache_seq_rm(ctx, slot.id, slot.n_past, -1);
+                slot.cache_tokens.resize(slot.cache_tokens.size() - (n_drafted - n_accepted));
+                slot.n_drafted  += n_drafted;
+                slot.n_accepted += n_accepted;
+            }
+
+            if (done) {
+                finish_slot(idx, slot);
+            }
+        }
+    }
+
+    llama_batch_free(batch);
+    llama_batch_free(dbatch);
+}
+
+// --- Embeddings
+//     The pod computes embeddings with its own context of the same model created on the first request. Requests are
+//     served by the serving loop between batches with the compute threads of the pod. Short texts are packed as separate sequences
+//     into the same batch, so thousands of chunks are evaluated with a few full batches instead of one by one.
+//     The pooling of the model is applied when it has one, generative models are pooled by the last token.
+
+#define EMBED_SEQ_MAX 64 // max texts packed into the same batch
+
+static llama_context * embed_context(int idx) {
+    llama_pod & pod = ::pods[idx];
+    if (pod.embed_ctx) {
+        return pod.embed_ctx;
+    }
+
+    const int n_batch = ::params[idx].n_batch > 0 ? ::params[idx].n_batch : 512;
+
+    llama_context_params cparams = llama_context_params_from_gpt_params(::params[idx]);
+    cparams.embeddings      = true;
+    cparams.n_seq_max       = EMBED_SEQ_MAX;
+    cparams.n_ctx           = n_batch; // NB! The cache is cleared after each batch
+    cparams.n_batch         = n_batch;
+    cparams.n_ubatch        = n_batch; // non-causal models should see the whole text at once
+    cparams.n_threads       = ::params[idx].n_threads_batch;
+    cparams.n_threads_batch = ::params[idx].n_threads_batch;
+
+    pod.embed_ctx = llama_new_context_with_model(models[idx], cparams);
+    if (pod.embed_ctx == NULL) {
+        fprintf(stderr, "%s: error: failed to create embedding context for pod %d\n", __func__, idx);
+        return NULL;
+    }
+
+    llama_attach_threadpool(pod.embed_ctx, pod.threadpool);
+
+    return pod.embed_ctx;
+}
+
+// L2 normalised copy of the vector
+static void normalize_embedding(const float * embd, float * out, int n_embd) {
+    double sum = 0.0;
+    for (int i = 0; i < n_embd; i++) {
+        sum += embd[i] * embd[i];
+    }
+    const float norm = sum > 0.0 ? 1.0 / sqrt(sum) : 0.0f;
+    for (int i = 0; i < n_embd; i++) {
+        out[i] = embd[i] * norm;
+    }
+}
+
+// Compute embeddings of texts with the model of the pod, vectors of llama_n_embd() floats each are written one
+// after another into out, texts without tokens get zero vectors. Texts longer than the batch are truncated
+// Returns total number of tokens evaluated or -1 on failure
+int64_t embed_batch(int idx, const char * const * texts, int n, float * out) {
+    llama_pod & pod = ::pods[idx];
+
+    llama_embed_request request = { texts, n, out, {} };
+    auto done = request.done.get_future();
+
+    // NB! Nobody would serve the request of the pod which was never started or is already stopped
+    pod.mutex.lock();
+    if (pod.shutdown || !pod.server.joinable()) {
+        pod.mutex.unlock();
+        return -1;
+    }
+    pod.embeds.push_back(&request);
+    pod.mutex.unlock();
+    pod.ready.notify_one();
+
+    return done.get();
+}
+
+// NB! Called by the serving thread of the pod only
+static int64_t embed_texts(int idx, const char * const * texts, int n, float * out) {
+    llama_context * ctx = embed_context(idx);
+    if (ctx == NULL) {
+        return -1;
+    }
+
+    const llama_model * model = models[idx];
+    const int n_embd  = llama_n_embd(model);
+    const int n_batch = llama_n_batch(ctx);
+    const bool pooled = llama_pooling_type(ctx) != LLAMA_POOLING_TYPE_NONE;
+    const bool add_bos = llama_should_add_bos_token(model);
+
+    // -- tokenize everything first, so batches are packed up to the limit
+
+    std::vector<std::vector<llama_token>> tokens(n);
+    for (int k = 0; k < n; k++) {
+        tokens[k] = ::llama_tokenize(model, texts[k], add_bos, false);
+        if ((int) tokens[k].size() > n_batch) {
+            tokens[k].resize(n_batch);
+        }
+    }
+
+    int64_t n_tokens = 0;
+    llama_batch batch = llama_batch_init(n_batch, 0, 1);
+    std::vector<int32_t> i_last(EMBED_SEQ_MAX); // batch index of the last token of each sequence
+
+    for (int first = 0; first < n; ) {
+
+        // -- pack next texts as separate sequences
+
+        llama_batch_clear(batch);
+        int last = first;
+        for (; last < n && last - first < EMBED_SEQ_MAX && batch.n_tokens + (int) tokens[last].size() <= n_batch; last++) {
+            const llama_seq_id seq = last - first;
+            const int n_seq = tokens[last].size();
+            for (int i = 0; i < n_seq; i++) {
+                llama_batch_add(batch, tokens[last][i], i, { seq }, i == n_seq - 1);
+            }
+            i_last[seq] = batch.n_tokens - 1;
+        }
+
+        llama_kv_cache_clear(ctx);
+        if (batch.n_tokens > 0 && llama_decode(ctx, batch)) {
+            fprintf(stderr, "%s: error: failed to decode embedding batch of pod %d\n", __func__, idx);
+            llama_batch_free(batch);
+            return -1;
+        }
+        n_tokens += batch.n_tokens;
+
+        // -- write vectors right into the caller buffer
+
+        for (int k = first; k < last; k++) {
+            float * vector = out + (size_t) k * n_embd;
+            if (tokens[k].empty()) {
+                std::fill(vector, vector + n_embd, 0.0f);
+                continue;
+            }
+            const float * embd = pooled ? llama_get_embeddings_seq(ctx, k - first) : llama_get_embeddings_ith(ctx, i_last[k - first]);
+            normalize_embedding(embd, vector, n_embd);
+        }
+
+        first = last;
+    }
+
+    llama_kv_cache_clear(ctx);
+    llama_batch_free(batch);
+    return n_tokens;
+}
+
+// --- Bulk inference
+//     Prompts of the JSONL file are streamed right into pod queues without the server in between, so serving loops
+//     keep all slots busy within the multi-sequence batch until the file is over. Prompts are read ahead by windows
+//     sorted by their length in tokens, the longest ones go first and the shortest fill the gaps at the end of the window.
+//     Results are written in the order jobs are done, each line carries the ID of its prompt, or the error for prompts
+//     which could not be processed at all.
+//     Input lines look like {"id":"1","prompt":"...","grammar":"...","schema":{...}}, only the prompt is required
+
+#define BULK_WINDOW  4096 // prompts read ahead and sorted by length
+#define BULK_QUEUED  2    // jobs queued per pod slot, so the next one is already there when the slot is free
+#define BULK_POLL_MS 5    // how long to wait for the oldest running job before looking for any other done
+
+struct llama_bulk_job {
+    std::string id;       // ID of the prompt within the input file
+    size_t n_tokens = 0;  // prompt length in tokens of the first pod model
+    int idx = 0;          // pod doing the job
+    std::unique_ptr<llama_job> job;
+    std::future<int64_t> done;
+};
+
+// Process all prompts of the input file with the first n_pods pods, returns how many of them were done or -1
+int64_t bulk_inference(int n_pods, const std::string & input, const std::string & output) {
+    std::ifstream in(input);
+    if (!in) {
+        fprintf(stderr, "%s: error: failed to open '%s'\n", __func__, input.c_str());
+        return -1;
+    }
+    std::ofstream out(output, std::ios::trunc);
+    if (!out) {
+        fprintf(stderr, "%s: error: failed to create '%s'\n", __func__, output.c_str());
+        return -1;
+    }
+
+    // -- how many jobs each pod takes at once
+
+    std::vector<int> limits(n_pods, 0);
+    std::vector<int> queued(n_pods, 0);
+    for (int idx = 0; idx < n_pods; idx++) {
+        limits[idx] = contexts[idx] ? ::params[idx].n_parallel * BULK_QUEUED : 0;
+    }
+    if (std::all_of(limits.begin(), limits.end(), [](int limit) { return limit == 0; })) {
+        fprintf(stderr, "%s: error: no pods to process prompts\n", __func__);
+        return -1;
+    }
+
+    // NB! Pods usually serve the same model, so prompts are measured with the model of the first one
+    const llama_model * model = models[std::find_if(limits.begin(), limits.end(), [](int limit) { return limit > 0; }) - limits.begin()];
+    const bool add_bos = llama_should_add_bos_token(model);
+
+    const std::string prefix = "bulk-" + std::to_string(ggml_time_us()) + "-";
+    int64_t n_lines = 0;
+    int64_t n_done  = 0;
+
+    std::deque<llama_bulk_job> window; // prompts read ahead
+    std::list<llama_bulk_job> running; // prompts queued into pods
+
+    // NB! The output might end with the broken UTF-8 sequence when the job was aborted
+    auto write = [&](const nlohmann::ordered_json & result) {
+        out << result.dump(-1, ' ', false, nlohmann::ordered_json::error_handler_t::replace) << "\n";
+        out.flush();
+        n_done++;
+    };
+
+    auto read = [&]() {
+        std::string line;
+        while (window.size() < BULK_WINDOW && std::getline(in, line)) {
+            n_lines++;
+            if (line.find_first_not_of(" \t\r") == std::string::npos) continue;
+
+            auto item = nlohmann::ordered_json::parse(line, nullptr, false);
+            std::string id = std::to_string(n_lines);
+            if (item.is_object() && item.contains("id")) {
+                id = item["id"].is_string() ? item["id"].get<std::string>() : item["id"].dump();
+            }
+            if (!item.is_object() || !item.contains("prompt") || !item["prompt"].is_string()) {
+                write({ { "id", id }, { "error", "prompt is missing" } });
+                continue;
+            }
+
+            llama_bulk_job bulk;
+            bulk.id = id;
+            bulk.job = std::make_unique<llama_job>();
+            bulk.job->jobID  = prefix + std::to_string(n_lines);
+            bulk.job->prompt = item["prompt"].get<std::string>();
+            bulk.n_tokens = ::llama_tokenize(model, bulk.job->prompt, add_bos, true).size();
+            if (item.contains("grammar") && item["grammar"].is_string()) {
+                bulk.job->grammar = item["grammar"].get<std::string>();
+            }
+            if (item.contains("schema") && !item["schema"].is_null()) {
+                bulk.job->schema = item["schema"].is_string() ? item["schema"].get<std::string>() : item["schema"].dump();
+            }
+            window.push_back(std::move(bulk));
+        }
+        std::stable_sort(window.begin(), window.end(), [](const llama_bulk_job & a, const llama_bulk_job & b) {
+            return a.n_tokens > b.n_tokens;
+        });
+    };
+
+    for (;;) {
+
+        // -- the next window is read only when the previous one is queued, so it's not reordered endlessly
+
+        if (window.empty()) {
+            read();
+        }
+
+        // -- queue prompts into pods which are least loaded relative to their slots
+
+        while (!window.empty()) {
+            int best = -1;
+            for (int idx = 0; idx < n_pods; idx++) {
+                if (queued[idx] >= limits[idx]) continue;
+                if (best < 0 || (int64_t) queued[idx] * limits[best] < (int64_t) queued[best] * limits[idx]) {
+                    best = idx;
+                }
+            }
+            if (best < 0) break;
+
+            llama_bulk_job & bulk = window.front();
+            bulk.idx = best;
+            bulk.job->record = create_job(bulk.job->jobID);
+            bulk.done = bulk.job->done.get_future();
+            queue_job(best, bulk.job.get(), 0);
+            queued[best]++;
+
+            running.push_back(std::move(bulk));
+            window.pop_front();
+        }
+
+        if (running.empty()) {
+            break; // the window is empty only at the end of the file
+        }
+
+        // -- write results of all jobs done so far
+
+        bool finished = false;
+        for (auto it = running.begin(); it != running.end(); ) {
+            if (it->done.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+                ++it;
+                continue;
+            }
+            it->done.get();
+
+            nlohmann::ordered_json result = { { "id", it->id } };
+            {
+                std::shared_lock<std::shared_mutex> lock(it->job->record->mutex);
+                if (!it->job->record->error.empty()) {
+                    result["error"] = it->job->record->error;
+                } else {
+                    result["output"]        = it->job->record->output;
+                    result["prompt_tokens"] = it->job->record->promptTokenCount;
+                    result["output_tokens"] = it->job->record->outputTokenCount;
+                    if (it->job->record->aborted) {
+                        result["aborted"] = true;
+                    }
+                }
+            }
+            write(result);
+            releaseJobCPP(it->job->jobID);
+
+            queued[it->idx]--;
+            finished = true;
+            it = running.erase(it);
+        }
+
+        if (!finished) {
+            running.front().done.wait_for(std::chrono::milliseconds(BULK_POLL_MS));
+        }
+    }
+
+    return n_done;
+}
+
+// Copy up to cap bytes of the job text starting from the offset, returns how many bytes were copied
+int64_t readOutputCPP(const std::string & jobID, int64_t from, char * buf, int64_t cap) {
+    auto record = find_job(jobID);
+    if (!record) return 0;
+    std::shared_lock<std::shared_mutex> lock(record->mutex);
+    if (from < 0 || from >= (int64_t) record->output.size()) return 0;
+    const int64_t res = std::min(cap, (int64_t) record->output.size() - from);
+    memcpy(buf, record->output.data() + from, res);
+    return res;
+}
+
+int64_t getOutputTokenCountCPP(const std::string & jobID) {
+    auto record = find_job(jobID);
+    if (!record) return 0;
+    std::shared_lock<std::shared_mutex> lock(record->mutex);
+    return record->outputTokenCount;
+}
+
+int64_t promptEvalCPP(const std::string & jobID) {
+    auto record = find_job(jobID);
+    if (!record) return 0;
+    std::shared_lock<std::shared_mutex> lock(record->mutex);
+    return record->promptEval;
+}
+
+int64_t getPromptTokenCountCPP(const std::string & jobID) {
+    auto record = find_job(jobID);
+    if (!record) return 0;
+    std::shared_lock<std::shared_mutex> lock(record->mutex);
+    return record->promptTokenCount;
 }
 
-int64_t promptEvalCPP(const std::string & jobID) {
-    mutex.lock();
-    int64_t res = promptEvals[jobID];
-    mutex.unlock();
-    return res;
+int64_t getDraftTokenCountCPP(const std::string & jobID) {
+    auto record = find_job(jobID);
+    if (!record) return 0;
+    std::shared_lock<std::shared_mutex> lock(record->mutex);
+    return record->draftTokenCount;
 }
 
-int64_t getPromptTokenCountCPP(const std::string & jobID) {
-    mutex.lock();
-    int64_t res = promptTokenCount[jobID];
-    mutex.unlock();
-    return res;
+int64_t getAcceptedTokenCountCPP(const std::string & jobID) {
+    auto record = find_job(jobID);
+    if (!record) return 0;
+    std::shared_lock<std::shared_mutex> lock(record->mutex);
+    return record->acceptedTokenCount;
 }
 
 int64_t timingCPP(const std::string & jobID) {
-    mutex.lock();
-    int64_t res = ::timings[jobID];
-    mutex.unlock();
-    return res;
+    auto record = find_job(jobID);
+    if (!record) return 0;
+    std::shared_lock<std::shared_mutex> lock(record->mutex);
+    return record->timing;
 }
 
 uint32_t getSeedCPP(const std::string & jobID) {
-    mutex.lock();
-    uint32_t res = ::seeds[jobID];
-    mutex.unlock();
-    return res;
+    auto record = find_job(jobID);
+    if (!record) return 0;
+    std::shared_lock<std::shared_mutex> lock(record->mutex);
+    return record->seed;
+}
+
+bool isAbortedCPP(const std::string & jobID) {
+    auto record = find_job(jobID);
+    if (!record) return false;
+    std::shared_lock<std::shared_mutex> lock(record->mutex);
+    return record->aborted;
+}
+
+void releaseJobCPP(const std::string & jobID) {
+    auto & shard = job_shard(jobID);
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    shard.records.erase(jobID);
 }
 
 extern "C" { // ------------------------------------------------------
@@ -683,9 +2986,14 @@ enum ggml_numa_strategy {
 }; 
 */
 
-void init(char * swap, char * debug) {
+void init(char * swap, int64_t swapLimit, char * debug) {
     ::debug = debug;
     ::path_session = swap;
+    ::swapLimit = swapLimit * 1024 * 1024;
+    if (!::path_session.empty()) {
+        std::error_code err;
+        std::filesystem::create_directories(::path_session, err);
+    }
     // fprintf(stderr, "\n\nDEBUG: %s\n\n", debug);
     // fprintf(stderr, "\n\nLEN: %d\n\n", strlen(debug));
     ///// bool showFlag = false;
@@ -694,7 +3002,7 @@ void init(char * swap, char * debug) {
     //if (strlen(debug) == 0) { hide(); fprintf(stderr, "\n\nINSIDE: %d\n\n", strlen(debug)); }
     if (strlen(debug) < 2) hide();
     llama_backend_init();
-    llama_numa_init(GGML_NUMA_STRATEGY_DISABLED); // TODO: NUMA = params.numa
+    llama_numa_init(GGML_NUMA_STRATEGY_DISABLED); // NB! Pods are bound to NUMA nodes one by one within initContext()
     ///// if (showFlag) { show(); }
     show();
 }
@@ -704,9 +3012,19 @@ void * initContext(
     int idx, 
     char * modelName, 
     int threads, 
+    int numa,
+    char * cpus,
     int batch_size, 
+    int budget,
+    int slots,
+    char * draftName,
+    int n_draft,
+    int lookup,
+    char * lookupStatic,
+    char * lookupDynamic,
     int gpu1, int gpu2, int gpu3, int gpu4, 
     int context, int predict,
+    int keep, int window,
     int32_t mirostat, float mirostat_tau, float mirostat_eta,
     float temperature, int top_k, float top_p,
     float typical_p, 
@@ -720,7 +3038,18 @@ void * initContext(
     ::params[idx].model           = modelName;
     ::params[idx].n_threads       = threads;
     ::params[idx].n_batch         = batch_size;
+    ::params[idx].n_budget        = budget > 0 ? budget : 0;
+    ::params[idx].n_parallel      = slots > 0 ? slots : 1;
     ::params[idx].n_threads_batch = ::params[idx].n_threads_batch == -1 ? threads : ::params[idx].n_threads_batch;
+    ::params[idx].numa_node       = numa >= 0 ? numa : -1;
+    ::params[idx].cpus            = cpus;
+
+    ::params[idx].model_draft     = draftName;
+    ::params[idx].n_draft         = n_draft > 0 ? n_draft : 5;
+
+    ::pods[idx].lookup                 = lookup;
+    ::params[idx].lookup_cache_static  = lookupStatic;
+    ::params[idx].lookup_cache_dynamic = lookupDynamic;
 
     ::params[idx].main_gpu        = 0; // TODO: Main GPU depending on tensor split
     ::params[idx].n_gpu_layers    = gpu1 + gpu2 + gpu3 + gpu4; // TODO: variable number of GPUs
@@ -731,6 +3060,8 @@ void * initContext(
 
     ::params[idx].n_ctx           = context;
     ::params[idx].n_predict       = predict;
+    ::params[idx].n_keep          = keep;
+    ::params[idx].n_window        = window > 0 ? window : 0;
 
     // -- Janus sampling
 
@@ -757,36 +3088,112 @@ void * initContext(
     
     ::params[idx].seed            = seed;
     
+    // -- the calling thread is bound to the NUMA node only while the pod allocates its memory,
+    //    the weights replica is loaded without mmap, so it's not shared with pods of other nodes via page cache
+
+    auto affinity = thread_affinity();
+    if (::params[idx].numa_node >= 0) {
+        if (bind_thread(numa_cpus(::params[idx].numa_node))) {
+            ::params[idx].use_mmap = false;
+        } else {
+            fprintf(stderr, "%s: warning: failed to bind the pod to NUMA node %d\n", __func__, ::params[idx].numa_node);
+            ::params[idx].numa_node = -1;
+        }
+    }
+
+    // -- CPUs listed explicitly take precedence over ones of the NUMA node
+
+    ::pods[idx].cpus = parse_cpus(::params[idx].cpus);
+    if (::pods[idx].cpus.empty() && ::params[idx].numa_node >= 0) {
+        ::pods[idx].cpus = numa_cpus(::params[idx].numa_node);
+    }
+
     bool showFlag = false;
     if (strstr(debug, "cuda") != NULL) { hide(); showFlag = true; }
     auto res = init_context(idx);
     if (showFlag) { show(); }
 
+    if (::params[idx].numa_node >= 0) {
+        bind_thread(affinity);
+    }
+
     return res;
 }
 
+// stop the pod after all its jobs are done and free its contexts, compute threads and models
+void freeContext(int idx) {
+    free_context(idx);
+}
+
 int64_t doInference(
     int idx, 
     void * ctx, 
     char * jobID, 
     char * sessionID, 
-    char * prompt) {
+    char * prompt,
+    char * grammar,
+    char * schema,
+    int priority,
+    char * tenant,
+    int choices,
+    int64_t timeout) {
     
     std::string id = jobID;
     std::string text = prompt;
     std::string session = sessionID;
+    std::string rules = grammar;
+    std::string format = schema;
+    std::string owner = tenant;
     
-    return do_inference(idx, (struct llama_context *)ctx, id, session, text);
+    return do_inference(idx, (struct llama_context *)ctx, id, session, text, rules, format, priority, owner, choices, timeout);
+}
+
+// set the fair-share weight of the tenant, jobs of the tenant with weight 2 get twice more tokens than ones with 1
+void setTenant(char * tenant, float weight) {
+    std::lock_guard<std::mutex> lock(tenantsMutex);
+    tenantWeights[tenant] = weight > 0 ? weight : 1.0f;
+}
+
+// stop the job either waiting in the pod queue or running within one of its slots
+void stopInference(int idx, char * jobID) {
+    std::string id = jobID;
+
+    ::pods[idx].mutex.lock();
+
+    // NB! Preempted jobs are stopped by the serving thread, which owns their parked state
+    auto & queue = ::pods[idx].queue;
+    auto it = std::find_if(queue.begin(), queue.end(), [&id](llama_job * job) { return job->jobID == id; });
+    if (it != queue.end() && !(*it)->parked) {
+        abort_job(*it);
+        release_branches(*it);
+        (*it)->done.set_value(0);
+        queue.erase(it);
+    } else {
+        ::pods[idx].stops.insert(id);
+        // the running job is aborted right in the middle of the decode, no need to wait for the next step
+        auto record = find_job(id);
+        if (it == queue.end() && record) {
+            std::shared_lock<std::shared_mutex> lockRecord(record->mutex);
+            if (record->t_finished_us == 0) {
+                ::pods[idx].abort = true;
+            }
+        }
+    }
+
+    ::pods[idx].mutex.unlock();
+    ::pods[idx].ready.notify_one();
 }
 
-void stopInference(int idx) {
-    ::stopInferenceFlags[idx] = true;
+// return only the part of the job text starting from the byte offset, so pollers do not copy the whole text each time
+int64_t readOutput(char * jobID, int64_t from, char * buf, int64_t cap) {
+    std::string id = jobID;
+    return readOutputCPP(id, from, buf, cap);
 }
 
-// return current result of processing
-const char * status(char * jobID) {
+// return how many tokens were generated so far, pollers might skip reading while it is the same
+int64_t getOutputTokenCount(char * jobID) {
     std::string id = jobID;
-    return statusCPP(id);
+    return getOutputTokenCountCPP(id);
 }
 
 // return average PROMPT token processing timing from context
@@ -807,11 +3214,54 @@ int64_t timing(char * jobID) {
     return timingCPP(id);
 }
 
+// return how many tokens were proposed by the draft model
+int64_t getDraftTokenCount(char * jobID) {
+    std::string id = jobID;
+    return getDraftTokenCountCPP(id);
+}
+
+// return how many drafted tokens were accepted by the main model
+int64_t getAcceptedTokenCount(char * jobID) {
+    std::string id = jobID;
+    return getAcceptedTokenCountCPP(id);
+}
+
 uint32_t getSeed(char * jobID) {
     std::string id = jobID;
     return getSeedCPP(id);
 }
 
+// return 1 when the job was stopped or hit its deadline before the output was complete
+int isAborted(char * jobID) {
+    std::string id = jobID;
+    return isAbortedCPP(id) ? 1 : 0;
+}
+
+// forget the job output and stats, the running job keeps its record until finished
+void releaseJob(char * jobID) {
+    std::string id = jobID;
+    releaseJobCPP(id);
+}
+
+// process all prompts of the JSONL file with the first n pods, writing results into another JSONL file as they done
+// returns how many prompts were processed or -1 on failure
+int64_t bulkInference(int pods, char * input, char * output) {
+    std::string in = input;
+    std::string out = output;
+    return bulk_inference(pods, in, out);
+}
+
+// size of embedding vectors computed by the pod
+int embedSize(int idx) {
+    return models[idx] ? llama_n_embd(models[idx]) : 0;
+}
+
+// compute L2 normalised embeddings of n texts into out of n * embedSize() floats
+// returns total number of tokens evaluated or -1 on failure
+int64_t embedBatch(int idx, char ** texts, int n, float * out) {
+    return embed_batch(idx, texts, n, out);
+}
+
 }  // ------------------------------------------------------
 
 //
@@ -924,18 +3374,153 @@ void llama_batch_add(
 
 // ------------------------------------------------------
 
+// --- Grammar masks
+//     Checking every vocab token against the grammar is the most expensive part of constrained sampling,
+//     while the set of allowed tokens depends only on the grammar state. So the mask of allowed tokens is computed
+//     once when the state is met for the first time, then it's shared between all jobs with the same grammar and model
+
+#define GRAMMAR_MASKS 1024 // max grammar states with cached masks per grammar, least recently used ones are dropped
+
+typedef std::pair<std::string, std::shared_ptr<const std::vector<uint64_t>>> llama_grammar_mask; // grammar state, bitset of allowed tokens
+
+struct llama_grammar_masks {
+    std::mutex mutex;
+    std::list<llama_grammar_mask> list; // most recently used first
+    std::unordered_map<std::string, std::list<llama_grammar_mask>::iterator> masks; // [ grammar state ] -> entry
+};
+
+std::mutex grammarsMutex;
+std::unordered_map<std::string, std::weak_ptr<llama_grammar_masks>> grammarMasks; // [ model + grammar ] -> masks
+
+static std::shared_ptr<llama_grammar_masks> acquire_masks(const llama_model * model, const std::string & grammar) {
+    std::lock_guard<std::mutex> lock(grammarsMutex);
+
+    // forget grammars which are not used by any job anymore
+    for (auto it = grammarMasks.begin(); it != grammarMasks.end(); ) {
+        it = it->second.expired() ? grammarMasks.erase(it) : std::next(it);
+    }
+
+    auto & weak = grammarMasks[std::to_string((uintptr_t) model) + "|" + grammar];
+    auto masks = weak.lock();
+    if (!masks) {
+        masks = std::make_shared<llama_grammar_masks>();
+        weak = masks;
+    }
+
+    return masks;
+}
+
+// Grammar state independent of where the rules are placed in memory: stacks of rule element offsets plus partial UTF-8
+static std::string grammar_state(struct llama_sampling_context * ctx_sampling) {
+
+    const llama_grammar * grammar = ctx_sampling->grammar;
+    auto & bases = ctx_sampling->grammar_bases;
+
+    // NB! Rules are never changed after the grammar was created
+    if (bases.empty()) {
+        uint32_t offset = 0;
+        for (const auto & rule : grammar->rules) {
+            bases.push_back({ rule.data(), offset });
+            offset += rule.size();
+        }
+        std::sort(bases.begin(), bases.end());
+    }
+
+    std::vector<uint32_t> state = { grammar->partial_utf8.value, (uint32_t) grammar->partial_utf8.n_remain };
+
+    for (const auto & stack : grammar->stacks) {
+        state.push_back(stack.size());
+        for (auto element : stack) {
+            auto base = std::upper_bound(bases.begin(), bases.end(), std::make_pair(element, UINT32_MAX)) - 1;
+            state.push_back(base->second + (element - base->first));
+        }
+    }
+
+    return std::string((const char *) state.data(), state.size() * sizeof(uint32_t));
+}
+
+// Bitset of tokens allowed by the grammar within its current state
+static std::shared_ptr<const std::vector<uint64_t>> grammar_mask(
+                  struct llama_sampling_context * ctx_sampling,
+                  struct llama_context * ctx_main) {
+
+    auto & cache = *ctx_sampling->masks;
+    const std::string state = grammar_state(ctx_sampling);
+
+    {
+        std::lock_guard<std::mutex> lock(cache.mutex);
+        auto it = cache.masks.find(state);
+        if (it != cache.masks.end()) {
+            cache.list.splice(cache.list.begin(), cache.list, it->second);
+            return it->second->second;
+        }
+    }
+
+    // NB! The mask is computed without the lock, so rarely the same state might be computed twice by different pods
+    const int n_vocab = llama_n_vocab(llama_get_model(ctx_main));
+
+    std::vector<llama_token_data> cur(n_vocab);
+    for (llama_token id = 0; id < n_vocab; id++) {
+        cur[id] = llama_token_data{ id, 0.0f, 0.0f };
+    }
+
+    llama_token_data_array cur_p = { cur.data(), cur.size(), false };
+    llama_sample_grammar(ctx_main, &cur_p, ctx_sampling->grammar);
+
+    auto mask = std::make_shared<std::vector<uint64_t>>((n_vocab + 63) / 64, 0);
+    for (llama_token id = 0; id < n_vocab; id++) {
+        if (cur[id].logit != -INFINITY) {
+            (*mask)[id >> 6] |= 1ULL << (id & 63);
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(cache.mutex);
+
+    auto it = cache.masks.find(state);
+    if (it != cache.masks.end()) {
+        cache.list.erase(it->second);
+    } else if (cache.list.size() >= GRAMMAR_MASKS) {
+        cache.masks.erase(cache.list.back().first);
+        cache.list.pop_back();
+    }
+
+    cache.list.push_front({ state, mask });
+    cache.masks[state] = cache.list.begin();
+
+    return mask;
+}
+
+// Drop all candidates which are not allowed by the grammar
+static void llama_sample_grammar_masked(
+                  struct llama_sampling_context * ctx_sampling,
+                  struct llama_context * ctx_main,
+                  llama_token_data_array * cur_p) {
+
+    const auto mask = grammar_mask(ctx_sampling, ctx_main);
+    const uint64_t * bits = mask->data();
+
+    for (size_t i = 0; i < cur_p->size; i++) {
+        const llama_token id = cur_p->data[i].id;
+        if (!((bits[id >> 6] >> (id & 63)) & 1)) {
+            cur_p->data[i].logit = -INFINITY;
+        }
+    }
+}
+
+// ------------------------------------------------------
+
 struct llama_sampling_context * llama_sampling_init(const struct llama_sampling_params & params) {
     struct llama_sampling_context * result = new llama_sampling_context();
 
     result->params  = params;
     result->grammar = nullptr;
-/*
+
     // if there is a grammar, parse it
     if (!params.grammar.empty()) {
         result->parsed_grammar = grammar_parser::parse(params.grammar.c_str());
 
         // will be empty (default) if there are parse errors
-        if (result->parsed_grammar.rules.empty()) {
+        if (result->parsed_grammar.rules.empty() || result->parsed_grammar.symbol_ids.count("root") == 0) {
             fprintf(stderr, "%s: failed to parse grammar\n", __func__);
             delete result;
             return nullptr;
@@ -943,16 +3528,30 @@ struct llama_sampling_context * llama_sampling_init(const struct llama_sampling_
 
         std::vector<const llama_grammar_element *> grammar_rules(result->parsed_grammar.c_rules());
 
-        result->grammar = llama_grammar_init(
-                grammar_rules.data(),
-                grammar_rules.size(), result->parsed_grammar.symbol_ids.at("root"));
+        try {
+            result->grammar = llama_grammar_init(
+                    grammar_rules.data(),
+                    grammar_rules.size(), result->parsed_grammar.symbol_ids.at("root"));
+        } catch (const std::exception & err) {
+            fprintf(stderr, "%s: error: %s\n", __func__, err.what());
+            delete result;
+            return nullptr;
+        }
     }
-*/
-    result->prev.resize(params.n_prev);
+
+    result->prev.assign(params.n_prev, 0);
 
     return result;
 }
 
+void llama_sampling_free(struct llama_sampling_context * ctx) {
+    if (ctx->grammar != NULL) {
+        llama_grammar_free(ctx->grammar);
+    }
+
+    delete ctx;
+}
+
 // -- FIXME: DUP BRIDGE + JANUS
 
 // no reasons to expose this function in header
@@ -960,7 +3559,8 @@ static void sampler_queue(
                    struct llama_context * ctx_main,
             const llama_sampling_params & params,
                  llama_token_data_array & cur_p,
-                                 size_t   min_keep) {
+                                 size_t   min_keep,
+                                 size_t   first = 0) { // samplers before this one were already applied
     const float         temp              = params.temp;
     const float         dynatemp_range    = params.dynatemp_range;
     const float         dynatemp_exponent = params.dynatemp_exponent;
@@ -971,8 +3571,8 @@ static void sampler_queue(
     const float         typical_p         = params.typical_p;
     const std::vector<llama_sampler_type> & samplers_sequence = params.samplers_sequence;
 
-    for (auto sampler_type : samplers_sequence) {
-        switch (sampler_type) {
+    for (size_t i = first; i < samplers_sequence.size(); i++) {
+        switch (samplers_sequence[i]) {
             case llama_sampler_type::TOP_K    : llama_sample_top_k    (ctx_main, &cur_p, top_k,     min_keep); break;
             case llama_sampler_type::TFS_Z    : llama_sample_tail_free(ctx_main, &cur_p, tfs_z,     min_keep); break;
             case llama_sampler_type::TYPICAL_P: llama_sample_typical  (ctx_main, &cur_p, typical_p, min_keep); break;
@@ -992,13 +3592,57 @@ static void sampler_queue(
     }
 }
 
-static llama_token_data_array llama_sampling_prepare_impl(
+// The same as llama_sample_repetition_penalties(), but consumes the token history as two spans of the ring buffer
+// NB! Penalties are applied right to the logits, so only tokens from the history are visited
+static void sample_penalties(
+                                  float * logits,
+                                 size_t   n_vocab,
+     ring_buffer<llama_token>::span older,
+     ring_buffer<llama_token>::span newer,
+                                  float penalty_repeat,
+                                  float penalty_freq,
+                                  float penalty_present) {
+
+    if (older.size + newer.size == 0 || (penalty_repeat == 1.0f && penalty_freq == 0.0f && penalty_present == 0.0f)) {
+        return;
+    }
+
+    // create a frequency map to count occurrences of each token in the history
+    std::unordered_map<llama_token, int> token_count;
+    for (size_t i = 0; i < older.size; ++i) {
+        token_count[older.data[i]]++;
+    }
+    for (size_t i = 0; i < newer.size; ++i) {
+        token_count[newer.data[i]]++;
+    }
+
+    for (const auto & it : token_count) {
+        if (it.first < 0 || (size_t) it.first >= n_vocab) {
+            continue;
+        }
+
+        float & logit = logits[it.first];
+        const int count = it.second;
+
+        if (logit <= 0) {
+            logit *= penalty_repeat;
+        } else {
+            logit /= penalty_repeat;
+        }
+
+        logit -= float(count) * penalty_freq + float(count > 0) * penalty_present;
+    }
+}
+
+// Apply logit bias, guidance and penalties to the logits of the sequence and return the result
+// NB! Logits of the context are never changed, the copy is made within the sampling context only when there are
+//     any changes to apply, so the same logits might be sampled again [ grammar resampling or parallel choices ]
+static const float * llama_sampling_apply(
                   struct llama_sampling_context * ctx_sampling,
                   struct llama_context * ctx_main,
                   struct llama_context * ctx_cfg,
                   const int idx,
-                  bool apply_grammar,
-                  std::vector<float> * original_logits) {
+                  const float * original) {
     const llama_sampling_params & params = ctx_sampling->params;
 
     const int n_vocab = llama_n_vocab(llama_get_model(ctx_main));
@@ -1010,18 +3654,26 @@ static llama_token_data_array llama_sampling_prepare_impl(
 
     const bool    penalize_nl     = params.penalize_nl;
 
-    auto & prev = ctx_sampling->prev;
-    auto & cur  = ctx_sampling->cur;
+    // -- find out penalized tokens first, most of the time there is nothing else to apply
 
-    // Get a pointer to the logits
-    float * logits = llama_get_logits_ith(ctx_main, idx);
+    std::pair<ring_buffer<llama_token>::span, ring_buffer<llama_token>::span> penalty_tokens;
+    if (params.use_penalty_prompt_tokens) {
+        const size_t n = std::min(params.penalty_prompt_tokens.size(), (size_t) std::max(penalty_last_n, 0));
+        penalty_tokens.first  = { params.penalty_prompt_tokens.data() + params.penalty_prompt_tokens.size() - n, n };
+        penalty_tokens.second = { nullptr, 0 };
+    } else {
+        penalty_tokens = ctx_sampling->prev.last(std::max(penalty_last_n, 0));
+    }
+    const int penalty_tokens_used_size = penalty_tokens.first.size + penalty_tokens.second.size;
 
-    if (ctx_sampling->grammar != NULL && !apply_grammar) {
-        GGML_ASSERT(original_logits != NULL);
-        // Only make a copy of the original logits if we are not applying grammar checks, not sure if I actually have to do this.
-        *original_logits = {logits, logits + llama_n_vocab(llama_get_model(ctx_main))};
+    if (params.logit_bias.empty() && !ctx_cfg && !penalty_tokens_used_size) {
+        return original;
     }
 
+    auto & logits_vec = ctx_sampling->logits;
+    logits_vec.assign(original, original + n_vocab);
+    float * logits = logits_vec.data();
+
     // apply params.logit_bias map
     for (auto it = params.logit_bias.begin(); it != params.logit_bias.end(); it++) {
         logits[it->first] += it->second;
@@ -1032,37 +3684,59 @@ static llama_token_data_array llama_sampling_prepare_impl(
         llama_sample_apply_guidance(ctx_main, logits, logits_guidance, params.cfg_scale);
     }
 
-    cur.clear();
+    // apply penalties
+    if (penalty_tokens_used_size) {
+        const llama_token nl = llama_token_nl(llama_get_model(ctx_main));
+        const float nl_logit = nl >= 0 && nl < n_vocab ? logits[nl] : 0.0f;
+
+        sample_penalties(logits, n_vocab, penalty_tokens.first, penalty_tokens.second, penalty_repeat, penalty_freq, penalty_present);
 
-    for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
-        cur.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
+        if (!penalize_nl && nl >= 0 && nl < n_vocab) {
+            logits[nl] = nl_logit;
+        }
     }
 
-    llama_token_data_array cur_p = { cur.data(), cur.size(), false };
+    return logits;
+}
 
-    // apply penalties
-    const auto& penalty_tokens = params.use_penalty_prompt_tokens ? params.penalty_prompt_tokens : prev;
-    const int penalty_tokens_used_size = std::min((int)penalty_tokens.size(), penalty_last_n);
-    if (penalty_tokens_used_size) {
-        const float nl_logit = logits[llama_token_nl(llama_get_model(ctx_main))];
+static llama_token_data_array llama_sampling_prepare_impl(
+                  struct llama_sampling_context * ctx_sampling,
+                  struct llama_context * ctx_main,
+                  struct llama_context * ctx_cfg,
+                  const int idx,
+                  bool apply_grammar,
+                  std::vector<float> * original_logits) {
 
-        llama_sample_repetition_penalties(ctx_main, &cur_p,
-                penalty_tokens.data() + penalty_tokens.size() - penalty_tokens_used_size,
-                penalty_tokens_used_size, penalty_repeat, penalty_freq, penalty_present);
+    const int n_vocab = llama_n_vocab(llama_get_model(ctx_main));
 
-        if (!penalize_nl) {
-            for (size_t idx = 0; idx < cur_p.size; idx++) {
-                if (cur_p.data[idx].id == llama_token_nl(llama_get_model(ctx_main))) {
-                    cur_p.data[idx].logit = nl_logit;
-                    break;
-                }
-            }
-        }
+    auto & cur  = ctx_sampling->cur;
+
+    // Get a pointer to the logits
+    float * logits = llama_get_logits_ith(ctx_main, idx);
+
+    if (ctx_sampling->grammar != NULL && !apply_grammar) {
+        GGML_ASSERT(original_logits != NULL);
+        // Only make a copy of the original logits if we are not applying grammar checks, not sure if I actually have to do this.
+        *original_logits = {logits, logits + llama_n_vocab(llama_get_model(ctx_main))};
+    }
+
+    const float * biased = llama_sampling_apply(ctx_sampling, ctx_main, ctx_cfg, idx, logits);
+
+    cur.resize(n_vocab);
+
+    for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
+        cur[token_id] = llama_token_data{token_id, biased[token_id], 0.0f};
     }
 
+    llama_token_data_array cur_p = { cur.data(), cur.size(), false };
+
     // apply grammar checks before sampling logic
     if (apply_grammar && ctx_sampling->grammar != NULL) {
-        llama_sample_grammar(ctx_main, &cur_p, ctx_sampling->grammar);
+        if (ctx_sampling->masks) {
+            llama_sample_grammar_masked(ctx_sampling, ctx_main, &cur_p);
+        } else {
+            llama_sample_grammar(ctx_main, &cur_p, ctx_sampling->grammar);
+        }
     }
 
     return cur_p;
@@ -1078,6 +3752,113 @@ llama_token_data_array llama_sampling_prepare(
     return llama_sampling_prepare_impl(ctx_sampling,ctx_main, ctx_cfg, idx, apply_grammar, original_logits);
 }
 
+// -- Fused sampling
+
+// Ordering of llama_sample_top_k(), ties are resolved by token ID the same way
+static inline bool better_token(const llama_token_data & a, const llama_token_data & b) {
+    return a.logit > b.logit || (a.logit == b.logit && a.id < b.id);
+}
+
+// Select top k logits within the single pass over the vocab, the result is sorted in descending order
+// NB! The heap keeps the worst selected token on top, so most blocks of the vocab are skipped after the single compare
+static void top_k_logits(const float * logits, const int n_vocab, const int k, std::vector<llama_token_data> & top) {
+
+    top.clear();
+    for (llama_token id = 0; id < k; id++) {
+        top.push_back(llama_token_data{id, logits[id], 0.0f});
+    }
+    std::make_heap(top.begin(), top.end(), better_token);
+
+    auto consider = [&top](llama_token id, float logit) {
+        if (logit > top.front().logit) {
+            std::pop_heap(top.begin(), top.end(), better_token);
+            top.back() = llama_token_data{id, logit, 0.0f};
+            std::push_heap(top.begin(), top.end(), better_token);
+        }
+    };
+
+    int i = k;
+
+#if defined(__AVX2__)
+    for (; i + 8 <= n_vocab; i += 8) {
+        const __m256 v = _mm256_loadu_ps(logits + i);
+        if (_mm256_movemask_ps(_mm256_cmp_ps(v, _mm256_set1_ps(top.front().logit), _CMP_GT_OQ)) == 0) {
+            continue;
+        }
+        for (int j = i; j < i + 8; j++) {
+            consider(j, logits[j]);
+        }
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    for (; i + 4 <= n_vocab; i += 4) {
+        const float32x4_t v = vld1q_f32(logits + i);
+        if (vmaxvq_u32(vcgtq_f32(v, vdupq_n_f32(top.front().logit))) == 0) {
+            continue;
+        }
+        for (int j = i; j < i + 4; j++) {
+            consider(j, logits[j]);
+        }
+    }
+#endif
+
+    for (; i < n_vocab; i++) {
+        consider(i, logits[i]);
+    }
+
+    std::sort_heap(top.begin(), top.end(), better_token);
+}
+
+// Top-K sampler is the first one within the chain and cuts the vocab, so the rest of chain might work only with its survivors.
+// The fused sampler selects them without building and sorting candidates for the whole vocab
+// and gives the same tokens as the full chain with the same RNG state
+// NB! Only Top-K itself is fused, the rest of the chain [ softmax included ] runs over its survivors as before.
+//     Both ways put tied logits in the order of token IDs, so the output is the same for ties too
+static bool llama_sampling_fusable(const llama_sampling_context * ctx_sampling, const int n_vocab, int & k) {
+    const llama_sampling_params & params = ctx_sampling->params;
+
+    if (params.temp <= 0.0 || params.mirostat != 0 || ctx_sampling->grammar != NULL) {
+        return false;
+    }
+
+    if (params.samplers_sequence.empty() || params.samplers_sequence[0] != llama_sampler_type::TOP_K) {
+        return false;
+    }
+
+    // the same limits as llama_sample_top_k() uses
+    k = params.top_k <= 0 ? n_vocab : params.top_k;
+    k = std::max(k, std::max(1, params.min_keep));
+    k = std::min(k, n_vocab);
+
+    return k < n_vocab;
+}
+
+static llama_token llama_sampling_sample_fused(
+                  struct llama_sampling_context * ctx_sampling,
+                  struct llama_context * ctx_main,
+                  struct llama_context * ctx_cfg,
+                  const int idx,
+                  const int k) {
+    const llama_sampling_params & params = ctx_sampling->params;
+
+    const int n_vocab = llama_n_vocab(llama_get_model(ctx_main));
+    const float * logits = llama_sampling_apply(ctx_sampling, ctx_main, ctx_cfg, idx, llama_get_logits_ith(ctx_main, idx));
+
+    auto & cur = ctx_sampling->cur;
+    top_k_logits(logits, n_vocab, k, cur);
+
+    llama_token_data_array cur_p = { cur.data(), cur.size(), true };
+
+    // -- the rest of the chain after Top-K
+    size_t min_keep = std::max(1, params.min_keep);
+    sampler_queue(ctx_main, params, cur_p, min_keep, 1);
+
+    llama_token id = llama_sample_token_with_rng(ctx_main, &cur_p, ctx_sampling->rng);
+
+    ctx_sampling->n_valid = cur_p.size;
+
+    return id;
+}
+
 static llama_token llama_sampling_sample_impl(
                   struct llama_sampling_context * ctx_sampling,
                   struct llama_context * ctx_main,
@@ -1091,9 +3872,18 @@ static llama_token llama_sampling_sample_impl(
     const float   mirostat_tau    = params.mirostat_tau;
     const float   mirostat_eta    = params.mirostat_eta;
 
+    // fast path for the most common chains
+    int k = 0;
+    if (!is_resampling && llama_sampling_fusable(ctx_sampling, llama_n_vocab(llama_get_model(ctx_main)), k)) {
+        return llama_sampling_sample_fused(ctx_sampling, ctx_main, ctx_cfg, idx, k);
+    }
+
+    // NB! With cached masks the grammar is cheap enough to be applied right away instead of checking the sampled token first
+    const bool apply_grammar = is_resampling || ctx_sampling->masks != nullptr;
+
     std::vector<float> original_logits;
-    auto cur_p = llama_sampling_prepare(ctx_sampling, ctx_main, ctx_cfg, idx, /* apply_grammar= */ is_resampling, &original_logits);
-    if (ctx_sampling->grammar != NULL && !is_resampling) {
+    auto cur_p = llama_sampling_prepare(ctx_sampling, ctx_main, ctx_cfg, idx, apply_grammar, &original_logits);
+    if (ctx_sampling->grammar != NULL && !apply_grammar) {
         GGML_ASSERT(!original_logits.empty());
     }
     llama_token id = 0;
@@ -1138,7 +3928,7 @@ static llama_token llama_sampling_sample_impl(
         }
     }
 
-    if (ctx_sampling->grammar != NULL && !is_resampling) {
+    if (ctx_sampling->grammar != NULL && !apply_grammar) {
         // Create an array with a single token data element for the sampled id
         llama_token_data single_token_data = {id, logits[id], 0.0f};
         llama_token_data_array single_token_data_array = { &single_token_data, 1, false };
@@ -1179,7 +3969,6 @@ void llama_sampling_accept(
         struct llama_context * ctx_main,
         llama_token id,
         bool apply_grammar) {
-    ctx_sampling->prev.erase(ctx_sampling->prev.begin());
     ctx_sampling->prev.push_back(id);
 
     if (ctx_sampling->grammar != NULL && apply_grammar) {
@@ -1230,6 +4019,57 @@ int32_t cpu_get_num_physical_cores() {
 }
 
 
+#if defined(__x86_64__) && defined(__linux__) && !defined(__ANDROID__)
+#include <pthread.h>
+#include <unistd.h>
+
+static void cpuid(unsigned leaf, unsigned subleaf,
+                  unsigned *eax, unsigned *ebx, unsigned *ecx, unsigned *edx) {
+    __asm__("movq\t%%rbx,%%rsi\n\t"
+            "cpuid\n\t"
+            "xchgq\t%%rbx,%%rsi"
+            : "=a"(*eax), "=S"(*ebx), "=c"(*ecx), "=d"(*edx)
+            : "0"(leaf), "2"(subleaf));
+}
+
+static int pin_cpu(int cpu) {
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    CPU_SET(cpu, &mask);
+    return pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask);
+}
+
+static bool is_hybrid_cpu(void) {
+    unsigned eax, ebx, ecx, edx;
+    cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+    return !!(edx & (1u << 15));
+}
+
+static bool is_running_on_efficiency_core(void) {
+    unsigned eax, ebx, ecx, edx;
+    cpuid(0x1a, 0, &eax, &ebx, &ecx, &edx);
+    int intel_atom = 0x20;
+    int core_type = (eax & 0xff000000u) >> 24;
+    return core_type == intel_atom;
+}
+
+static int cpu_count_math_cpus(int n_cpu) {
+    int result = 0;
+    for (int cpu = 0; cpu < n_cpu; ++cpu) {
+        if (pin_cpu(cpu)) {
+            return -1;
+        }
+        if (is_running_on_efficiency_core()) {
+            continue; // efficiency cores harm lockstep threading
+        }
+        ++cpu; // hyperthreading isn't useful for linear algebra
+        ++result;
+    }
+    return result;
+}
+
+#endif // __x86_64__ && __linux__
+
 /**
  * Returns number of CPUs on system that are useful for math.
  */
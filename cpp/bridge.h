@@ -2,6 +2,8 @@
 
 #include <string>
 #include <vector>
+#include <algorithm>
+#include <memory>
 #include <unordered_map>
 
 #if !defined (_WIN32)
@@ -183,8 +185,10 @@ struct gpt_params {
     int32_t n_predict             =    -1; // new tokens to predict
     int32_t n_ctx                 =     0; // context size
     int32_t n_batch               =  2048; // logical batch size for prompt processing (must be >=32 to use BLAS)
+    int32_t n_budget              =     0; // max tokens evaluated per step, longer prompts are split into chunks [ 0 = n_batch ]
     int32_t n_ubatch              =   512; // physical batch size for prompt processing (must be >=32 to use BLAS)
     int32_t n_keep                =     0; // number of tokens to keep from initial prompt
+    int32_t n_window              =     0; // evict the oldest tokens in steps of n_window instead of a half of the context [ 0 = disabled ]
     int32_t n_draft               =     5; // number of tokens to draft during speculative decoding
     int32_t n_chunks              =    -1; // max number of chunks to process (-1 = unlimited)
     int32_t n_parallel            =     1; // number of parallel sequences to decode
@@ -211,6 +215,8 @@ struct gpt_params {
     void * cb_eval_user_data                 = nullptr;
 
     ggml_numa_strategy numa = GGML_NUMA_STRATEGY_DISABLED;
+    int32_t numa_node       = -1; // NUMA node to bind threads and memory of the pod [ -1 = not bound ]
+    std::string cpus        = ""; // CPUs for compute threads of the pod like "0-15,32-47" [ empty = any or CPUs of NUMA node ]
 
     enum llama_split_mode        split_mode        = LLAMA_SPLIT_MODE_LAYER; // how to split the model across GPUs
     enum llama_rope_scaling_type rope_scaling_type = LLAMA_ROPE_SCALING_TYPE_UNSPECIFIED;
@@ -367,6 +373,66 @@ struct gpt_params {
 // Create a new sampling context instance.
 struct llama_sampling_context * llama_sampling_init(const struct llama_sampling_params & params);
 
+// Free the sampling context instance along with its grammar.
+void llama_sampling_free(struct llama_sampling_context * ctx);
+
+// Fixed capacity ring buffer for the history of recent tokens, the oldest items are overwritten when it's full
+// NB! The last items are exposed as at most two contiguous spans, so they could be consumed without copying
+template<typename T>
+struct ring_buffer {
+
+    struct span {
+        const T * data;
+        size_t    size;
+    };
+
+    // fill the whole capacity with the value, so the buffer is always full like the vector it replaces
+    void assign(size_t capacity, const T & value) {
+        items.assign(capacity, value);
+        first = 0;
+        count = capacity;
+    }
+
+    void fill(const T & value) {
+        std::fill(items.begin(), items.end(), value);
+    }
+
+    void push_back(const T & value) {
+        if (items.empty()) return;
+        if (count < items.size()) {
+            items[(first + count++) % items.size()] = value;
+            return;
+        }
+        items[first] = value;
+        first = (first + 1) % items.size();
+    }
+
+    size_t size() const { return count; }
+    size_t capacity() const { return items.size(); }
+    bool empty() const { return count == 0; }
+
+    // i-th item from the oldest one
+    const T & operator[](size_t i) const { return items[(first + i) % items.size()]; }
+
+    // i-th item from the newest one
+    const T & rat(size_t i) const { return items[(first + count - 1 - i) % items.size()]; }
+
+    const T & back() const { return rat(0); }
+
+    // the last n items as [ older, newer ] spans, the second one is empty when there is no wrap
+    std::pair<span, span> last(size_t n) const {
+        n = std::min(n, count);
+        const size_t start = (first + count - n) % std::max(items.size(), (size_t) 1);
+        const size_t head  = std::min(n, items.size() - start);
+        return { span{ items.data() + start, head }, span{ items.data(), n - head } };
+    }
+
+private:
+    std::vector<T> items;
+    size_t first = 0; // index of the oldest item
+    size_t count = 0;
+};
+
 // general sampler context
 // TODO: move to llama.h
 struct llama_sampling_context {
@@ -381,9 +447,13 @@ struct llama_sampling_context {
     // internal
     grammar_parser::parse_state parsed_grammar;
 
-    // TODO: replace with ring-buffer
-    std::vector<llama_token>      prev;
+    // allowed tokens for grammar states, shared by all jobs with the same grammar
+    std::shared_ptr<struct llama_grammar_masks> masks;
+    std::vector<std::pair<const llama_grammar_element *, uint32_t>> grammar_bases; // rules sorted by address with offsets
+
+    ring_buffer<llama_token>      prev;
     std::vector<llama_token_data> cur;
+    std::vector<float>            logits; // copy of the sequence logits with bias, guidance and penalties applied
     size_t n_valid; // Number of correct top tokens with correct probabilities.
 
     std::mt19937 rng;
@@ -476,30 +546,54 @@ void hide();
 void show();
 
 struct llama_context * init_context(int idx);
+void free_context(int idx);
 int64_t do_inference(
     int idx, 
     struct llama_context * ctx, 
     const std::string & jobID, 
     const std::string & sessionID, 
-    const std::string & text);
-
-const char * statusCPP(const std::string & jobID);
+    const std::string & text,
+    const std::string & grammar,
+    const std::string & schema,
+    int priority,
+    const std::string & tenant,
+    int choices,
+    int64_t timeout);
+int64_t embed_batch(int idx, const char * const * texts, int n, float * out);
+int64_t bulk_inference(int n_pods, const std::string & input, const std::string & output);
+
+int64_t readOutputCPP(const std::string & jobID, int64_t from, char * buf, int64_t cap);
+int64_t getOutputTokenCountCPP(const std::string & jobID);
 int64_t promptEvalCPP(const std::string & jobID);
 int64_t getPromptTokenCountCPP(const std::string & jobID);
 int64_t timingCPP(const std::string & jobID);
+int64_t getDraftTokenCountCPP(const std::string & jobID);
+int64_t getAcceptedTokenCountCPP(const std::string & jobID);
 uint32_t getSeedCPP(const std::string & jobID);
+bool isAbortedCPP(const std::string & jobID);
+void releaseJobCPP(const std::string & jobID);
 
 extern "C" { // -----    
 
-void init(char * swap, char * debug);
+void init(char * swap, int64_t swapLimit, char * debug);
 
 void * initContext(
     int idx, 
     char * modelName, 
     int threads,
+    int numa,
+    char * cpus,
     int batch_size,
+    int budget,
+    int slots,
+    char * draftName,
+    int n_draft,
+    int lookup,
+    char * lookupStatic,
+    char * lookupDynamic,
     int gpu1, int gpu2, int gpu3, int gpu4,
     int context, int predict,
+    int keep, int window,
     int32_t mirostat, float mirostat_tau, float mirostat_eta,
     float temperature, int top_k, float top_p,
     float typical_p,
@@ -508,19 +602,36 @@ void * initContext(
     uint32_t seed,
     char * debug);
 
+void freeContext(int idx);
+
 int64_t doInference(
     int idx, 
     void * ctx, 
     char * jobID, 
     char * sessionID, 
-    char * prompt); 
-
-void stopInference(int idx);
-const char * status(char * jobID);
+    char * prompt,
+    char * grammar,
+    char * schema,
+    int priority,
+    char * tenant,
+    int choices,
+    int64_t timeout); 
+
+void stopInference(int idx, char * jobID);
+void setTenant(char * tenant, float weight);
+int64_t readOutput(char * jobID, int64_t from, char * buf, int64_t cap);
+int64_t getOutputTokenCount(char * jobID);
 int64_t promptEval(char * jobID);
 int64_t getPromptTokenCount(char * jobID);
 int64_t timing(char * jobID);  
+int64_t getDraftTokenCount(char * jobID);
+int64_t getAcceptedTokenCount(char * jobID);
 uint32_t getSeed(char * jobID);  
+int isAborted(char * jobID);
+void releaseJob(char * jobID);
+int64_t bulkInference(int pods, char * input, char * output);
+int embedSize(int idx);
+int64_t embedBatch(int idx, char ** texts, int n, float * out);
 
 } // ------- extern "C"
 
@@ -3,8 +3,172 @@
 #include "log.h"
 
 #include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// --- Flat hash table
+
+#define LLAMA_NGRAM_FILE_MAGIC   0x6e67726du // 'ngrm'
+#define LLAMA_NGRAM_FILE_VERSION 1
+
+// NB! Header occupies the whole cache line, so entries following it within the mapped file stay aligned
+struct alignas(64) llama_ngram_file_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t capacity;
+    uint64_t n_used;
+    uint64_t n_chunks;
+};
+
+static_assert(sizeof(llama_ngram_file_header) == 64, "n-gram file header should fit the cache line");
+
+const llama_ngram_entry * llama_ngram_cache::find(const llama_ngram & ngram) const {
+    if (n_used == 0) {
+        return nullptr;
+    }
+
+    const llama_ngram_entry * data = entry_data();
+    const size_t mask = capacity - 1;
+
+    for (size_t i = llama_ngram_hash_function{}(ngram) & mask; ; i = (i + 1) & mask) {
+        if (data[i].ngram.tokens[0] == -1) {
+            return nullptr;
+        }
+        if (data[i].ngram == ngram) {
+            return &data[i];
+        }
+    }
+}
+
+int32_t llama_ngram_cache::count(const llama_ngram_entry & entry, llama_token token) const {
+    int32_t res = 0;
+    for_each(entry, [&](llama_token t, int32_t count) {
+        if (t == token) {
+            res = count;
+        }
+    });
+    return res;
+}
+
+llama_ngram_entry & llama_ngram_cache::insert(const llama_ngram & ngram) {
+    GGML_ASSERT(!mapped() && "mapped n-gram caches are read-only");
+
+    // keep the load factor below 0.75 so probe sequences stay short
+    if ((n_used + 1) * 4 > capacity * 3) {
+        grow();
+    }
+
+    const size_t mask = capacity - 1;
+
+    size_t i = llama_ngram_hash_function{}(ngram) & mask;
+    while (entries[i].ngram.tokens[0] != -1) {
+        if (entries[i].ngram == ngram) {
+            return entries[i];
+        }
+        i = (i + 1) & mask;
+    }
+
+    llama_ngram_entry & entry = entries[i];
+    entry.ngram    = ngram;
+    entry.n_tokens = 0;
+    entry.overflow = -1;
+    n_used++;
+
+    return entry;
+}
+
+void llama_ngram_cache::grow() {
+    decltype(entries) old(capacity > 0 ? capacity * 2 : 64);
+    old.swap(entries);
+    capacity = entries.size();
+
+    // overflow chunks are referenced by index, so only entries themselves are moved
+    const size_t mask = capacity - 1;
+    for (const llama_ngram_entry & entry : old) {
+        if (entry.ngram.tokens[0] == -1) {
+            continue;
+        }
+        size_t i = llama_ngram_hash_function{}(entry.ngram) & mask;
+        while (entries[i].ngram.tokens[0] != -1) {
+            i = (i + 1) & mask;
+        }
+        entries[i] = entry;
+    }
+}
+
+void llama_ngram_cache::add(const llama_ngram & ngram, llama_token token, int32_t count) {
+    llama_ngram_entry & entry = insert(ngram);
+
+    const int32_t n_inline = std::min(entry.n_tokens, LLAMA_NGRAM_INLINE);
+    for (int32_t i = 0; i < n_inline; ++i) {
+        if (entry.tokens[i] == token) {
+            entry.counts[i] += count;
+            return;
+        }
+    }
+
+    if (entry.n_tokens < LLAMA_NGRAM_INLINE) {
+        entry.tokens[entry.n_tokens] = token;
+        entry.counts[entry.n_tokens] = count;
+        entry.n_tokens++;
+        return;
+    }
+
+    // look through the overflow chain and remember its tail
+    int32_t n_left = entry.n_tokens - LLAMA_NGRAM_INLINE;
+    int32_t last = -1;
+    for (int32_t c = entry.overflow; c >= 0; c = chunks[c].next) {
+        llama_ngram_chunk & chunk = chunks[c];
+        for (int32_t i = 0; i < LLAMA_NGRAM_CHUNK && i < n_left; ++i) {
+            if (chunk.tokens[i] == token) {
+                chunk.counts[i] += count;
+                return;
+            }
+        }
+        n_left -= LLAMA_NGRAM_CHUNK;
+        last = c;
+    }
+
+    const int32_t pos = (entry.n_tokens - LLAMA_NGRAM_INLINE) % LLAMA_NGRAM_CHUNK;
+    if (pos == 0) {
+        chunks.emplace_back();
+        chunks.back().next = -1;
+        const int32_t c = chunks.size() - 1;
+        if (last < 0) {
+            entry.overflow = c;
+        } else {
+            chunks[last].next = c;
+        }
+        last = c;
+        n_chunks = chunks.size();
+    }
+
+    chunks[last].tokens[pos] = token;
+    chunks[last].counts[pos] = count;
+    entry.n_tokens++;
+}
+
+void llama_ngram_cache::clear() {
+    capacity = 0;
+    n_used   = 0;
+    n_chunks = 0;
+    entries.clear();
+    chunks.clear();
+    mapping.reset();
+    mapped_entries = nullptr;
+    mapped_chunks  = nullptr;
+}
+
+// --- N-gram lookup
+
 void llama_ngram_cache_update(llama_ngram_cache & ngram_cache, int ngram_min, int ngram_max,
                               std::vector<llama_token> & inp, int nnew, bool print_progress) {
     const int64_t t_start_ms = ggml_time_ms();
@@ -20,19 +184,7 @@ void llama_ngram_cache_update(llama_ngram_cache & ngram_cache, int ngram_min, in
             llama_ngram ngram(&inp[ngram_start], ngram_size);
             const llama_token token = inp[i];
 
-            llama_ngram_cache::iterator part_it = ngram_cache.find(ngram);
-            if (part_it == ngram_cache.end()) {
-                llama_ngram_cache_part part;
-                part.emplace(token, 1);
-                ngram_cache.emplace(ngram, part);
-            } else {
-                llama_ngram_cache_part::iterator token_count_it = part_it->second.find(token);
-                if (token_count_it == part_it->second.end()) {
-                    part_it->second.emplace(token, 1);
-                } else {
-                    token_count_it->second++;
-                }
-            }
+            ngram_cache.add(ngram, token, 1);
             ++n_done;
 
             if (print_progress && n_done % 10000000 == 0) {
@@ -59,27 +211,23 @@ constexpr int draft_min_sample_size_strict[LLAMA_NGRAM_MAX] = { 4,  3,  2,  2};
 constexpr int     draft_min_percent_strict[LLAMA_NGRAM_MAX] = {75, 66, 66, 66};
 
 // Helper function that tries to draft a token from only the static ngram cache:
-static llama_token try_draft(llama_ngram_cache & nc_static, const llama_ngram ngram_static) {
-    llama_ngram_cache::iterator part_static_it = nc_static.find(ngram_static);
-    if (part_static_it == nc_static.end()) {
+static llama_token try_draft(const llama_ngram_cache & nc_static, const llama_ngram ngram_static) {
+    const llama_ngram_entry * part_static = nc_static.find(ngram_static);
+    if (part_static == nullptr) {
         return -1;
     }
-    const llama_ngram_cache_part part_static = part_static_it->second;
 
     int max_count_static  = 0;
     int sum_count_static  = 0;
     llama_token max_token = -1;
 
-    for (std::pair<llama_token, int> token_count_static : part_static) {
-        const llama_token token = token_count_static.first;
-        const int32_t count_static  = token_count_static.second;
-
+    nc_static.for_each(*part_static, [&](llama_token token, int32_t count_static) {
         if (count_static > max_count_static) {
             max_token        = token;
             max_count_static = count_static;
         }
         sum_count_static += count_static;
-    }
+    });
 
     if (sum_count_static < draft_min_sample_size_lax[LLAMA_NGRAM_STATIC-1]) {
         return -1;
@@ -92,7 +240,8 @@ static llama_token try_draft(llama_ngram_cache & nc_static, const llama_ngram ng
 
 // Try to draft a token from primary cache (context/dynamic), validate with static cache:
 static llama_token try_draft(
-    llama_ngram_cache & nc_primary, const std::vector<llama_ngram> & ngrams_primary, llama_ngram_cache_part & part_static,
+    const llama_ngram_cache & nc_primary, const std::vector<llama_ngram> & ngrams_primary,
+    const llama_ngram_cache & nc_static, const llama_ngram_entry * part_static,
     const int * min_sample_size, const int * min_percent) {
 
     llama_token drafted_token = -1;
@@ -100,24 +249,19 @@ static llama_token try_draft(
     for (int i = ngrams_primary.size()-1; i >= 0 && drafted_token == -1; --i) {
         const llama_ngram ngram_primary = ngrams_primary[i];
 
-        llama_ngram_cache::iterator part_primary_it = nc_primary.find(ngram_primary);
-        if (part_primary_it == nc_primary.end()) {
+        const llama_ngram_entry * part_primary = nc_primary.find(ngram_primary);
+        if (part_primary == nullptr) {
             continue;
         }
-        const llama_ngram_cache_part part_primary = part_primary_it->second;
 
         int max_count_primary = 0;
         int max_count_static  = 0;
         int sum_count_primary = 0;
         llama_token max_token = -1;
 
-        for (std::pair<llama_token, int> token_count_primary : part_primary) {
-            const llama_token token = token_count_primary.first;
-
-            llama_ngram_cache_part::iterator token_count_static_it = part_static.find(token);
-
-            const int32_t count_primary = token_count_primary.second;
-            const int32_t count_static  = token_count_static_it != part_static.end() ? 100*token_count_static_it->second : 1;
+        nc_primary.for_each(*part_primary, [&](llama_token token, int32_t count_primary) {
+            const int32_t token_count_static = part_static ? nc_static.count(*part_static, token) : 0;
+            const int32_t count_static = token_count_static > 0 ? 100*token_count_static : 1;
 
             if (count_primary*count_static > max_count_primary*max_count_static) {
                 max_token         = token;
@@ -125,7 +269,7 @@ static llama_token try_draft(
                 max_count_static  = count_static;
             }
             sum_count_primary += count_primary;
-        }
+        });
 
         if (sum_count_primary < min_sample_size[i]) {
             continue;
@@ -141,7 +285,7 @@ static llama_token try_draft(
 
 void llama_ngram_cache_draft(
     std::vector<llama_token> & inp, std::vector<llama_token> & draft, int n_draft, int ngram_min, int ngram_max,
-    llama_ngram_cache & nc_context, llama_ngram_cache & nc_dynamic, llama_ngram_cache & nc_static
+    const llama_ngram_cache & nc_context, const llama_ngram_cache & nc_dynamic, const llama_ngram_cache & nc_static
 ) {
     GGML_ASSERT(draft.size() == 1);
     const int inp_size = inp.size();
@@ -158,11 +302,7 @@ void llama_ngram_cache_draft(
         for (int j = ngram_start_static; j < ngram_start_static + LLAMA_NGRAM_STATIC; ++j) {
             ngram_static.tokens[j-ngram_start_static] = get_token(inp, draft, j);
         }
-        llama_ngram_cache::iterator part_static_it = nc_static.find(ngram_static);
-        llama_ngram_cache_part part_static;
-        if (part_static_it != nc_static.end()) {
-            part_static = part_static_it->second;
-        }
+        const llama_ngram_entry * part_static = nc_static.find(ngram_static);
 
         // cd = context + dynamic
         std::vector<llama_ngram> ngrams_cd;
@@ -175,10 +315,10 @@ void llama_ngram_cache_draft(
             ngrams_cd.push_back(ngram_cd);
         }
         if (drafted_token == -1) {
-            drafted_token = try_draft(nc_context, ngrams_cd, part_static, draft_min_sample_size_lax, draft_min_percent_lax);
+            drafted_token = try_draft(nc_context, ngrams_cd, nc_static, part_static, draft_min_sample_size_lax, draft_min_percent_lax);
         }
         if (drafted_token == -1) {
-            drafted_token = try_draft(nc_dynamic, ngrams_cd, part_static, draft_min_sample_size_strict, draft_min_percent_strict);
+            drafted_token = try_draft(nc_dynamic, ngrams_cd, nc_static, part_static, draft_min_sample_size_strict, draft_min_percent_strict);
         }
         if (drafted_token == -1) {
             drafted_token = try_draft(nc_static, ngram_static);
@@ -193,34 +333,27 @@ void llama_ngram_cache_draft(
     }
 }
 
-void llama_ngram_cache_save(llama_ngram_cache & ngram_cache, std::string & filename) {
-    std::ofstream file_out(filename, std::ios::binary);
-    for (std::pair<llama_ngram, llama_ngram_cache_part> item : ngram_cache) {
-        const llama_ngram      ngram        = item.first;
-        llama_ngram_cache_part token_counts = item.second;
-        GGML_ASSERT(!token_counts.empty());
-        const int32_t ntokens = token_counts.size();
-        GGML_ASSERT(ntokens > 0);
+// --- Files
+//     The file is the header followed by the table and overflow chunks exactly as they are laid out in memory
 
-        file_out.write(reinterpret_cast<const char *>(&ngram),   sizeof(llama_ngram));
-        file_out.write(reinterpret_cast<const char *>(&ntokens), sizeof(int32_t));
-        for (std::pair<llama_token, int32_t> item2 : token_counts) {
-            const llama_token token = item2.first;
-            const int32_t     count = item2.second;
-            GGML_ASSERT(count > 0);
-
-            file_out.write(reinterpret_cast<const char *>(&token), sizeof(llama_token));
-            file_out.write(reinterpret_cast<const char *>(&count), sizeof(int32_t));
-        }
-    }
+bool llama_ngram_cache_save(const llama_ngram_cache & ngram_cache, const std::string & filename) {
+    llama_ngram_file_header header = {};
+    header.magic    = LLAMA_NGRAM_FILE_MAGIC;
+    header.version  = LLAMA_NGRAM_FILE_VERSION;
+    header.capacity = ngram_cache.capacity;
+    header.n_used   = ngram_cache.n_used;
+    header.n_chunks = ngram_cache.n_chunks;
 
+    std::ofstream file_out(filename, std::ios::binary);
+    file_out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file_out.write(reinterpret_cast<const char *>(ngram_cache.entry_data()), header.capacity * sizeof(llama_ngram_entry));
+    file_out.write(reinterpret_cast<const char *>(ngram_cache.chunk_data()), header.n_chunks * sizeof(llama_ngram_chunk));
+    file_out.close(); // NB! Buffered data is flushed only here, so the disk might be found full at this point
+    return !file_out.fail();
 }
 
-llama_ngram_cache llama_ngram_cache_load(std::string & filename) {
-    std::ifstream hashmap_file(filename, std::ios::binary);
-    if (!hashmap_file) {
-        throw std::ifstream::failure("Unable to open file " + filename);
-    }
+// Files written before the flat table are the stream of n-grams each followed by its token counts
+static llama_ngram_cache llama_ngram_cache_load_stream(std::ifstream & hashmap_file) {
     llama_ngram_cache ngram_cache;
 
     llama_ngram ngram;
@@ -236,7 +369,6 @@ llama_ngram_cache llama_ngram_cache_load(std::string & filename) {
         GGML_ASSERT(!hashmap_file.eof());
         GGML_ASSERT(hashmap_file.read(ntokensc, sizeof(int32_t)));
         GGML_ASSERT(ntokens > 0);
-        llama_ngram_cache_part token_counts;
 
         for (int i = 0; i < ntokens; ++i) {
             GGML_ASSERT(!hashmap_file.eof());
@@ -244,39 +376,94 @@ llama_ngram_cache llama_ngram_cache_load(std::string & filename) {
             GGML_ASSERT(!hashmap_file.eof());
             GGML_ASSERT(hashmap_file.read(countc, sizeof(int32_t)));
             GGML_ASSERT(count > 0);
-            token_counts.emplace(token, count);
+            ngram_cache.add(ngram, token, count);
         }
-
-        ngram_cache.emplace(ngram, token_counts);
     }
     GGML_ASSERT(hashmap_file.eof());
 
     return ngram_cache;
 }
 
-void llama_ngram_cache_merge(llama_ngram_cache & ngram_cache_target, llama_ngram_cache & ngram_cache_add) {
-    for (std::pair<llama_ngram, llama_ngram_cache_part> ngram_part : ngram_cache_add) {
-        const llama_ngram      ngram = ngram_part.first;
-        llama_ngram_cache_part  part = ngram_part.second;
+static bool llama_ngram_cache_check(const llama_ngram_file_header & header, size_t file_size) {
+    return header.magic == LLAMA_NGRAM_FILE_MAGIC && header.version == LLAMA_NGRAM_FILE_VERSION &&
+        (header.capacity & (header.capacity - 1)) == 0 && header.n_used < header.capacity + (header.capacity == 0) &&
+        file_size == sizeof(header) + header.capacity * sizeof(llama_ngram_entry) + header.n_chunks * sizeof(llama_ngram_chunk);
+}
 
-        llama_ngram_cache::iterator part_merged_it = ngram_cache_target.find(ngram);
-        if (part_merged_it == ngram_cache_target.end()) {
-            ngram_cache_target.emplace(ngram, part);
-            continue;
-        }
+llama_ngram_cache llama_ngram_cache_load(const std::string & filename) {
+    std::ifstream hashmap_file(filename, std::ios::binary | std::ios::ate);
+    if (!hashmap_file) {
+        throw std::ifstream::failure("Unable to open file " + filename);
+    }
+    const size_t file_size = hashmap_file.tellg();
+    hashmap_file.seekg(0);
+
+    llama_ngram_file_header header = {};
+    if (!hashmap_file.read(reinterpret_cast<char *>(&header), sizeof(header)) || header.magic != LLAMA_NGRAM_FILE_MAGIC) {
+        hashmap_file.clear();
+        hashmap_file.seekg(0);
+        return llama_ngram_cache_load_stream(hashmap_file);
+    }
+    if (!llama_ngram_cache_check(header, file_size)) {
+        throw std::ifstream::failure("Wrong n-gram cache file " + filename);
+    }
 
-        for (std::pair<llama_token, int32_t> token_count : part) {
-            const llama_token token = token_count.first;
-            const int32_t     count = token_count.second;
-            GGML_ASSERT(count > 0);
+    llama_ngram_cache ngram_cache;
+    ngram_cache.capacity = header.capacity;
+    ngram_cache.n_used   = header.n_used;
+    ngram_cache.n_chunks = header.n_chunks;
+    ngram_cache.entries.resize(header.capacity);
+    ngram_cache.chunks.resize(header.n_chunks);
+
+    hashmap_file.read(reinterpret_cast<char *>(ngram_cache.entries.data()), header.capacity * sizeof(llama_ngram_entry));
+    hashmap_file.read(reinterpret_cast<char *>(ngram_cache.chunks.data()),  header.n_chunks * sizeof(llama_ngram_chunk));
+    if (!hashmap_file) {
+        throw std::ifstream::failure("Unable to read file " + filename);
+    }
 
-            llama_ngram_cache_part::iterator token_count_merged_it = part_merged_it->second.find(token);
-            if (token_count_merged_it == part_merged_it->second.end()) {
-                part_merged_it->second.emplace(token, count);
-                continue;
-            }
+    return ngram_cache;
+}
 
-            token_count_merged_it->second += count;
-        }
+llama_ngram_cache llama_ngram_cache_map(const std::string & filename) {
+#ifdef _WIN32
+    return llama_ngram_cache_load(filename);
+#else
+    const int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::ifstream::failure("Unable to open file " + filename);
+    }
+
+    struct stat st;
+    llama_ngram_file_header header = {};
+    const bool ok = fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(header) &&
+        pread(fd, &header, sizeof(header), 0) == (ssize_t) sizeof(header) && llama_ngram_cache_check(header, st.st_size);
+
+    void * addr = ok ? mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+
+    // older stream files and the empty ones are just loaded
+    if (addr == MAP_FAILED) {
+        return llama_ngram_cache_load(filename);
     }
+
+    const size_t size = st.st_size;
+    llama_ngram_cache ngram_cache;
+    ngram_cache.capacity = header.capacity;
+    ngram_cache.n_used   = header.n_used;
+    ngram_cache.n_chunks = header.n_chunks;
+    ngram_cache.mapping  = std::shared_ptr<void>(addr, [size](void * addr) { munmap(addr, size); });
+    ngram_cache.mapped_entries = reinterpret_cast<const llama_ngram_entry *>((const char *) addr + sizeof(header));
+    ngram_cache.mapped_chunks  = reinterpret_cast<const llama_ngram_chunk *>(ngram_cache.mapped_entries + header.capacity);
+
+    return ngram_cache;
+#endif
+}
+
+void llama_ngram_cache_merge(llama_ngram_cache & ngram_cache_target, const llama_ngram_cache & ngram_cache_add) {
+    ngram_cache_add.for_each([&](const llama_ngram_entry & entry) {
+        ngram_cache_add.for_each(entry, [&](llama_token token, int32_t count) {
+            GGML_ASSERT(count > 0);
+            ngram_cache_target.add(entry.ngram, token, count);
+        });
+    });
 }
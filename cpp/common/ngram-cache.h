@@ -2,7 +2,10 @@
 
 #include "llama.h"
 
-#include <unordered_map>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
 #include <string>
 #include <vector>
 
@@ -37,22 +40,140 @@ struct llama_ngram {
     }
 };
 
+// Order-sensitive hash, so "a b" and "b a" are not colliding:
 struct llama_ngram_hash_function {
     size_t operator()(const llama_ngram & ngram) const {
-        size_t hash = 0;
+        uint64_t hash = 0xcbf29ce484222325ULL;
         for (int i = 0; i < LLAMA_NGRAM_MAX; ++i) {
-            hash ^= std::hash<llama_token>{}(ngram.tokens[i]);
+            hash = (hash ^ (uint32_t) ngram.tokens[i]) * 0x100000001b3ULL;
         }
+        // final avalanche, the table index is taken from the lower bits
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 33;
         return hash;
     }
 };
 
-// token -> number of times token has been seen
-typedef std::unordered_map<llama_token, int32_t> llama_ngram_cache_part;
+#define LLAMA_NGRAM_INLINE 5 // follow tokens stored right within the table entry
+#define LLAMA_NGRAM_CHUNK  7 // follow tokens per overflow chunk
+
+// n-gram -> empirical distribution of following tokens, exactly one cache line.
+// Most n-grams are followed by a few distinct tokens only, the rest of them goes to the chain of overflow chunks.
+struct alignas(64) llama_ngram_entry {
+    llama_ngram ngram;   // tokens[0] == -1 for empty entries
+    int32_t n_tokens;    // number of distinct following tokens
+    int32_t overflow;    // index of the first overflow chunk, -1 if none
+    llama_token tokens[LLAMA_NGRAM_INLINE];
+    int32_t     counts[LLAMA_NGRAM_INLINE];
+};
+
+struct alignas(64) llama_ngram_chunk {
+    llama_token tokens[LLAMA_NGRAM_CHUNK];
+    int32_t     counts[LLAMA_NGRAM_CHUNK];
+    int32_t next;        // index of the next chunk, -1 if none
+    int32_t padding;
+};
+
+static_assert(sizeof(llama_ngram_entry) == 64, "n-gram entry should fit the cache line");
+static_assert(sizeof(llama_ngram_chunk) == 64, "n-gram chunk should fit the cache line");
+
+// NB! Before C++17 operator new ignores alignas of the type, while the compiler still relies on it with aligned loads and stores.
+// Storage of the table is aligned by hand, so it's the same whatever standard each unit including this header is built with.
+template <typename T>
+struct llama_ngram_allocator {
+    using value_type = T;
 
-// n-gram -> empirical distribution of following tokens
-typedef std::unordered_map<llama_ngram, llama_ngram_cache_part, llama_ngram_hash_function> llama_ngram_cache;
+    llama_ngram_allocator() = default;
+    template <typename U>
+    llama_ngram_allocator(const llama_ngram_allocator<U> &) {}
 
+    T * allocate(size_t n) {
+        void * raw = ::operator new(n * sizeof(T) + alignof(T) + sizeof(void *));
+        const uintptr_t addr = ((uintptr_t) raw + sizeof(void *) + alignof(T) - 1) & ~(uintptr_t) (alignof(T) - 1);
+        reinterpret_cast<void **>(addr)[-1] = raw; // the original pointer is kept right before the aligned storage
+        return reinterpret_cast<T *>(addr);
+    }
+
+    void deallocate(T * ptr, size_t) {
+        ::operator delete(reinterpret_cast<void **>(ptr)[-1]);
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const llama_ngram_allocator<T> &, const llama_ngram_allocator<U> &) { return true; }
+
+template <typename T, typename U>
+bool operator!=(const llama_ngram_allocator<T> &, const llama_ngram_allocator<U> &) { return false; }
+
+// Open-addressing hash table with linear probing and power of two capacity.
+// The table and chunks are plain arrays without pointers, so the file written by llama_ngram_cache_save
+// can be mapped into memory as is with llama_ngram_cache_map. Mapped caches are read-only.
+struct llama_ngram_cache {
+    llama_ngram_cache() = default;
+    llama_ngram_cache(llama_ngram_cache &&) = default;
+    llama_ngram_cache & operator=(llama_ngram_cache &&) = default;
+
+    // returns nullptr if the n-gram was never seen
+    const llama_ngram_entry * find(const llama_ngram & ngram) const;
+
+    // count of the token following the n-gram, zero if none
+    int32_t count(const llama_ngram_entry & entry, llama_token token) const;
+
+    // add count to the token following the n-gram
+    void add(const llama_ngram & ngram, llama_token token, int32_t count);
+
+    // call fn(token, count) for each token following the n-gram
+    template <typename F>
+    void for_each(const llama_ngram_entry & entry, F fn) const {
+        const int32_t n_inline = entry.n_tokens < LLAMA_NGRAM_INLINE ? entry.n_tokens : LLAMA_NGRAM_INLINE;
+        for (int32_t i = 0; i < n_inline; ++i) {
+            fn(entry.tokens[i], entry.counts[i]);
+        }
+        int32_t n_left = entry.n_tokens - n_inline;
+        for (int32_t c = entry.overflow; c >= 0 && n_left > 0; c = chunk_data()[c].next) {
+            const llama_ngram_chunk & chunk = chunk_data()[c];
+            for (int32_t i = 0; i < LLAMA_NGRAM_CHUNK && n_left > 0; ++i, --n_left) {
+                fn(chunk.tokens[i], chunk.counts[i]);
+            }
+        }
+    }
+
+    // call fn(entry) for each n-gram
+    template <typename F>
+    void for_each(F fn) const {
+        for (size_t i = 0; i < capacity; ++i) {
+            if (entry_data()[i].ngram.tokens[0] != -1) {
+                fn(entry_data()[i]);
+            }
+        }
+    }
+
+    size_t size()  const { return n_used; }
+    bool   empty() const { return n_used == 0; }
+    bool mapped()  const { return mapping != nullptr; }
+
+    void clear();
+
+    const llama_ngram_entry * entry_data() const { return mapping ? mapped_entries : entries.data(); }
+    const llama_ngram_chunk * chunk_data() const { return mapping ? mapped_chunks  : chunks.data(); }
+
+    size_t capacity = 0; // always power of two
+    size_t n_used   = 0;
+    size_t n_chunks = 0;
+
+    std::vector<llama_ngram_entry, llama_ngram_allocator<llama_ngram_entry>> entries;
+    std::vector<llama_ngram_chunk, llama_ngram_allocator<llama_ngram_chunk>> chunks;
+
+    // read-only view of the file mapped into memory
+    std::shared_ptr<void> mapping;
+    const llama_ngram_entry * mapped_entries = nullptr;
+    const llama_ngram_chunk * mapped_chunks  = nullptr;
+
+private:
+    llama_ngram_entry & insert(const llama_ngram & ngram);
+    void grow();
+};
 
 // Update an ngram cache with tokens.
 // ngram_cache:         the cache to modify.
@@ -76,19 +197,26 @@ void llama_ngram_cache_update(
 // nc_static:          ngram cache generated from a large text corpus, used for validation.
 void llama_ngram_cache_draft(
     std::vector<llama_token> & inp, std::vector<llama_token> & draft, int n_draft, int ngram_min, int ngram_max,
-    llama_ngram_cache & nc_context, llama_ngram_cache & nc_dynamic, llama_ngram_cache & nc_static);
+    const llama_ngram_cache & nc_context, const llama_ngram_cache & nc_dynamic, const llama_ngram_cache & nc_static);
 
 // Save an ngram cache to a file.
 // ngram_cache: the ngram cache to save.
 // filename:    the path under which to save the ngram cache.
-void llama_ngram_cache_save(llama_ngram_cache & ngram_cache, std::string & filename);
+// returns:     false if the file could not be written completely, it's left as is then.
+bool llama_ngram_cache_save(const llama_ngram_cache & ngram_cache, const std::string & filename);
 
-// Load an ngram cache saved with llama_ngram_cache_save.
+// Load an ngram cache saved with llama_ngram_cache_save into memory, the result can be modified.
+// Files of the older stream format are loaded too.
 // filename: the path from which to load the ngram cache.
 // returns:  an ngram cache containing the information saved to filename.
-llama_ngram_cache llama_ngram_cache_load(std::string & filename);
+llama_ngram_cache llama_ngram_cache_load(const std::string & filename);
+
+// Map an ngram cache saved with llama_ngram_cache_save into memory read-only, without loading it.
+// Falls back to llama_ngram_cache_load if the file can't be mapped.
+// filename: the path from which to map the ngram cache.
+llama_ngram_cache llama_ngram_cache_map(const std::string & filename);
 
 // Merge two ngram caches.
 // ngram_cache_target: the ngram cache to which to add the information from ngram_cache_add.
 // ngram_cache_add:    the ngram cache to add to ngram_cache_target.
-void llama_ngram_cache_merge(llama_ngram_cache & ngram_cache_target, llama_ngram_cache & ngram_cache_add);
+void llama_ngram_cache_merge(llama_ngram_cache & ngram_cache_target, const llama_ngram_cache & ngram_cache_add);
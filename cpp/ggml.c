@@ -27,6 +27,7 @@
 #include <signal.h>
 #if defined(__gnu_linux__)
 #include <syscall.h>
+#include <linux/futex.h>
 #endif
 
 #ifdef GGML_USE_OPENMP
@@ -1761,6 +1762,8 @@ struct ggml_compute_state_shared {
     void* abort_callback_data;
 
     atomic_int current_chunk; // currently processing chunk during Mat_Mul, shared between all the threads.
+
+    atomic_int n_sleeping; // threads fallen asleep on node_n or node_task, they should be woken up
 };
 
 struct ggml_compute_state {
@@ -1768,8 +1771,26 @@ struct ggml_compute_state {
     int ith;
     struct ggml_compute_state_shared* shared;
     enum ggml_status ec;
+    struct ggml_threadpool * pool; // NULL for threads started only for the single graph
 };
 
+#if !defined(_WIN32)
+// persistent compute threads reused by all graphs, workers[0] is the thread calling ggml_graph_compute()
+struct ggml_threadpool {
+    int n_threads;
+    struct ggml_compute_state * workers;
+
+    pthread_mutex_t mutex; // guards idle workers falling asleep between graphs
+    pthread_cond_t  cond;
+
+    atomic_int n_graphs;   // incremented for each new graph
+    atomic_int n_done;     // workers done with the current graph
+    atomic_int n_parked;   // workers sleeping on the cond
+    atomic_int n_sleeping; // the calling thread sleeping on n_done
+    atomic_bool stop;
+};
+#endif
+
 //
 // fundamental operations
 //
@@ -18716,6 +18737,92 @@ static void set_numa_thread_affinity(int thread_n) { UNUSED(thread_n);  }
 static void clear_numa_thread_affinity(void) {}
 #endif
 
+//
+// hybrid barriers: waiting threads spin for a while, then fall asleep on the futex until the value is changed,
+// so threads of several graphs computed on the same host at once do not steal cores from each other
+//
+
+#ifndef GGML_SPIN_COUNT
+#define GGML_SPIN_COUNT 1024 // pause iterations before falling asleep
+#endif
+#define GGML_SPIN_YIELD 64   // yield the core once per so many iterations, so oversubscribed threads get it earlier
+
+static inline void ggml_spin_pause(void) {
+#if defined(__SSE3__)
+    // Tell the processor we're spinning.  It's a processor hint for spinlocks.
+    _mm_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+#if defined(__gnu_linux__)
+// NB! The kernel sees the plain int behind the atomic one, the cast via uintptr_t drops _Atomic without warnings
+static void ggml_futex_wait(atomic_int * addr, int value) {
+    syscall(SYS_futex, (void *)(uintptr_t) addr, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+static void ggml_futex_wake(atomic_int * addr) {
+    syscall(SYS_futex, (void *)(uintptr_t) addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+#else
+// portable fallback: sleepers of all barriers share the single condition, the value is checked under its mutex,
+// so the wake up after the value was changed is never lost, and others just check their values and sleep again
+static pthread_mutex_t ggml_futex_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  ggml_futex_cond  = PTHREAD_COND_INITIALIZER;
+
+static void ggml_futex_wait(atomic_int * addr, int value) {
+    pthread_mutex_lock(&ggml_futex_mutex);
+    if (atomic_load(addr) == value) {
+        pthread_cond_wait(&ggml_futex_cond, &ggml_futex_mutex);
+    }
+    pthread_mutex_unlock(&ggml_futex_mutex);
+}
+
+static void ggml_futex_wake(atomic_int * addr) {
+    UNUSED(addr);
+    pthread_mutex_lock(&ggml_futex_mutex);
+    pthread_cond_broadcast(&ggml_futex_cond);
+    pthread_mutex_unlock(&ggml_futex_mutex);
+}
+#endif
+
+// spin while the value is the same as the last one for a while, return the current value
+static int ggml_spin_wait(atomic_int * value, int last) {
+    int current = atomic_load(value);
+    for (int i = 0; current == last && i < GGML_SPIN_COUNT; i++) {
+        ggml_spin_pause();
+        if (i % GGML_SPIN_YIELD == GGML_SPIN_YIELD - 1) {
+            sched_yield();
+        }
+        current = atomic_load(value);
+    }
+    return current;
+}
+
+// wait until the value differs from the last one and return the new value
+// NB! The sleeper is counted before the value is checked again, and the waker checks sleepers after the value
+//     was changed, so with sequentially consistent atomics the wake up is never lost
+static int ggml_barrier_wait(atomic_int * value, int last, atomic_int * n_sleeping) {
+    int current = ggml_spin_wait(value, last);
+    if (current != last) {
+        return current;
+    }
+    atomic_fetch_add(n_sleeping, 1);
+    while ((current = atomic_load(value)) == last) {
+        ggml_futex_wait(value, last);
+    }
+    atomic_fetch_sub(n_sleeping, 1);
+    return current;
+}
+
+// call after the value was changed
+static void ggml_barrier_wake(atomic_int * value, atomic_int * n_sleeping) {
+    if (atomic_load(n_sleeping) > 0) {
+        ggml_futex_wake(value);
+    }
+}
+
 static void ggml_graph_compute_perf_stats_node(struct ggml_tensor * node, const struct ggml_compute_state_shared * st) {
     int64_t cycles_cur  = ggml_perf_cycles()  - st->perf_node_start_cycles;
     int64_t time_us_cur = ggml_perf_time_us() - st->perf_node_start_time_us;
@@ -18972,46 +19079,14 @@ static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads, int n_cur_
     return n_tasks;
 }
 
-static void ggml_graph_compute_thread_sync_node(int * node_n, struct ggml_compute_state * state, const bool do_yield) {
+static void ggml_graph_compute_thread_sync_node(int * node_n, struct ggml_compute_state * state) {
     // wait for other threads to finish
-    const int last_node_n = * node_n;
-
-    while (true) {
-        if (do_yield) {
-            sched_yield();
-        }
-
-        *node_n = atomic_load(&state->shared->node_n);
-        if (*node_n != last_node_n) {
-            break;
-        }
-
-#if defined(__SSE3__)
-        // Tell the processor we're spinning.  It's a processor hint for spinlocks.
-        _mm_pause();
-#endif
-    }
+    *node_n = ggml_barrier_wait(&state->shared->node_n, *node_n, &state->shared->n_sleeping);
 }
 
-static void ggml_graph_compute_thread_sync_task(int * task_phase, struct ggml_compute_state * state, const bool do_yield) {
+static void ggml_graph_compute_thread_sync_task(int * task_phase, struct ggml_compute_state * state) {
     // wait for other threads to finish
-    const int last_task_phase = *task_phase;
-
-    while (true) {
-        if (do_yield) {
-            sched_yield();
-        }
-
-        *task_phase = atomic_load(&state->shared->node_task);
-        if (*task_phase != last_task_phase) {
-            break;
-        }
-
-#if defined(__SSE3__)
-        // Tell the processor we're spinning.  It's a processor hint for spinlocks.
-        _mm_pause();
-#endif
-    }
+    *task_phase = ggml_barrier_wait(&state->shared->node_task, *task_phase, &state->shared->n_sleeping);
 }
 
 static thread_ret_t ggml_graph_compute_thread(void * data) {
@@ -19022,18 +19097,15 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
 
     const int   n_threads   = state->shared->n_threads;
 
-    set_numa_thread_affinity(state->ith);
+    // pool threads are pinned once for all graphs
+    if (!state->pool) {
+        set_numa_thread_affinity(state->ith);
+    }
 
     int node_n     = -1;
     int task_phase = GGML_TASK_TYPE_FINALIZE;
 
     while (true) {
-        if (cplan->abort_callback && cplan->abort_callback(cplan->abort_callback_data)) {
-            state->shared->node_n += 1;
-            state->ec = GGML_STATUS_ABORTED;
-            return 0;
-        }
-
         if (atomic_fetch_sub(&state->shared->n_active, 1) == 1) {
             // all other threads are finished and spinning
             // do finalize and init here so we don't have synchronize again
@@ -19055,41 +19127,50 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
                 ggml_graph_compute_perf_stats_node(node, state->shared);
             }
 
-            // distribute new work or execute it direct if 1T
-            while (++node_n < cgraph->n_nodes) {
-                GGML_PRINT_DEBUG_5("%s: %d/%d\n", __func__, node_n, cgraph->n_nodes);
-                struct ggml_tensor * node = cgraph->nodes[node_n];
-                const int n_tasks = ggml_get_n_tasks(node, n_threads, state->shared->n_threads);
-
-                state->shared->perf_node_start_cycles  = ggml_perf_cycles();
-                state->shared->perf_node_start_time_us = ggml_perf_time_us();
-
-                params.nth = n_tasks;
+            // NB! Only the thread distributing the work checks for abort, so the others are never left waiting
+            //     for the node which is not coming. All of them stop together just like after the last node
+            if (cplan->abort_callback && cplan->abort_callback(cplan->abort_callback_data)) {
+                node_n = cgraph->n_nodes;
+                state->ec = GGML_STATUS_ABORTED;
+            } else {
+                // distribute new work or execute it direct if 1T
+                while (++node_n < cgraph->n_nodes) {
+                    GGML_PRINT_DEBUG_5("%s: %d/%d\n", __func__, node_n, cgraph->n_nodes);
+                    struct ggml_tensor * node = cgraph->nodes[node_n];
+                    const int n_tasks = ggml_get_n_tasks(node, n_threads, state->shared->n_threads);
+
+                    state->shared->perf_node_start_cycles  = ggml_perf_cycles();
+                    state->shared->perf_node_start_time_us = ggml_perf_time_us();
+
+                    params.nth = n_tasks;
+
+                    if (n_tasks == 1) {
+                        /* INIT */
+                        if (GGML_OP_HAS_INIT[node->op]) {
+                            params.type = GGML_TASK_TYPE_INIT;
+                            ggml_compute_forward(&params, node, state);
+                        }
 
-                if (n_tasks == 1) {
-                    /* INIT */
-                    if (GGML_OP_HAS_INIT[node->op]) {
-                        params.type = GGML_TASK_TYPE_INIT;
+                        // TODO: maybe push node_n to the atomic but if other threads see n_tasks is 1,
+                        // they do something more efficient than spinning (?)
+                        params.type = GGML_TASK_TYPE_COMPUTE;
                         ggml_compute_forward(&params, node, state);
-                    }
 
-                    // TODO: maybe push node_n to the atomic but if other threads see n_tasks is 1,
-                    // they do something more efficient than spinning (?)
-                    params.type = GGML_TASK_TYPE_COMPUTE;
-                    ggml_compute_forward(&params, node, state);
+                        if (GGML_OP_HAS_FINALIZE[node->op]) {
+                            params.type = GGML_TASK_TYPE_FINALIZE;
+                            ggml_compute_forward(&params, node, state);
+                        }
 
-                    if (GGML_OP_HAS_FINALIZE[node->op]) {
-                        params.type = GGML_TASK_TYPE_FINALIZE;
-                        ggml_compute_forward(&params, node, state);
+                        ggml_graph_compute_perf_stats_node(node, state->shared);
+                    } else {
+                        break;
                     }
 
-                    ggml_graph_compute_perf_stats_node(node, state->shared);
-                } else {
-                    break;
-                }
-
-                if (cplan->abort_callback && cplan->abort_callback(cplan->abort_callback_data)) {
-                    break;
+                    if (cplan->abort_callback && cplan->abort_callback(cplan->abort_callback_data)) {
+                        node_n = cgraph->n_nodes;
+                        state->ec = GGML_STATUS_ABORTED;
+                        break;
+                    }
                 }
             }
 
@@ -19097,9 +19178,11 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
             atomic_store(&state->shared->n_active,  n_threads);
             atomic_store(&state->shared->node_n,    node_n);
             atomic_store(&state->shared->node_task, task_phase);
+            ggml_barrier_wake(&state->shared->node_n,    &state->shared->n_sleeping);
+            ggml_barrier_wake(&state->shared->node_task, &state->shared->n_sleeping);
         } else {
-            ggml_graph_compute_thread_sync_node(&node_n,     state, false);
-            ggml_graph_compute_thread_sync_task(&task_phase, state, false);
+            ggml_graph_compute_thread_sync_node(&node_n,     state);
+            ggml_graph_compute_thread_sync_task(&task_phase, state);
         }
 
         // check if we should stop
@@ -19127,15 +19210,13 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
             task_phase = GGML_TASK_TYPE_COMPUTE;
             atomic_store(&state->shared->n_active,  n_threads);
             atomic_store(&state->shared->node_task, task_phase);
+            ggml_barrier_wake(&state->shared->node_task, &state->shared->n_sleeping);
         }
         else {
-            // TODO: this sched_yield can have significant impact on the performance - either positive or negative
-            //       depending on the workload and the operating system.
-            //       since it is not clear what is the best approach, it should potentially become user-configurable
-            //       ref: https://github.com/ggerganov/ggml/issues/291
-            // UPD:  adding the do_yield flag seems to resolve the issue universally
-            const bool do_yield = node_n < 0 || cgraph->nodes[node_n]->op == GGML_OP_MUL_MAT;
-            ggml_graph_compute_thread_sync_task(&task_phase, state, do_yield);
+            // NB! Spinning with sched_yield() was making threads of co-located graphs fight for the cores,
+            //     now waiting threads fall asleep on the futex after the short spin
+            //     ref: https://github.com/ggerganov/ggml/issues/291
+            ggml_graph_compute_thread_sync_task(&task_phase, state);
         }
 
         if (state->ith < n_tasks) {
@@ -19147,9 +19228,10 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
             task_phase = GGML_TASK_TYPE_FINALIZE;
             atomic_store(&state->shared->n_active,  n_threads);
             atomic_store(&state->shared->node_task, task_phase);
+            ggml_barrier_wake(&state->shared->node_task, &state->shared->n_sleeping);
         }
         else {
-            ggml_graph_compute_thread_sync_task(&task_phase, state, false);
+            ggml_graph_compute_thread_sync_task(&task_phase, state);
         }
     }
 
@@ -19377,6 +19459,175 @@ static enum ggml_status ggml_graph_compute_parallel(struct ggml_compute_state *
     return compute_status;
 }
 
+#if !defined(_WIN32)
+static thread_ret_t ggml_threadpool_worker(void * data) {
+    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
+    struct ggml_threadpool    * pool  = state->pool;
+
+    int n_graphs = 0;
+
+    while (true) {
+        // wait for the next graph, spin for a while and then park on the cond
+        int current = ggml_spin_wait(&pool->n_graphs, n_graphs);
+
+        if (current == n_graphs) {
+            pthread_mutex_lock(&pool->mutex);
+            // NB! Parked worker is counted before n_graphs is checked again, see ggml_threadpool_compute()
+            atomic_fetch_add(&pool->n_parked, 1);
+            while ((current = atomic_load(&pool->n_graphs)) == n_graphs && !atomic_load(&pool->stop)) {
+                pthread_cond_wait(&pool->cond, &pool->mutex);
+            }
+            atomic_fetch_sub(&pool->n_parked, 1);
+            pthread_mutex_unlock(&pool->mutex);
+        }
+
+        if (atomic_load(&pool->stop)) {
+            break;
+        }
+
+        // the next graph can't start before all workers are done with the current one
+        n_graphs = current;
+
+        if (state->ith < state->shared->n_threads) {
+            ggml_graph_compute_thread(state);
+        }
+
+        atomic_fetch_add(&pool->n_done, 1);
+        ggml_barrier_wake(&pool->n_done, &pool->n_sleeping);
+    }
+
+    return 0;
+}
+
+static enum ggml_status ggml_threadpool_compute(struct ggml_threadpool * pool, struct ggml_compute_state_shared * shared) {
+    enum ggml_status compute_status = GGML_STATUS_SUCCESS;
+
+    for (int j = 0; j < pool->n_threads; j++) {
+        pool->workers[j].shared = shared;
+        pool->workers[j].ec     = GGML_STATUS_SUCCESS;
+    }
+
+    // wake up workers
+    atomic_store(&pool->n_done, 0);
+    atomic_fetch_add(&pool->n_graphs, 1);
+    if (atomic_load(&pool->n_parked) > 0) {
+        pthread_mutex_lock(&pool->mutex);
+        pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+
+    // this is a work thread too
+    ggml_graph_compute_thread(&pool->workers[0]);
+
+    // wait for workers, they are touching the shared state until the very end
+    int n_done = atomic_load(&pool->n_done);
+    while (n_done < pool->n_threads - 1) {
+        n_done = ggml_barrier_wait(&pool->n_done, n_done, &pool->n_sleeping);
+    }
+
+    for (int j = 0; j < shared->n_threads; j++) {
+        if (pool->workers[j].ec != GGML_STATUS_SUCCESS) {
+            compute_status = pool->workers[j].ec;
+            break;
+        }
+    }
+    return compute_status;
+}
+
+struct ggml_threadpool * ggml_threadpool_new(int n_threads, const int * cpus, int n_cpus) {
+    GGML_ASSERT(n_threads > 0);
+
+    struct ggml_threadpool * pool = GGML_MALLOC(sizeof(struct ggml_threadpool));
+
+    pool->n_threads = n_threads;
+    pool->workers   = GGML_MALLOC(sizeof(struct ggml_compute_state)*n_threads);
+
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    atomic_store(&pool->n_graphs,   0);
+    atomic_store(&pool->n_done,     0);
+    atomic_store(&pool->n_parked,   0);
+    atomic_store(&pool->n_sleeping, 0);
+    atomic_store(&pool->stop,       false);
+
+    for (int j = 0; j < n_threads; ++j) {
+        pool->workers[j] = (struct ggml_compute_state) {
+            .thrd   = 0,
+            .ith    = j,
+            .shared = NULL,
+            .ec     = GGML_STATUS_SUCCESS,
+            .pool   = pool,
+        };
+    }
+
+    // workers[0] is the thread calling ggml_graph_compute()
+    for (int j = 1; j < n_threads; ++j) {
+        const int rc = ggml_thread_create(&pool->workers[j].thrd, NULL, ggml_threadpool_worker, &pool->workers[j]);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+
+#if defined(__gnu_linux__)
+        if (cpus && n_cpus > 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            for (int i = 0; i < n_cpus; ++i) {
+                if (cpus[i] >= 0 && cpus[i] < CPU_SETSIZE) {
+                    CPU_SET(cpus[i], &set);
+                }
+            }
+            const int rv = pthread_setaffinity_np(pool->workers[j].thrd, sizeof(set), &set);
+            if (rv) {
+                fprintf(stderr, "warning: pthread_setaffinity_np() failed: %s\n", strerror(rv));
+            }
+        }
+#endif
+    }
+
+#if !defined(__gnu_linux__)
+    UNUSED(cpus);
+    UNUSED(n_cpus);
+#endif
+
+    return pool;
+}
+
+void ggml_threadpool_free(struct ggml_threadpool * pool) {
+    if (!pool) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    atomic_store(&pool->stop, true);
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (int j = 1; j < pool->n_threads; j++) {
+        const int rc = ggml_thread_join(pool->workers[j].thrd, NULL);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
+
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->mutex);
+
+    GGML_FREE(pool->workers);
+    GGML_FREE(pool);
+}
+#else
+// NB! There are no persistent threads on Windows, the NULL pool makes ggml_graph_compute() create threads for each graph
+struct ggml_threadpool * ggml_threadpool_new(int n_threads, const int * cpus, int n_cpus) {
+    UNUSED(n_threads);
+    UNUSED(cpus);
+    UNUSED(n_cpus);
+    return NULL;
+}
+
+void ggml_threadpool_free(struct ggml_threadpool * pool) {
+    UNUSED(pool);
+}
+#endif
+
 enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
     {
         GGML_ASSERT(cplan);
@@ -19389,9 +19640,16 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
 
     int n_threads = cplan->n_threads;
 
+#if !defined(_WIN32)
+    if (cplan->threadpool) {
+        n_threads = MIN(n_threads, cplan->threadpool->n_threads);
+    } else
+#endif
+    {
 #if defined(GGML_USE_OPENMP)
-    n_threads = MIN(n_threads, omp_get_max_threads());
+        n_threads = MIN(n_threads, omp_get_max_threads());
 #endif
+    }
 
     struct ggml_compute_state_shared state_shared = {
         /*.cgraph                  =*/ cgraph,
@@ -19405,21 +19663,33 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
         /*.abort_callback          =*/ NULL,
         /*.abort_callback_data     =*/ NULL,
         /*.current_chunk;          =*/ 0,
+        /*.n_sleeping              =*/ 0,
     };
-    struct ggml_compute_state * workers = alloca(sizeof(struct ggml_compute_state)*n_threads);
     const int64_t perf_start_cycles  = ggml_perf_cycles();
     const int64_t perf_start_time_us = ggml_perf_time_us();
 
-    for (int j = 0; j < n_threads; ++j) {
-        workers[j] = (struct ggml_compute_state) {
-            .thrd   = 0,
-            .ith    = j,
-            .shared = &state_shared,
-            .ec     = GGML_STATUS_SUCCESS,
-        };
-    }
+    enum ggml_status compute_status = GGML_STATUS_SUCCESS;
+
+#if !defined(_WIN32)
+    if (cplan->threadpool) {
+        compute_status = ggml_threadpool_compute(cplan->threadpool, &state_shared);
+    } else
+#endif
+    {
+        struct ggml_compute_state * workers = alloca(sizeof(struct ggml_compute_state)*n_threads);
+
+        for (int j = 0; j < n_threads; ++j) {
+            workers[j] = (struct ggml_compute_state) {
+                .thrd   = 0,
+                .ith    = j,
+                .shared = &state_shared,
+                .ec     = GGML_STATUS_SUCCESS,
+                .pool   = NULL,
+            };
+        }
 
-    enum ggml_status compute_status = ggml_graph_compute_parallel(workers, n_threads);
+        compute_status = ggml_graph_compute_parallel(workers, n_threads);
+    }
 
     // performance stats (graph)
     {
@@ -609,6 +609,9 @@ extern "C" {
     // If it returns true, the computation is aborted
     typedef bool (*ggml_abort_callback)(void * data);
 
+    // persistent compute threads, see ggml_threadpool_new()
+    struct ggml_threadpool;
+
     // the compute plan that needs to be prepared for ggml_graph_compute()
     // since https://github.com/ggerganov/ggml/issues/287
     struct ggml_cplan {
@@ -620,6 +623,9 @@ extern "C" {
         // abort ggml_graph_compute when true
         ggml_abort_callback abort_callback;
         void *              abort_callback_data;
+
+        // if not NULL, the graph is computed by the threads of the pool instead of the new ones
+        struct ggml_threadpool * threadpool;
     };
 
     enum ggml_cgraph_eval_order {
@@ -2028,6 +2034,12 @@ extern "C" {
     // note: the drawback of this API is that you must have ensured that the context has enough memory for the work data
     GGML_API enum ggml_status  ggml_graph_compute_with_ctx(struct ggml_context * ctx, struct ggml_cgraph * cgraph, int n_threads);
 
+    // long-lived compute threads pinned to the given CPUs (inherit the affinity of the calling thread if cpus is NULL)
+    // the thread calling ggml_graph_compute() is the first one of n_threads
+    // returns NULL on Windows, where graphs are computed with threads created for each of them as before
+    GGML_API struct ggml_threadpool * ggml_threadpool_new (int n_threads, const int * cpus, int n_cpus);
+    GGML_API void                     ggml_threadpool_free(struct ggml_threadpool * pool);
+
     GGML_API struct ggml_tensor * ggml_graph_get_tensor(struct ggml_cgraph * cgraph, const char * name);
 
     GGML_API void                 ggml_graph_export(const struct ggml_cgraph * cgraph, const char * fname);
@@ -1,6 +1,10 @@
 #include <array>
 #include <algorithm>
+#include <cmath>
+#include <cstdio>
 #include <cstring>
+#include <map>
+#include <mutex>
 #include <string>
 #include <vector>
 #include <random>
@@ -17,6 +21,12 @@
 #include "bridge.h"
 #include "janus.h"
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 char * janusDebug; // debug level = "cuda|tokenizer", etc
 
 // The Guardian has always been a newspaper for writers, 
@@ -28,10 +38,138 @@ char * janusDebug; // debug level = "cuda|tokenizer", etc
 
 // https://www.theguardian.com/info/2000/mar/24/neither-pedantic-nor-wild
 
-bool isJanusInitialized = false;
+// --- Janus tables
+
+#define LLAMA_FILE_MAGIC_JANUS 0x6a616e75u // 'janu'
+
+// tables are shared between all pods using the same model and Janus scale
+std::mutex janusMutex;
+std::map<std::pair<const llama_model *, float>, std::weak_ptr<const llama_janus_tables>> janusTables;
+
+// FNV-1a hash of model vocab, tables are valid only for exactly the same tokens
+static uint64_t vocab_hash(const llama_model * model) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    auto mix = [&hash](const void * data, size_t size) {
+        for (size_t i = 0; i < size; i++) {
+            hash ^= ((const uint8_t *) data)[i];
+            hash *= 0x100000001b3ULL;
+        }
+    };
+
+    // NB! Model desc is used for choosing token heuristics too
+    char desc[256];
+    llama_model_desc(model, desc, sizeof(desc));
+    mix(desc, strlen(desc) + 1);
+
+    const int32_t vocabSize = llama_n_vocab(model);
+    mix(&JANUS_VERSION, sizeof(JANUS_VERSION));
+    mix(&vocabSize, sizeof(vocabSize));
+    for (llama_token id = 0; id < vocabSize; id++) {
+        const char * text = llama_token_get_text(model, id);
+        mix(text, strlen(text) + 1);
+    }
+
+    return hash;
+}
+
+// -- Disk cache of tables is placed next to the model file
+
+static bool load_tables(const std::string & path, llama_janus_tables & tables, int32_t vocabSize) {
+
+    FILE * file = fopen(path.c_str(), "rb");
+    if (file == NULL) return false;
+
+    uint32_t magic = 0, version = 0;
+    uint64_t hash = 0;
+    float scale = 0.0;
+    int32_t size = 0;
+
+    bool ok =
+        fread(&magic,   sizeof(magic),   1, file) == 1 && magic == LLAMA_FILE_MAGIC_JANUS &&
+        fread(&version, sizeof(version), 1, file) == 1 && version == JANUS_VERSION &&
+        fread(&hash,    sizeof(hash),    1, file) == 1 && hash == tables.vocabHash &&
+        fread(&scale,   sizeof(scale),   1, file) == 1 && scale == tables.scale &&
+        fread(&size,    sizeof(size),    1, file) == 1 && size == vocabSize;
+
+    if (ok) {
+        tables.scales.resize(size);
+        tables.types.resize(size);
+        tables.pedantic.resize((size + 63) / 64);
+        ok =
+            fread(tables.scales.data(),   sizeof(float),    tables.scales.size(),   file) == tables.scales.size() &&
+            fread(tables.types.data(),    sizeof(int8_t),   tables.types.size(),    file) == tables.types.size() &&
+            fread(tables.pedantic.data(), sizeof(uint64_t), tables.pedantic.size(), file) == tables.pedantic.size();
+    }
+
+    fclose(file);
+    return ok;
+}
 
-float * scales; // precomputed scales (penalties) for each token
-float * types;  // precoputed types for each token
+static void save_tables(const std::string & path, const llama_janus_tables & tables) {
+
+    // NB! Write into temp file first, so other processes never read partial tables
+    std::string temp = path + ".tmp";
+    FILE * file = fopen(temp.c_str(), "wb");
+    if (file == NULL) return;
+
+    const uint32_t magic = LLAMA_FILE_MAGIC_JANUS;
+    const int32_t size = tables.scales.size();
+
+    bool ok =
+        fwrite(&magic,               sizeof(magic),            1, file) == 1 &&
+        fwrite(&JANUS_VERSION,       sizeof(JANUS_VERSION),    1, file) == 1 &&
+        fwrite(&tables.vocabHash,    sizeof(tables.vocabHash), 1, file) == 1 &&
+        fwrite(&tables.scale,        sizeof(tables.scale),     1, file) == 1 &&
+        fwrite(&size,                sizeof(size),             1, file) == 1 &&
+        fwrite(tables.scales.data(),   sizeof(float),    tables.scales.size(),   file) == tables.scales.size() &&
+        fwrite(tables.types.data(),    sizeof(int8_t),   tables.types.size(),    file) == tables.types.size() &&
+        fwrite(tables.pedantic.data(), sizeof(uint64_t), tables.pedantic.size(), file) == tables.pedantic.size();
+
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(temp.c_str(), path.c_str()) != 0) {
+        remove(temp.c_str());
+    }
+}
+
+// Returns tables for the model and Janus params, computing them only when no other pod or disk cache has them yet
+// cachePath - file for caching tables on disk, might be empty to disable caching
+std::shared_ptr<const llama_janus_tables> acquireJanus(
+        const llama_model * model,
+        llama_sampling_params & params,
+        const std::string & cachePath,
+        char * debug) {
+
+    ::janusDebug = debug;
+
+    // -- safe defaults
+
+    if (params.depth <= 0) params.depth = 200;
+    if (params.scale <= 0.0 || params.scale > 1.0) params.scale = 0.97;
+    if (params.hi <= 0.0    || params.hi > 1.0)    params.hi = 0.99;
+    if (params.lo <= 0.0    || params.lo > 1.0)    params.lo = 0.96;
+
+    std::lock_guard<std::mutex> lock(janusMutex);
+
+    auto & shared = janusTables[{ model, params.scale }];
+    auto tables = shared.lock();
+    if (tables) {
+        return tables;
+    }
+
+    auto fresh = std::make_shared<llama_janus_tables>();
+    fresh->vocabHash = vocab_hash(model);
+    fresh->scale     = params.scale;
+
+    if (cachePath.empty() || !load_tables(cachePath, *fresh, llama_n_vocab(model))) {
+        initJanus(model, params, *fresh);
+        if (!cachePath.empty()) {
+            save_tables(cachePath, *fresh);
+        }
+    }
+
+    shared = fresh;
+    return fresh;
+}
 
 // -- NB! llama_sampling_sample() is a newer implementation of older bridge.cpp::llama_sample_token() with Janus implementation inside
 /*
@@ -183,21 +321,135 @@ llama_token llama_sampling_sample(
     return id;
 }
 */
+// --- Janus kernels
+
+// Halve logits of the incompatible tokens [ when needed ] and find the max logit within the single pass over the vocab
+// NB! NaN logits are just skipped while looking for the max, as it was with comparisons before
+static float janus_mask_max(float * logits, const int8_t * types, const size_t n, const bool halve) {
+
+    size_t i = 0;
+    float top = -INFINITY;
+
+#if defined(__AVX2__)
+    const __m256i en    = _mm256_set1_epi32(LANG_EN);
+    const __m256i other = _mm256_set1_epi32(LANG_OTHER);
+    const __m256  one   = _mm256_set1_ps(1.0f);
+    const __m256  half  = _mm256_set1_ps(0.5f);
+    __m256 acc = _mm256_set1_ps(-INFINITY);
+
+    for (; i + 8 <= n; i += 8) {
+        __m256 v = _mm256_loadu_ps(logits + i);
+        if (halve) {
+            const __m256i t = _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *)(types + i)));
+            const __m256i m = _mm256_or_si256(_mm256_cmpeq_epi32(t, en), _mm256_cmpeq_epi32(t, other));
+            v = _mm256_mul_ps(v, _mm256_blendv_ps(one, half, _mm256_castsi256_ps(m)));
+            _mm256_storeu_ps(logits + i, v);
+        }
+        acc = _mm256_max_ps(v, acc); // returns acc for NaN
+    }
+
+    float lanes[8];
+    _mm256_storeu_ps(lanes, acc);
+    for (int j = 0; j < 8; j++) top = lanes[j] > top ? lanes[j] : top;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const int32x4_t en    = vdupq_n_s32(LANG_EN);
+    const int32x4_t other = vdupq_n_s32(LANG_OTHER);
+    const float32x4_t one  = vdupq_n_f32(1.0f);
+    const float32x4_t half = vdupq_n_f32(0.5f);
+    float32x4_t acc0 = vdupq_n_f32(-INFINITY);
+    float32x4_t acc1 = vdupq_n_f32(-INFINITY);
+
+    for (; i + 8 <= n; i += 8) {
+        float32x4_t v0 = vld1q_f32(logits + i);
+        float32x4_t v1 = vld1q_f32(logits + i + 4);
+        if (halve) {
+            const int16x8_t t = vmovl_s8(vld1_s8(types + i));
+            const int32x4_t t0 = vmovl_s16(vget_low_s16(t));
+            const int32x4_t t1 = vmovl_s16(vget_high_s16(t));
+            v0 = vmulq_f32(v0, vbslq_f32(vorrq_u32(vceqq_s32(t0, en), vceqq_s32(t0, other)), half, one));
+            v1 = vmulq_f32(v1, vbslq_f32(vorrq_u32(vceqq_s32(t1, en), vceqq_s32(t1, other)), half, one));
+            vst1q_f32(logits + i, v0);
+            vst1q_f32(logits + i + 4, v1);
+        }
+        acc0 = vbslq_f32(vcgtq_f32(v0, acc0), v0, acc0);
+        acc1 = vbslq_f32(vcgtq_f32(v1, acc1), v1, acc1);
+    }
+
+    float lanes[8];
+    vst1q_f32(lanes, acc0);
+    vst1q_f32(lanes + 4, acc1);
+    for (int j = 0; j < 8; j++) top = lanes[j] > top ? lanes[j] : top;
+#endif
+
+    for (; i < n; i++) {
+        if (halve && (types[i] == LANG_EN || types[i] == LANG_OTHER)) {
+            logits[i] *= 0.5;
+        }
+        top = logits[i] > top ? logits[i] : top;
+    }
+
+    return top;
+}
+
+// Collect tokens close enough to the top one [ except the top token itself ]
+// NB! It's the same condition as used for cutting the list sorted by logits, so it keeps everything for negative top logit
+static void janus_survivors(const float * logits, const size_t n, const llama_token topToken, const float topLogit, const float cutoff, std::vector<llama_token_data> & candidates) {
+
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    const __m256 top = _mm256_set1_ps(topLogit);
+    const __m256 cut = _mm256_set1_ps(cutoff);
+
+    for (; i + 8 <= n; i += 8) {
+        // most of the vocab is cut off, so whole blocks are skipped here
+        const __m256 ratio = _mm256_div_ps(_mm256_loadu_ps(logits + i), top);
+        if (_mm256_movemask_ps(_mm256_cmp_ps(ratio, cut, _CMP_LT_OQ)) == 0xFF) {
+            continue;
+        }
+        for (size_t j = i; j < i + 8; j++) {
+            if ((llama_token) j != topToken && !(logits[j] / topLogit < cutoff)) {
+                candidates.push_back(llama_token_data{(llama_token) j, logits[j], 0.0f});
+            }
+        }
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const float32x4_t top = vdupq_n_f32(topLogit);
+    const float32x4_t cut = vdupq_n_f32(cutoff);
+
+    for (; i + 4 <= n; i += 4) {
+        const float32x4_t ratio = vdivq_f32(vld1q_f32(logits + i), top);
+        if (vminvq_u32(vcltq_f32(ratio, cut)) == 0xFFFFFFFF) {
+            continue;
+        }
+        for (size_t j = i; j < i + 4; j++) {
+            if ((llama_token) j != topToken && !(logits[j] / topLogit < cutoff)) {
+                candidates.push_back(llama_token_data{(llama_token) j, logits[j], 0.0f});
+            }
+        }
+    }
+#endif
+
+    for (; i < n; i++) {
+        if ((llama_token) i != topToken && !(logits[i] / topLogit < cutoff)) {
+            candidates.push_back(llama_token_data{(llama_token) i, logits[i], 0.0f});
+        }
+    }
+}
+
 // -- Experimental approach of Janus Sampling by gotzmann [ paper is coming ]
 
 llama_token sample_janus_token(
 
         struct llama_context * ctx, 
+        const llama_janus_tables & tables,
         struct llama_sampling_params & params,
-        const std::vector<llama_token> & last_tokens,
+        const ring_buffer<llama_token> & last_tokens,
         const size_t promptLen,
         const size_t pos,
-        const size_t max) {
-
-    if (!::isJanusInitialized) {
-        initJanus(ctx, params, janusDebug);
-        ::isJanusInitialized = true;
-    }
+        const size_t max,
+        const int idx,
+        std::mt19937 & rng) {
 
     // const int64_t t_start_sample_us = ggml_time_us();
 
@@ -212,16 +464,15 @@ llama_token sample_janus_token(
     //exit(1); */
 
     // fprintf(stderr, "\n JANUS DEBUG = %s", janusDebug); // DEBUG
-    printDebug(ctx, pos, 0, "TOP LIST"); // -- DEBUG
+    printDebug(ctx, tables, idx, pos, 0, "TOP LIST"); // -- DEBUG
 
     auto model       = llama_get_model(ctx);
-    float * logits   = llama_get_logits(ctx);
+    float * logits   = llama_get_logits_ith(ctx, idx);
     size_t vocabSize = llama_n_vocab(model);
-    size_t ctxSize   = last_tokens.size();
     // auto scale       = params.scale;
 
-    auto lastToken = last_tokens.data()[ last_tokens.size() - 1 ];
-    auto lastType  = ::types[lastToken];
+    auto lastToken = last_tokens.back();
+    auto lastType  = tables.types[lastToken];
    
     // -- Boost <EOS> token when we are closer to the limit
     //    NB! It looks like it enough just do not penalize it at all [ allowing scale == 1.0 ] ?
@@ -232,96 +483,81 @@ llama_token sample_janus_token(
     //    For better performance we are excluding prompt tokens
 
     // TODO: This should work right for the first system prompt, but what's about the next ones [ second, third, etc ] ?!
-    size_t depth = std::min((size_t) params.depth, pos - promptLen);
+    size_t depth = std::min(std::min((size_t) params.depth, pos - promptLen), last_tokens.size());
     // fprintf(stderr, "\n * depth = %d", depth); // DEBUG
-    // fprintf(stderr, "\n * ctxSize = %d", ctxSize); // DEBUG
-    for (size_t i = 0; i < depth; i++) {
-        //fprintf(stderr, " [ i=%d | pos=%d | depth=%d | len=%d ] ", i, pos, depth, promptLen); // DEBUG
-        // WAS auto id = last_tokens.data()[ ctxSize - 1 - i ];
-        auto id = last_tokens[ ctxSize - 1 - i ];
-        auto curType = ::types[id];
-        // fprintf(stderr, "\n [ ID == %d ] ", id); // DEBUG
-
-        // Decrease reperition penalty for word continuation tokens to help prevent wrong wordings in complex languages
-        // TODO: Maybe we need to skip the last token itself [ with check of i > 0 ] ?! 
-        if ((lastType == SPACE_RU || lastType == LANG_RU) && curType == LANG_RU) {
-            // fprintf(stderr, "\n WAS 01 = %f", logits[id]); // DEBUG
-            logits[id] *= 1.0 - (1.0 - ::scales[id]) * 0.20;
-            // fprintf(stderr, "\n NOW 01 = %f", logits[id]); // DEBUG
-            continue;
-        }
-
-        // TODO: Should we process negative probabilities by scale division?
-        // how it was before: logits[id] /= 1.0 + (penalty - 1.0) * 0.10;
-        // fprintf(stderr, "\n SCALE 02 %d = %f", id, ::scales[id]); // DEBUG
-        // fprintf(stderr, "\n WAS 02 = %f", logits[id]); // DEBUG
-        logits[id] *= ::scales[id];
-        // fprintf(stderr, "\n NOW 02 = %f", logits[id]); // DEBUG
-    }
-   
-    // -- Double down incompatible tokens (like word endings in some other language)
 
-    for (size_t id = 0; id < vocabSize; id++) {
-
-        auto curType = ::types[id];
+    // NB! History is walked from the newest token to the oldest one within two spans of the ring buffer
+    auto window = last_tokens.last(depth);
+    const ring_buffer<llama_token>::span spans[] = { window.second, window.first };
+
+    for (const auto & span : spans) {
+        for (size_t i = span.size; i-- > 0; ) {
+            //fprintf(stderr, " [ i=%d | pos=%d | depth=%d | len=%d ] ", i, pos, depth, promptLen); // DEBUG
+            auto id = span.data[i];
+            auto curType = tables.types[id];
+            // fprintf(stderr, "\n [ ID == %d ] ", id); // DEBUG
+
+            // Decrease reperition penalty for word continuation tokens to help prevent wrong wordings in complex languages
+            // TODO: Maybe we need to skip the last token itself [ with check of i > 0 ] ?! 
+            if ((lastType == SPACE_RU || lastType == LANG_RU) && curType == LANG_RU) {
+                // fprintf(stderr, "\n WAS 01 = %f", logits[id]); // DEBUG
+                logits[id] *= 1.0 - (1.0 - tables.scales[id]) * 0.20;
+                // fprintf(stderr, "\n NOW 01 = %f", logits[id]); // DEBUG
+                continue;
+            }
 
-        if (
-            ((lastType == SPACE_RU || lastType == LANG_RU) && (curType == LANG_EN || curType == LANG_OTHER))
-            // ||
-            // ((lastType == LANG_EN || lastType == SPACE_EN) && curType == LANG_RU) // Europeans mix ASCII and UTF-8
-        ) {
-            // fprintf(stderr, "\n WAS 03 = %f", logits[id]); // DEBUG
-            logits[id] *= 0.5; // scale * scale * scale;
-            // fprintf(stderr, "\n NOW 03 = %f", logits[id]); // DEBUG
+            // TODO: Should we process negative probabilities by scale division?
+            // how it was before: logits[id] /= 1.0 + (penalty - 1.0) * 0.10;
+            // fprintf(stderr, "\n WAS 02 = %f", logits[id]); // DEBUG
+            logits[id] *= tables.scales[id];
+            // fprintf(stderr, "\n NOW 02 = %f", logits[id]); // DEBUG
         }
-    }        
+    }
    
-    // -- Sort all logits
+    // -- Double down incompatible tokens (like word endings in some other language)
+    //    and find the top token within the same pass over the vocab
 
-    std::vector<llama_token_data> candidates;
-    //candidates.reserve(vocabSize);
-    candidates.clear();
+    const bool isRU = lastType == SPACE_RU || lastType == LANG_RU;
+    const float topLogit = janus_mask_max(logits, tables.types.data(), vocabSize, isRU);
 
-    for (llama_token id = 0; id < (int) vocabSize; id++) {
-        //candidates.data()[id] = llama_token_data{ id, logits[id], 0.0f };
-        candidates.emplace_back(
-            llama_token_data{id, logits[id], 0.0f}
-        );
+    llama_token topToken = 0;
+    while (topToken < (llama_token) vocabSize - 1 && logits[topToken] != topLogit) {
+        topToken++;
     }
 
-    std::sort(
-        candidates.data(), 
-        candidates.data() + candidates.size(), 
-        [](const llama_token_data & a, const llama_token_data & b) { 
-            return a.logit > b.logit; 
-        }
-    );           
-    
     // -- Final choice [ with experimental cutoff ]
     //    We'll use some general cutoff value for most of tokens
     //    and pedantic cutoff for the sensitive ones
 
-    auto topToken = candidates.data()[0].id;
-    auto topType  = types[topToken];
-    auto topLogit = candidates.data()[0].logit;
+    auto topType  = tables.types[topToken];
 
     float cutoff = params.lo;
-    if (isPedantic(ctx, topToken) || topType == LANG_RU || topType == LANG_EN) {
+    if (tables.isPedantic(topToken) || topType == LANG_RU || topType == LANG_EN) {
         cutoff = params.hi;
     }
 
-    for (size_t i = 1; i < candidates.size(); i++) {
-        if (candidates.data()[i].logit / topLogit < cutoff) {
-            candidates.resize(i);
-            break;
+    // -- Only tokens close enough to the top one survive, so there is no need to sort the whole vocab
+
+    thread_local std::vector<llama_token_data> candidates;
+    candidates.clear();
+    candidates.push_back(llama_token_data{topToken, topLogit, 0.0f});
+
+    janus_survivors(logits, vocabSize, topToken, topLogit, cutoff, candidates);
+
+    std::sort(
+        candidates.data() + 1, 
+        candidates.data() + candidates.size(), 
+        [](const llama_token_data & a, const llama_token_data & b) { 
+            return a.logit > b.logit; 
         }
-    }
+    );
 
-    printDebug(ctx, pos, candidates.size(), "SHORTIST"); // -- DEBUG
+    printDebug(ctx, tables, idx, pos, candidates.size(), "SHORTIST"); // -- DEBUG
 
     llama_token_data_array shortlist = { candidates.data(), candidates.size(), true };
 
-    return llama_sample_token(ctx, &shortlist);
+    // NB! Each job has its own RNG when sampling multiple sequences within the same context
+    return llama_sample_token_with_rng(ctx, &shortlist, rng);
 }
 
 // Tokens very often used for math, coding and JSON (aka repetitive),
@@ -372,9 +608,7 @@ llama_token pedanticTokens[] = {
 };
 */
 
-bool isPedantic(struct llama_context * ctx, llama_token id) {
-
-    auto token = llama_token_to_piece(ctx, id);
+bool isPedantic(const std::string & token) {
 
     // -- numbers
 
@@ -397,19 +631,31 @@ bool isPedantic(struct llama_context * ctx, llama_token id) {
     return false;
 }
 
+// the same text of the token as llama_token_to_piece() of common returns, but without the context
+static std::string tokenPiece(const llama_model * model, const llama_token token) {
+    char buf[128];
+    const int n = llama_token_to_piece(model, token, buf, sizeof(buf), true);
+    if (n >= 0) {
+        return std::string(buf, n);
+    }
+    std::string piece(-n, 0);
+    llama_token_to_piece(model, token, &piece[0], piece.size(), true);
+    return piece;
+}
+
 // -- initJanus prefills base scaling penalties for each token depending on Janus Sampling euristics
 
 // LLaMA3 vocabSize = 128,288
 
-void initJanus(struct llama_context * ctx, struct llama_sampling_params & params, char * debug) {
-
-    ::isJanusInitialized = true;
-    ::janusDebug = debug;
+void initJanus(const struct llama_model * model, struct llama_sampling_params & params, llama_janus_tables & tables) {
 
-    auto model = llama_get_model(ctx);
     auto vocabSize = llama_n_vocab(model);
-    ::scales = new float[vocabSize] {};
-    ::types = new float[vocabSize] {};
+    tables.scales.assign(vocabSize, 0.0);
+    tables.types.assign(vocabSize, LANG_ZERO);
+    tables.pedantic.assign((vocabSize + 63) / 64, 0);
+
+    auto & scales = tables.scales;
+    auto & types  = tables.types;
 
     // fprintf(stderr, "\n\n === initJanus ===\n\n");
     // fprintf(stderr, "\n\n === vocabSize = %d ===\n\n", vocabSize);
@@ -427,13 +673,6 @@ void initJanus(struct llama_context * ctx, struct llama_sampling_params & params
     fprintf(stderr, "\n * lo = %f", params.lo);
     exit(1); */
 
-    // -- safe defaults
-
-    if (params.depth <= 0) params.depth = 200;
-    if (params.scale <= 0.0 || params.scale > 1.0) params.scale = 0.97;
-    if (params.hi <= 0.0    || params.hi > 1.0)    params.hi = 0.99;
-    if (params.lo <= 0.0    || params.lo > 1.0)    params.lo = 0.96;
-
     // -- init tokens with some heuristics
     //    how it was before [ with penalty = 1.06 ] : logits[id] /= 1.0 + (penalty - 1.0) * 0.10;
 
@@ -444,20 +683,26 @@ void initJanus(struct llama_context * ctx, struct llama_sampling_params & params
     // -- Assign manually specific penalties for high-frequency tokens
     // TODO: Need more work with real texts and statistical probabilities
 
+    // NB! Each token piece is decoded only once, it was the most expensive part of init before
+    std::vector<std::string> pieces(vocabSize);
+
     for (llama_token id = 0; id < vocabSize; id++) {
 
-        auto type  = tokType(ctx, id);
-        auto lower = isLower(ctx, id);
-        size_t len = tokSize(ctx, id);
+        pieces[id] = tokenPiece(model, id);
 
-        ::types[id] = type;
+        auto type  = tokType(pieces[id]);
+        auto lower = isLower(pieces[id]);
+        size_t len = pieces[id].size();
+
+        types[id] = type;
 
         // -- pedantic tokens
 
-        if (isPedantic(ctx, id)) {
-            ::scales[id] = 1.0 - (1.0 - scale) * 0.20;
-            //fprintf(stderr, "\n SCALE1 %d = %f", id, ::scales[id]);
-            //fprintf(stderr, " | \"%s\"", llama_token_to_piece(ctx, id).c_str());
+        if (isPedantic(pieces[id])) {
+            tables.pedantic[id >> 6] |= 1ULL << (id & 63);
+            scales[id] = 1.0 - (1.0 - scale) * 0.20;
+            //fprintf(stderr, "\n SCALE1 %d = %f", id, scales[id]);
+            //fprintf(stderr, " | \"%s\"", pieces[id].c_str());
             continue;
         }
 
@@ -474,26 +719,26 @@ void initJanus(struct llama_context * ctx, struct llama_sampling_params & params
 
         if (type == LANG_RU && lower) {
             // NB! Size in bytes is 2x of UTF-8 chars for RU
-            ::scales[id] = 1.0 - (1.0 - scale) * probes[len/2];
-            //fprintf(stderr, "\n SCALE2 %d = %f", id, ::scales[id]);
-            //fprintf(stderr, " | \"%s\"", llama_token_to_piece(ctx, id).c_str());
+            scales[id] = 1.0 - (1.0 - scale) * probes[std::min(len/2, (size_t) 19)];
+            //fprintf(stderr, "\n SCALE2 %d = %f", id, scales[id]);
+            //fprintf(stderr, " | \"%s\"", pieces[id].c_str());
             continue;
         }
 
         // -- similar hack for EN
 
         if (type == LANG_EN && lower) {
-            ::scales[id] = 1.0 - (1.0 - scale) * probes[len];
-            //fprintf(stderr, "\n SCALE3 %d = %f", id, ::scales[id]);
-            //fprintf(stderr, " | \"%s\"", llama_token_to_piece(ctx, id).c_str());
+            scales[id] = 1.0 - (1.0 - scale) * probes[std::min(len, (size_t) 19)];
+            //fprintf(stderr, "\n SCALE3 %d = %f", id, scales[id]);
+            //fprintf(stderr, " | \"%s\"", pieces[id].c_str());
             continue;
         }
 
         // -- full penalization for other tokens
 
-        ::scales[id] = scale;
-        //fprintf(stderr, "\n SCALE4 %d = %f", id, ::scales[id]);
-        //fprintf(stderr, " | \"%s\"", llama_token_to_piece(ctx, id).c_str());
+        scales[id] = scale;
+        //fprintf(stderr, "\n SCALE4 %d = %f", id, scales[id]);
+        //fprintf(stderr, " | \"%s\"", pieces[id].c_str());
     }
 
 /*
@@ -524,12 +769,12 @@ void initJanus(struct llama_context * ctx, struct llama_sampling_params & params
 
         if (vocabSize > 128000) { // LLaMA-3
 
-            ::scales[0] = 1.0;   // just to be safe
-            ::scales[128001] = scale; // penalize <|end_of_text|> in the beginning and allow it to boost over 1.0 later
+            scales[0] = 1.0;   // just to be safe
+            scales[128001] = scale; // penalize <|end_of_text|> in the beginning and allow it to boost over 1.0 later
 
             for (int id = 0; id < vocabSize; id++) {
 
-                auto token = llama_token_to_piece(ctx, id);
+                auto & token = pieces[id];
 
                 //if (token == "0" || token == "9" || token == "```" || token == " *") {
                 //    fprintf(stderr, "\n[ TOKEN | %d == %s]", id, token.c_str());
@@ -544,7 +789,7 @@ void initJanus(struct llama_context * ctx, struct llama_sampling_params & params
 
                 // 198, 271
                 if (token == "\n" || token == "\n\n") {
-                    ::scales[id] = 1.0 - (1.0 - scale) * 0.10;
+                    scales[id] = 1.0 - (1.0 - scale) * 0.10;
                     //fprintf(stderr, " [ TOKEN | %d == '%s' ] ", id, token.c_str());
                     continue;
                 }
@@ -553,138 +798,138 @@ void initJanus(struct llama_context * ctx, struct llama_sampling_params & params
 
                 // 256, 257
                 if (token == "  " || token == "    ") {
-                    ::scales[id] = 1.0 - (1.0 - scale) * 0.20;
+                    scales[id] = 1.0 - (1.0 - scale) * 0.20;
                     //fprintf(stderr, " [ TOKEN | %d == '%s' ] ", id, token.c_str());
                     continue;
                 } 
 
                 // 220, 11, 13
                 if (token == " " || token == "," || token == ".") {
-                    ::scales[id] = 1.0 - (1.0 - scale) * 0.10;
+                    scales[id] = 1.0 - (1.0 - scale) * 0.10;
                     //fprintf(stderr, " [ TOKEN | %d == '%s' ] ", id, token.c_str());
                     continue;
                 } 
 
                 // 2001, 12, 25, 26
                 if (token == " —" || token == "-" || token == ":" || token == ";") {
-                    ::scales[id] = 1.0 - (1.0 - scale) * 0.30;
+                    scales[id] = 1.0 - (1.0 - scale) * 0.30;
                     //fprintf(stderr, " [ TOKEN | %d == '%s' ] ", id, token.c_str());
                     continue;
                 } 
 
                 // 320, 570, 883, 8, 7
                 if (token == " (" || token == ")." || token == " )" || token == ")" || token == "(") {
-                    ::scales[id] = 1.0 - (1.0 - scale) * 0.30;
+                    scales[id] = 1.0 - (1.0 - scale) * 0.30;
                     //fprintf(stderr, " [ TOKEN | %d == '%s' ] ", id, token.c_str());
                     continue;
                 } 
 
-                if (id < 20000 && tokType(ctx, id) == SPACE_RU) {
-                    ::scales[id]   = 1.0 - (1.0 - scale) * 0.30;
+                if (id < 20000 && types[id] == SPACE_RU) {
+                    scales[id]   = 1.0 - (1.0 - scale) * 0.30;
                     continue;
                 }
 
-                if (id >= 20000 && id < 35000 && /*strlen(token.c_str()) >=2 &&*/ tokType(ctx, id) == SPACE_RU) {
-                    ::scales[id]   = 1.0 - (1.0 - scale) * 0.40;
+                if (id >= 20000 && id < 35000 && /*strlen(token.c_str()) >=2 &&*/ types[id] == SPACE_RU) {
+                    scales[id]   = 1.0 - (1.0 - scale) * 0.40;
                     //fprintf(stderr, " [ RUSSIAN | %d == '%s' ] ", id, token.c_str());
                     continue;
                 }
 
-                if (id >= 35000 && id < 50000 && tokType(ctx, id) == SPACE_RU) {
-                    ::scales[id]   = 1.0 - (1.0 - scale) * 0.50;
+                if (id >= 35000 && id < 50000 && types[id] == SPACE_RU) {
+                    scales[id]   = 1.0 - (1.0 - scale) * 0.50;
                     continue;
                 }
 
                 // -- Popular EN beginning parts
 
-                if (id < 500 && tokType(ctx, id) == SPACE_EN) {
-                    ::scales[id]   = 1.0 - (1.0 - scale) * 0.30;
+                if (id < 500 && types[id] == SPACE_EN) {
+                    scales[id]   = 1.0 - (1.0 - scale) * 0.30;
                     continue;
                 }
 
-                if (id >= 500 && id < 800 && tokType(ctx, id) == SPACE_EN) {
-                    ::scales[id]   = 1.0 - (1.0 - scale) * 0.40;
+                if (id >= 500 && id < 800 && types[id] == SPACE_EN) {
+                    scales[id]   = 1.0 - (1.0 - scale) * 0.40;
                     continue;
                 }
 
-                if (id >= 800 && id < 1100 && tokType(ctx, id) == SPACE_EN) {
-                    ::scales[id]   = 1.0 - (1.0 - scale) * 0.50;
+                if (id >= 800 && id < 1100 && types[id] == SPACE_EN) {
+                    scales[id]   = 1.0 - (1.0 - scale) * 0.50;
                     continue;
                 }
 
-                if (token == "\n") { ::scales[id] = 1.0 - (1.0 - scale) * 0.10; continue; } // newline
+                if (token == "\n") { scales[id] = 1.0 - (1.0 - scale) * 0.10; continue; } // newline
             
             } 
 
         } else { // LLaMA-2
 
-            ::scales[0]     = 1.0;   // just to be safe
-            ::scales[EOS]   = scale; // penalize <EOS> in the beginning and allow it to boost over 1.0 later
+            scales[0]     = 1.0;   // just to be safe
+            scales[EOS]   = scale; // penalize <EOS> in the beginning and allow it to boost over 1.0 later
             
-            ::scales[NL]    = 1.0 - (1.0 - scale) * 0.10; // newline
+            scales[NL]    = 1.0 - (1.0 - scale) * 0.10; // newline
 
-            ::scales[259]   = 1.0 - (1.0 - scale) * 0.20; //   259 => "  "
-            ::scales[268]   = 1.0 - (1.0 - scale) * 0.20; //   268 => "    "
+            scales[259]   = 1.0 - (1.0 - scale) * 0.20; //   259 => "  "
+            scales[268]   = 1.0 - (1.0 - scale) * 0.20; //   268 => "    "
 
-            ::scales[29871] = 1.0 - (1.0 - scale) * 0.10; // 29871 => " "
-            ::scales[29892] = 1.0 - (1.0 - scale) * 0.10; // 29892 => ","
-            ::scales[29889] = 1.0 - (1.0 - scale) * 0.20; // 29889 => "."
+            scales[29871] = 1.0 - (1.0 - scale) * 0.10; // 29871 => " "
+            scales[29892] = 1.0 - (1.0 - scale) * 0.10; // 29892 => ","
+            scales[29889] = 1.0 - (1.0 - scale) * 0.20; // 29889 => "."
 
-            ::scales[813]   = 1.0 - (1.0 - scale) * 0.30; // 813   => " —"
-            ::scales[29899] = 1.0 - (1.0 - scale) * 0.30; // 29899 => "-" [ used as bullet point ]
-            ::scales[29901] = 1.0 - (1.0 - scale) * 0.30; // 29901 => ":"
-            ::scales[29936] = 1.0 - (1.0 - scale) * 0.30; // 29936 => ";"
+            scales[813]   = 1.0 - (1.0 - scale) * 0.30; // 813   => " —"
+            scales[29899] = 1.0 - (1.0 - scale) * 0.30; // 29899 => "-" [ used as bullet point ]
+            scales[29901] = 1.0 - (1.0 - scale) * 0.30; // 29901 => ":"
+            scales[29936] = 1.0 - (1.0 - scale) * 0.30; // 29936 => ";"
 
-            ::scales[313]   = 1.0 - (1.0 - scale) * 0.30; // 313   => " ("
-            ::scales[467]   = 1.0 - (1.0 - scale) * 0.30; // 467   => ")."
-            ::scales[1723]  = 1.0 - (1.0 - scale) * 0.30; // 1723  => " )"
-            ::scales[29897] = 1.0 - (1.0 - scale) * 0.30; // 29897 => ")"
-            ::scales[29898] = 1.0 - (1.0 - scale) * 0.30; // 29898 => "("
+            scales[313]   = 1.0 - (1.0 - scale) * 0.30; // 313   => " ("
+            scales[467]   = 1.0 - (1.0 - scale) * 0.30; // 467   => ")."
+            scales[1723]  = 1.0 - (1.0 - scale) * 0.30; // 1723  => " )"
+            scales[29897] = 1.0 - (1.0 - scale) * 0.30; // 29897 => ")"
+            scales[29898] = 1.0 - (1.0 - scale) * 0.30; // 29898 => "("
     
             // -- Popular RU parts
 
-            ::scales[490]   = 1.0 - (1.0 - scale) * 0.30; // 490  => " в"
-            ::scales[531]   = 1.0 - (1.0 - scale) * 0.30; // 531  => " с"
-            ::scales[606]   = 1.0 - (1.0 - scale) * 0.30; // 606  => " и"
-            ::scales[614]   = 1.0 - (1.0 - scale) * 0.30; // 614  => " о"
-            ::scales[665]   = 1.0 - (1.0 - scale) * 0.35; // 665  => " на"
-            ::scales[733]   = 1.0 - (1.0 - scale) * 0.35; // 733  => " по"
-            ::scales[863]   = 1.0 - (1.0 - scale) * 0.35; // 863  => " у"
-            ::scales[1077]  = 1.0 - (1.0 - scale) * 0.40; // 1077 => " за"
-            ::scales[1097]  = 1.0 - (1.0 - scale) * 0.40; // 1097 => " а"
-            ::scales[1186]  = 1.0 - (1.0 - scale) * 0.40; // 1186 => " к"
-            ::scales[1447]  = 1.0 - (1.0 - scale) * 0.45; // 1447 => " до"
-            ::scales[1538]  = 1.0 - (1.0 - scale) * 0.45; // 1538 => " не"
-            ::scales[1604]  = 1.0 - (1.0 - scale) * 0.45; // 1604 => " об"
-            ::scales[1685]  = 1.0 - (1.0 - scale) * 0.45; // 1685 => " от"
-            ::scales[4281]  = 1.0 - (1.0 - scale) * 0.50; // 4281 => " что"
-
-            ::scales[857]   = 1.0 - (1.0 - scale) * 0.50; // 857  => " С"
-            ::scales[939]   = 1.0 - (1.0 - scale) * 0.50; // 939  => " В"
-            ::scales[1651]  = 1.0 - (1.0 - scale) * 0.50; // 1651 => " О"
+            scales[490]   = 1.0 - (1.0 - scale) * 0.30; // 490  => " в"
+            scales[531]   = 1.0 - (1.0 - scale) * 0.30; // 531  => " с"
+            scales[606]   = 1.0 - (1.0 - scale) * 0.30; // 606  => " и"
+            scales[614]   = 1.0 - (1.0 - scale) * 0.30; // 614  => " о"
+            scales[665]   = 1.0 - (1.0 - scale) * 0.35; // 665  => " на"
+            scales[733]   = 1.0 - (1.0 - scale) * 0.35; // 733  => " по"
+            scales[863]   = 1.0 - (1.0 - scale) * 0.35; // 863  => " у"
+            scales[1077]  = 1.0 - (1.0 - scale) * 0.40; // 1077 => " за"
+            scales[1097]  = 1.0 - (1.0 - scale) * 0.40; // 1097 => " а"
+            scales[1186]  = 1.0 - (1.0 - scale) * 0.40; // 1186 => " к"
+            scales[1447]  = 1.0 - (1.0 - scale) * 0.45; // 1447 => " до"
+            scales[1538]  = 1.0 - (1.0 - scale) * 0.45; // 1538 => " не"
+            scales[1604]  = 1.0 - (1.0 - scale) * 0.45; // 1604 => " об"
+            scales[1685]  = 1.0 - (1.0 - scale) * 0.45; // 1685 => " от"
+            scales[4281]  = 1.0 - (1.0 - scale) * 0.50; // 4281 => " что"
+
+            scales[857]   = 1.0 - (1.0 - scale) * 0.50; // 857  => " С"
+            scales[939]   = 1.0 - (1.0 - scale) * 0.50; // 939  => " В"
+            scales[1651]  = 1.0 - (1.0 - scale) * 0.50; // 1651 => " О"
 
             // -- Popular EN parts
 
-            ::scales[263]   = 1.0 - (1.0 - scale) * 0.30; // 263 => " a"
-            ::scales[278]   = 1.0 - (1.0 - scale) * 0.30; // 278 => " the"
-            ::scales[297]   = 1.0 - (1.0 - scale) * 0.30; // 297 => " in"
-            ::scales[304]   = 1.0 - (1.0 - scale) * 0.30; // 304 => " to"
-            ::scales[310]   = 1.0 - (1.0 - scale) * 0.30; // 310 => " of"
-            ::scales[322]   = 1.0 - (1.0 - scale) * 0.30; // 322 => " and"
-
-            ::scales[363]   = 1.0 - (1.0 - scale) * 0.35; // 363 => " for"
-            ::scales[372]   = 1.0 - (1.0 - scale) * 0.35; // 372 => " it"
-            ::scales[373]   = 1.0 - (1.0 - scale) * 0.35; // 373 => " on"
-            ::scales[385]   = 1.0 - (1.0 - scale) * 0.35; // 385 => " an"
-            ::scales[393]   = 1.0 - (1.0 - scale) * 0.35; // 393 => " that"
-            ::scales[408]   = 1.0 - (1.0 - scale) * 0.35; // 408 => " as"
-            ::scales[411]   = 1.0 - (1.0 - scale) * 0.35; // 411 => " with"
+            scales[263]   = 1.0 - (1.0 - scale) * 0.30; // 263 => " a"
+            scales[278]   = 1.0 - (1.0 - scale) * 0.30; // 278 => " the"
+            scales[297]   = 1.0 - (1.0 - scale) * 0.30; // 297 => " in"
+            scales[304]   = 1.0 - (1.0 - scale) * 0.30; // 304 => " to"
+            scales[310]   = 1.0 - (1.0 - scale) * 0.30; // 310 => " of"
+            scales[322]   = 1.0 - (1.0 - scale) * 0.30; // 322 => " and"
+
+            scales[363]   = 1.0 - (1.0 - scale) * 0.35; // 363 => " for"
+            scales[372]   = 1.0 - (1.0 - scale) * 0.35; // 372 => " it"
+            scales[373]   = 1.0 - (1.0 - scale) * 0.35; // 373 => " on"
+            scales[385]   = 1.0 - (1.0 - scale) * 0.35; // 385 => " an"
+            scales[393]   = 1.0 - (1.0 - scale) * 0.35; // 393 => " that"
+            scales[408]   = 1.0 - (1.0 - scale) * 0.35; // 408 => " as"
+            scales[411]   = 1.0 - (1.0 - scale) * 0.35; // 411 => " with"
             
-            ::scales[470]   = 1.0 - (1.0 - scale) * 0.40; // 470 => " or"
-            ::scales[472]   = 1.0 - (1.0 - scale) * 0.40; // 472 => " at"
-            ::scales[526]   = 1.0 - (1.0 - scale) * 0.40; // 526 => " are"
+            scales[470]   = 1.0 - (1.0 - scale) * 0.40; // 470 => " or"
+            scales[472]   = 1.0 - (1.0 - scale) * 0.40; // 472 => " at"
+            scales[526]   = 1.0 - (1.0 - scale) * 0.40; // 526 => " are"
 
-            ::scales[319]   = 1.0 - (1.0 - scale) * 0.50; // 319 => " A"
+            scales[319]   = 1.0 - (1.0 - scale) * 0.50; // 319 => " A"
         }
 
     } //else {
@@ -708,16 +953,13 @@ std::vector<std::byte> getBytes(std::string const &s) {
     return bytes;
 }
 
-int tokType(const llama_context *ctx, const llama_token token) {
+int tokType(const std::string & in) {
 
     int en = 0;
     int ru = 0;
     int other = 0;
     bool space = 0;
 
-    // WAS std::string in = llama_token_to_str(ctx, token); // vocab.id_to_token[token].text
-    std::string in = llama_token_to_piece(ctx, token); // vocab.id_to_token[token].text
-
     // DEBUG
     //std::string in = "хід";
     // in = "ё"; // 30043 => {209} {145} => {0xD1} {0x91}
@@ -811,10 +1053,8 @@ int tokType(const llama_context *ctx, const llama_token token) {
 }
 
 // NB! isLower works only for RU and EN 
-bool isLower(const llama_context *ctx, const llama_token token) {
+bool isLower(const std::string & in) {
 
-    // WAS: std::string in = llama_token_to_str(ctx, token);
-    std::string in = llama_token_to_piece(ctx, token);
     auto buf = getBytes(in);
 
     if (buf.size() <= 0) return false; 
@@ -843,18 +1083,13 @@ bool isLower(const llama_context *ctx, const llama_token token) {
     return false;
 }
 
-int tokSize(const llama_context *ctx, const llama_token token) {
-    // WAS: return llama_token_to_str(ctx, token).size();
-    return llama_token_to_piece(ctx, token).size();
-}
-
-void printDebug(struct llama_context * ctx, const int pos, const size_t shortlist, const char * text) {
+void printDebug(struct llama_context * ctx, const llama_janus_tables & tables, const int idx, const int pos, const size_t shortlist, const char * text) {
 
     if (::janusDebug == NULL) return; // DEBUG
     if (!strstr(::janusDebug, "sampling")) return; // DEBUG
 
     auto model = llama_get_model(ctx);
-    float * logits = llama_get_logits(ctx);
+    float * logits = llama_get_logits_ith(ctx, idx);
     const int vocabSize = llama_n_vocab(model);
 
     std::vector<llama_token_data> candidates;
@@ -896,14 +1131,14 @@ void printDebug(struct llama_context * ctx, const int pos, const size_t shortlis
                 "\n  --    13 [ %s%.3f * %.3f ] \"\\n\"",
                 zero.c_str(),
                 logit, 
-                ::scales[id]
+                tables.scales[id]
             );
         } else if (id == EOS) {
             fprintf(stderr, 
                 "\n  --     2 [ %s%.3f * %.3f ] \"<EOS>\"",
                 zero.c_str(),
                 logit, 
-                ::scales[id]
+                tables.scales[id]
             );
         } else {
             fprintf(stderr, 
@@ -911,7 +1146,7 @@ void printDebug(struct llama_context * ctx, const int pos, const size_t shortlis
                 id,
                 zero.c_str(),
                 logit,
-                ::scales[id],
+                tables.scales[id],
                 // WAS: llama_token_to_str(ctx, id).c_str()
                 llama_token_to_piece(ctx, id).c_str()
             );
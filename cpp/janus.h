@@ -2,6 +2,9 @@
 
 #include <string>
 #include <vector>
+#include <random>
+#include <memory>
+#include <cstdint>
 
 #include "ggml-common.h"
 #include "ggml-backend.h"
@@ -24,23 +27,48 @@ const int SPACE_RU = 30;
 const int LANG_OTHER = 4;
 const int SPACE_OTHER = 40;
 
+// -- Janus tables
+
+// bump the version when token heuristics are changed, so tables cached on disk are rebuilt
+const uint32_t JANUS_VERSION = 1;
+
+// NB! Tables are computed once for each model and Janus params, and never changed after that,
+//     so they are shared between pods and slots without any locking
+struct llama_janus_tables {
+    uint64_t vocabHash;             // hash of model vocab the tables were computed for
+    float scale;                    // Janus scale the tables were computed with
+    std::vector<float> scales;      // precomputed scales (penalties) for each token
+    std::vector<int8_t> types;      // precomputed types for each token
+    std::vector<uint64_t> pedantic; // bitset of pedantic tokens
+
+    bool isPedantic(llama_token id) const { return (pedantic[id >> 6] >> (id & 63)) & 1; }
+};
+
+std::shared_ptr<const llama_janus_tables> acquireJanus(
+    const struct llama_model * model,
+    struct llama_sampling_params & params,
+    const std::string & cachePath,
+    char * debug);
+
 llama_token sample_janus_token(
     struct llama_context * ctx, 
+    const llama_janus_tables & tables,
     struct llama_sampling_params & params, 
-    const std::vector<llama_token> & last_tokens, 
+    const ring_buffer<llama_token> & last_tokens, 
     const size_t promptLen,
     const size_t pos,
-    const size_t max);
+    const size_t max,
+    const int idx,
+    std::mt19937 & rng);
 
 ///// std::string llama_token_to_str(const struct llama_context * ctx, llama_token token);
 
 std::vector<std::byte> getBytes(std::string const &s);
-bool isPedantic(struct llama_context * ctx, llama_token id);
-bool isLower(const llama_context *ctx, const llama_token token);
-int tokType(const llama_context *ctx, const llama_token token);
-int tokSize(const llama_context *ctx, const llama_token token);
-void initJanus(struct llama_context * ctx, struct llama_sampling_params & params, char * debug);
-void printDebug(struct llama_context * ctx, const int pos, const size_t shortlist, const char * text);
+bool isPedantic(const std::string & token);
+bool isLower(const std::string & in);
+int tokType(const std::string & in);
+void initJanus(const struct llama_model * model, struct llama_sampling_params & params, llama_janus_tables & tables);
+void printDebug(struct llama_context * ctx, const llama_janus_tables & tables, const int idx, const int pos, const size_t shortlist, const char * text);
 
 
 // Get a string representation of the last sampled tokens
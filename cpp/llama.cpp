@@ -2361,6 +2361,8 @@ struct llama_context {
     ggml_abort_callback abort_callback      = nullptr;
     void *              abort_callback_data = nullptr;
 
+    struct ggml_threadpool * threadpool = nullptr; // not owned
+
     // input tensors
     struct ggml_tensor * inp_tokens;    // I32 [n_batch]
     struct ggml_tensor * inp_embd;      // F32 [n_embd, n_batch]
@@ -12024,7 +12026,7 @@ static size_t llama_output_reserve(llama_context & lctx, size_t n_outputs) {
 }
 
 
-static void llama_graph_compute(
+static enum ggml_status llama_graph_compute(
         llama_context & lctx,
           ggml_cgraph * gf,
                   int   n_threads) {
@@ -12037,6 +12039,7 @@ static void llama_graph_compute(
     if (lctx.backend_cpu != nullptr) {
         ggml_backend_cpu_set_n_threads(lctx.backend_cpu, n_threads);
         ggml_backend_cpu_set_abort_callback(lctx.backend_cpu, lctx.abort_callback, lctx.abort_callback_data);
+        ggml_backend_cpu_set_threadpool(lctx.backend_cpu, lctx.threadpool);
     }
 #ifdef GGML_USE_BLAS
     if (lctx.backend_blas != nullptr) {
@@ -12044,9 +12047,11 @@ static void llama_graph_compute(
     }
 #endif
 
-    ggml_backend_sched_graph_compute_async(lctx.sched, gf);
+    enum ggml_status status = ggml_backend_sched_graph_compute_async(lctx.sched, gf);
 
     // fprintf(stderr, "splits: %d\n", ggml_backend_sched_get_n_splits(lctx.sched));
+
+    return status;
 }
 
 // decode a batch of tokens by evaluating the transformer
@@ -12269,7 +12274,11 @@ static int llama_decode_internal(
 
         llama_set_inputs(lctx, u_batch);
 
-        llama_graph_compute(lctx, gf, n_threads);
+        // the rest of ubatches is not evaluated at all after the abort
+        // NB! KV cells taken by the batch hold garbage, so the caller should remove them from the cache
+        if (llama_graph_compute(lctx, gf, n_threads) == GGML_STATUS_ABORTED) {
+            return 2;
+        }
 
         // update the kv ring buffer
         {
@@ -14088,9 +14097,10 @@ void llama_sample_top_k(struct llama_context * ctx, llama_token_data_array * can
     k = std::min(k, (int) candidates->size);
 
     // Sort scores in descending order
+    // NB! Ties are resolved by token ID, so the same logits always give the same candidates [ as fused Top-K of the bridge does ]
     if (!candidates->sorted) {
         auto comp = [](const llama_token_data & a, const llama_token_data & b) {
-            return a.logit > b.logit;
+            return a.logit > b.logit || (a.logit == b.logit && a.id < b.id);
         };
         if (k <= 128) {
             std::partial_sort(candidates->data, candidates->data + k, candidates->data + candidates->size, comp);
@@ -17859,6 +17869,10 @@ void llama_set_abort_callback(struct llama_context * ctx, bool (*abort_callback)
     ctx->abort_callback_data = abort_callback_data;
 }
 
+void llama_attach_threadpool(struct llama_context * ctx, struct ggml_threadpool * threadpool) {
+    ctx->threadpool = threadpool;
+}
+
 void llama_set_causal_attn(struct llama_context * ctx, bool causal_attn) {
     ctx->cparams.causal_attn = causal_attn;
 }
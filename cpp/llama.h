@@ -770,6 +770,7 @@ extern "C" {
     // Positive return values does not mean a fatal error, but rather a warning.
     //   0 - success
     //   1 - could not find a KV slot for the batch (try reducing the size of the batch or increase the context)
+    //   2 - aborted by the abort callback (sequences of the batch should be removed from the KV cache)
     // < 0 - error
     LLAMA_API int32_t llama_decode(
             struct llama_context * ctx,
@@ -793,6 +794,10 @@ extern "C" {
     // Set abort callback
     LLAMA_API void llama_set_abort_callback(struct llama_context * ctx, ggml_abort_callback abort_callback, void * abort_callback_data);
 
+    // Compute graphs with the long-lived threads of the pool instead of starting new ones for each of them
+    // The pool is not owned by the context and might be shared between contexts used from the same thread, NULL to detach
+    LLAMA_API void llama_attach_threadpool(struct llama_context * ctx, struct ggml_threadpool * threadpool);
+
     // Wait until all computations are finished
     // This is automatically done when using one of the functions below to obtain the computation results
     // and is not necessary to call it explicitly in most cases
@@ -0,0 +1,416 @@
+// Unit checks of the bridge internals which do not need any model
+// NB! The bridge is included right here, so its static helpers are reachable without exporting them
+
+#include "../bridge.cpp"
+
+#undef NDEBUG
+#include <cassert>
+
+// -- ring buffer of the recent tokens
+
+static std::vector<int> unroll(const std::pair<ring_buffer<int>::span, ring_buffer<int>::span> & last) {
+    std::vector<int> items(last.first.data, last.first.data + last.first.size);
+    items.insert(items.end(), last.second.data, last.second.data + last.second.size);
+    return items;
+}
+
+static void test_ring_buffer() {
+    ring_buffer<int> ring;
+
+    // empty buffer of zero capacity never fails
+    ring.push_back(1);
+    assert(ring.empty());
+    assert(unroll(ring.last(4)).empty());
+
+    ring.assign(5, 0);
+    assert(ring.size() == 5 && ring.capacity() == 5);
+    assert((unroll(ring.last(3)) == std::vector<int>{ 0, 0, 0 }));
+
+    // no wrap yet: the oldest item is at the start of the storage
+    for (int i = 1; i <= 5; i++) {
+        ring.push_back(i);
+    }
+    auto last = ring.last(3);
+    assert(last.second.size == 0);
+    assert((unroll(last) == std::vector<int>{ 3, 4, 5 }));
+
+    // wrapped: older items are at the end of the storage and newer ones at the start
+    ring.push_back(6);
+    ring.push_back(7);
+    last = ring.last(4);
+    assert(last.first.size == 2 && last.second.size == 2);
+    assert((unroll(last) == std::vector<int>{ 4, 5, 6, 7 }));
+
+    // the newer span only
+    assert((unroll(ring.last(2)) == std::vector<int>{ 6, 7 }));
+    assert(ring.last(2).first.size == 2 && ring.last(2).second.size == 0);
+
+    // asking for more than there is gives everything
+    assert((unroll(ring.last(100)) == std::vector<int>{ 3, 4, 5, 6, 7 }));
+    assert(unroll(ring.last(0)).empty());
+
+    // spans agree with indexed access
+    for (size_t n = 0; n <= ring.size(); n++) {
+        const auto items = unroll(ring.last(n));
+        for (size_t i = 0; i < n; i++) {
+            assert(items[n - 1 - i] == ring.rat(i));
+        }
+    }
+    assert(ring.back() == 7 && ring[0] == 3);
+}
+
+// -- output text is cut before the incomplete UTF-8 sequence
+
+static void test_utf8_complete() {
+    assert(utf8_complete("") == 0);
+    assert(utf8_complete("hello") == 5);
+
+    const std::string e  = "\xC3\xA9";         // 2 bytes
+    const std::string ru = "\xD0\xB6";         // 2 bytes
+    const std::string cn = "\xE4\xB8\xAD";     // 3 bytes
+    const std::string em = "\xF0\x9F\x98\x80"; // 4 bytes
+
+    for (const auto & ch : { e, ru, cn, em }) {
+        const std::string text = "ab" + ch;
+        assert(utf8_complete(text) == text.size());
+        for (size_t n = 1; n < ch.size(); n++) {
+            assert(utf8_complete("ab" + ch.substr(0, n)) == 2);
+        }
+    }
+
+    // several characters in a row, the last one is split
+    assert(utf8_complete(em + cn + em.substr(0, 2)) == em.size() + cn.size());
+
+    // broken bytes are passed as is, so the output never stalls on them
+    assert(utf8_complete("ab\xFF") == 3);
+    assert(utf8_complete("\x80\x80\x80\x80\x80") == 5);
+}
+
+// -- grammar states are the same for the same position whatever copy of the grammar is used
+
+static void accept_text(llama_grammar * grammar, const std::string & text) {
+    for (unsigned char c : text) {
+        std::vector<std::vector<const llama_grammar_element *>> stacks;
+        llama_grammar_accept(grammar->rules, grammar->stacks, c, stacks);
+        grammar->stacks = std::move(stacks);
+    }
+}
+
+static llama_sampling_context * grammar_job(const llama_compiled_grammar & compiled) {
+    llama_sampling_params sparams;
+    auto ctx_sampling = llama_sampling_init(sparams);
+    ctx_sampling->grammar = llama_grammar_copy(compiled.grammar);
+    return ctx_sampling;
+}
+
+static void test_grammar_state() {
+    const auto compiled = compile_grammar("root ::= \"id\" [0-9]+ (\",\" [a-z]+)* \".\"", "");
+    assert(compiled && compiled->grammar);
+
+    auto a = grammar_job(*compiled);
+    auto b = grammar_job(*compiled);
+
+    // rules of each copy live at other addresses, still the keys match
+    assert(&a->grammar->rules[0][0] != &b->grammar->rules[0][0]);
+    assert(grammar_state(a) == grammar_state(b));
+
+    accept_text(a->grammar, "id12,ab");
+    accept_text(b->grammar, "id12,ab");
+    assert(!a->grammar->stacks.empty());
+    assert(grammar_state(a) == grammar_state(b));
+
+    // other positions give other keys
+    accept_text(b->grammar, ",");
+    assert(grammar_state(a) != grammar_state(b));
+
+    // the same grammar compiled from the same source is shared
+    assert(compile_grammar("root ::= \"id\" [0-9]+ (\",\" [a-z]+)* \".\"", "") == compiled);
+
+    llama_sampling_free(a);
+    llama_sampling_free(b);
+}
+
+// -- choices forked from the job follow its grammar with their own copies of it
+
+static void test_grammar_fork() {
+    const auto compiled = compile_grammar("root ::= \"[\" ([0-9]+ \",\")* \"]\"", "");
+    assert(compiled && compiled->grammar);
+
+    auto parent = grammar_job(*compiled);
+    accept_text(parent->grammar, "[12,");
+
+    // NB! The parent has already built its bases, the fork should not look up its own rules with them
+    const std::string state = grammar_state(parent);
+    assert(!parent->grammar_bases.empty());
+
+    auto fork = clone_sampling(parent);
+    assert(fork->grammar != parent->grammar);
+    assert(grammar_state(fork) == state);
+
+    // both continue the same way, while the parent grammar might be freed before the fork is done
+    accept_text(parent->grammar, "3");
+    accept_text(fork->grammar, "3");
+    assert(grammar_state(fork) == grammar_state(parent));
+
+    accept_text(fork->grammar, ",");
+    assert(grammar_state(fork) != grammar_state(parent));
+
+    llama_sampling_free(parent);
+
+    auto other = grammar_job(*compiled);
+    accept_text(other->grammar, "[12,3,");
+    assert(grammar_state(fork) == grammar_state(other));
+
+    llama_sampling_free(fork);
+    llama_sampling_free(other);
+}
+
+// -- fused Top-K selects the same candidates as the full sampling chain
+
+static void test_fused_sampling() {
+    const int n_vocab = 5000;
+
+    std::mt19937 rng(42);
+    std::vector<float> distinct(n_vocab);
+    for (int i = 0; i < n_vocab; i++) {
+        distinct[i] = (float) i / 100.0f - 20.0f;
+    }
+    std::shuffle(distinct.begin(), distinct.end(), rng);
+
+    // NB! Coarse logits give plenty of ties around the k-th place, both ways should cut them by token ID
+    std::vector<float> coarse(n_vocab);
+    for (int i = 0; i < n_vocab; i++) {
+        coarse[i] = (float) (rng() % 64) / 4.0f - 8.0f;
+    }
+
+    for (const auto & logits : { distinct, coarse }) {
+        for (int k : { 1, 5, 40, 200, 1000 }) {
+            for (float top_p : { 1.0f, 0.9f, 0.5f }) {
+                llama_sampling_params sparams;
+                sparams.top_k = k;
+                sparams.top_p = top_p;
+                sparams.min_p = 0.05f;
+                sparams.temp  = 0.8f;
+
+                auto ctx_sampling = llama_sampling_init(sparams);
+
+                int k_fused = 0;
+                assert(llama_sampling_fusable(ctx_sampling, n_vocab, k_fused) && k_fused == k);
+
+                const size_t min_keep = std::max(1, sparams.min_keep);
+
+                std::vector<llama_token_data> full(n_vocab);
+                for (llama_token id = 0; id < n_vocab; id++) {
+                    full[id] = llama_token_data{ id, logits[id], 0.0f };
+                }
+                llama_token_data_array full_p = { full.data(), full.size(), false };
+                sampler_queue(NULL, sparams, full_p, min_keep);
+
+                std::vector<llama_token_data> top;
+                top_k_logits(logits.data(), n_vocab, k_fused, top);
+                llama_token_data_array top_p_arr = { top.data(), top.size(), true };
+                sampler_queue(NULL, sparams, top_p_arr, min_keep, 1);
+
+                assert(full_p.size == top_p_arr.size);
+                for (size_t i = 0; i < full_p.size; i++) {
+                    assert(full_p.data[i].id == top_p_arr.data[i].id);
+                    assert(full_p.data[i].p  == top_p_arr.data[i].p);
+                }
+
+                llama_sampling_free(ctx_sampling);
+            }
+        }
+    }
+
+    // chains without the leading Top-K and greedy sampling keep the full path
+    llama_sampling_params sparams;
+    int k = 0;
+
+    sparams.top_k = 0;
+    auto ctx_sampling = llama_sampling_init(sparams);
+    assert(!llama_sampling_fusable(ctx_sampling, n_vocab, k));
+    llama_sampling_free(ctx_sampling);
+
+    sparams.top_k = 40;
+    sparams.temp  = 0.0f;
+    ctx_sampling = llama_sampling_init(sparams);
+    assert(!llama_sampling_fusable(ctx_sampling, n_vocab, k));
+    llama_sampling_free(ctx_sampling);
+}
+
+// -- job records are dropped when released or expired, while the holders of the record still read it safely
+
+static void test_job_records() {
+    // another job of the same shard, so creating it sweeps the expired ones
+    std::string other;
+    for (int i = 0; other.empty(); i++) {
+        const std::string id = "other-" + std::to_string(i);
+        if (&job_shard(id) == &job_shard("job")) other = id;
+    }
+
+    auto record = create_job("job");
+    assert(find_job("job") == record);
+    assert(find_job("none") == nullptr);
+
+    // running jobs are never expired
+    create_job(other);
+    assert(find_job("job") == record);
+
+    // finished long ago
+    record->output = "done";
+    record->t_finished_us = ggml_time_us() - (int64_t) (JOB_TTL + 1) * 1000 * 1000;
+    create_job(other);
+    assert(find_job("job") == nullptr);
+    assert(record->output == "done" && record.use_count() == 1);
+
+    // finished just now
+    record = create_job("job");
+    record->output = "done";
+    record->t_finished_us = ggml_time_us();
+    create_job(other);
+    assert(find_job("job") == record);
+
+    char buf[8];
+    assert(readOutputCPP("job", 0, buf, sizeof(buf)) == 4 && std::string(buf, 4) == "done");
+    assert(readOutputCPP("job", 2, buf, 1) == 1 && buf[0] == 'n');
+    assert(readOutputCPP("job", 4, buf, sizeof(buf)) == 0);
+
+    releaseJobCPP("job");
+    releaseJobCPP(other);
+    assert(find_job("job") == nullptr && find_job(other) == nullptr);
+    assert(readOutputCPP("job", 0, buf, sizeof(buf)) == 0);
+    assert(record->output == "done");
+}
+
+// -- n-gram table keeps all following tokens and survives the file round-trip
+
+static std::map<llama_token, int32_t> follows(const llama_ngram_cache & cache, const llama_ngram & ngram) {
+    std::map<llama_token, int32_t> res;
+    const llama_ngram_entry * entry = cache.find(ngram);
+    if (entry) {
+        cache.for_each(*entry, [&](llama_token token, int32_t count) { res[token] += count; });
+    }
+    return res;
+}
+
+static void test_ngram_cache() {
+    llama_ngram_cache cache;
+    std::map<std::vector<llama_token>, std::map<llama_token, int32_t>> expected;
+
+    // enough n-grams for the table to grow several times and enough followers to chain overflow chunks
+    std::mt19937 rng(7);
+    for (int i = 0; i < 20000; i++) {
+        const int size = 1 + rng() % LLAMA_NGRAM_MAX;
+        std::vector<llama_token> tokens(size);
+        for (auto & token : tokens) {
+            token = rng() % 30;
+        }
+        const llama_token next = rng() % (i % 3 == 0 ? 40 : 3);
+        cache.add(llama_ngram(tokens.data(), size), next, 1);
+        expected[tokens][next]++;
+    }
+
+    auto check = [&](const llama_ngram_cache & table) {
+        assert(table.size() == expected.size());
+        for (const auto & it : expected) {
+            const llama_ngram ngram(it.first.data(), it.first.size());
+            assert(follows(table, ngram) == it.second);
+            for (const auto & follow : it.second) {
+                assert(table.count(*table.find(ngram), follow.first) == follow.second);
+            }
+        }
+        const llama_token unseen[] = { 100, 101 };
+        assert(table.find(llama_ngram(unseen, 2)) == nullptr);
+    };
+
+    check(cache);
+    assert(cache.n_chunks > 0);
+
+    const std::string path = std::filesystem::temp_directory_path() / "test-bridge-ngram.bin";
+    assert(llama_ngram_cache_save(cache, path));
+
+    check(llama_ngram_cache_load(path));
+    const auto mapped = llama_ngram_cache_map(path);
+    check(mapped);
+
+    // merged into the empty cache gives the same table, even from the mapped one
+    llama_ngram_cache merged;
+    llama_ngram_cache_merge(merged, mapped);
+    check(merged);
+
+    std::filesystem::remove(path);
+
+    // NB! Full disk or missing directory should be reported, not crash the server
+    assert(!llama_ngram_cache_save(cache, "/dev/full"));
+    assert(!llama_ngram_cache_save(cache, "/nonexistent/test-bridge-ngram.bin"));
+}
+
+// -- snapshots are found by the longest prefix of tokens they share with the prompt
+
+static void test_snapshot_lookup() {
+    std::mt19937 rng(1);
+    std::vector<llama_token> history(SWAP_ANCHOR * 2 + 100);
+    for (auto & token : history) {
+        token = rng() % 32000;
+    }
+
+    // anchors are taken every SWAP_ANCHOR tokens and at the end
+    const auto anchors = snapshot_anchors(history.data(), history.size());
+    assert(anchors.size() == 3);
+    assert(anchors[0].second == SWAP_ANCHOR && anchors[1].second == SWAP_ANCHOR * 2 && anchors[2].second == history.size());
+    assert(snapshot_anchors(history.data(), SWAP_ANCHOR)[0] == anchors[0]);
+
+    llama_swap swap;
+    const int64_t swapSize = ::swapSize;
+
+    llama_snapshot snapshot;
+    snapshot.path    = "/nonexistent/test-bridge.kv";
+    snapshot.anchors = anchors;
+    snapshot.size    = 1000;
+    const uint64_t key = anchors.back().first;
+    add_snapshot(swap, key, std::move(snapshot));
+    assert(::swapSize == swapSize + 1000);
+
+    size_t n_found = 0;
+
+    // the same tokens
+    assert(find_snapshot(swap, history, 0, n_found) == &swap.files[key] && n_found == history.size());
+
+    // the prompt continues the history, so only the whole anchors match
+    auto prompt = history;
+    prompt.push_back(1);
+    assert(find_snapshot(swap, prompt, 0, n_found) && n_found == SWAP_ANCHOR * 2);
+
+    // nothing longer than we already have
+    n_found = 0;
+    assert(!find_snapshot(swap, prompt, SWAP_ANCHOR * 2, n_found) && n_found == 0);
+
+    // other tokens within the first anchor
+    prompt[10]++;
+    assert(!find_snapshot(swap, prompt, 0, n_found));
+
+    // anchors of unknown files are skipped without adding empty files
+    swap.anchors.insert({ anchors[0].first, key + 1 });
+    assert(find_snapshot(swap, history, 0, n_found) == &swap.files[key] && n_found == history.size());
+    assert(swap.files.size() == 1);
+
+    remove_snapshot(swap, key);
+    assert(::swapSize == swapSize);
+    assert(swap.files.empty() && swap.anchors.size() == 1);
+    assert(!find_snapshot(swap, history, 0, n_found));
+    assert(swap.files.empty());
+}
+
+int main() {
+    test_ring_buffer();
+    test_utf8_complete();
+    test_grammar_state();
+    test_grammar_fork();
+    test_fused_sampling();
+    test_job_records();
+    test_ngram_cache();
+    test_snapshot_lookup();
+
+    fprintf(stderr, "All tests passed.\n");
+    return 0;
+}
@@ -0,0 +1,123 @@
+// Unit checks of Janus Sampling kernels which do not need any model
+// NB! Janus sources are included right here, so its static kernels are reachable without exporting them
+
+#include "../janus.cpp"
+
+#undef NDEBUG
+#include <cassert>
+
+// -- shortlist is the same as it was with sorting of the whole vocab
+
+// The way it was done before: halve incompatible tokens, sort everything and cut the list at the first token far from the top
+static std::vector<llama_token_data> janus_full_sort(std::vector<float> logits, const std::vector<int8_t> & types, const bool halve, const float cutoff) {
+    std::vector<llama_token_data> candidates;
+    for (llama_token id = 0; id < (llama_token) logits.size(); id++) {
+        if (halve && (types[id] == LANG_EN || types[id] == LANG_OTHER)) {
+            logits[id] *= 0.5;
+        }
+        candidates.push_back(llama_token_data{id, logits[id], 0.0f});
+    }
+
+    std::sort(candidates.begin(), candidates.end(), [](const llama_token_data & a, const llama_token_data & b) {
+        return a.logit > b.logit;
+    });
+
+    const float topLogit = candidates[0].logit;
+    for (size_t i = 1; i < candidates.size(); i++) {
+        if (candidates[i].logit / topLogit < cutoff) {
+            candidates.resize(i);
+            break;
+        }
+    }
+
+    return candidates;
+}
+
+// The way it's done now: the single pass for the top token, then the pass collecting survivors, then sorting of them only
+static std::vector<llama_token_data> janus_threshold(std::vector<float> logits, const std::vector<int8_t> & types, const bool halve, const float cutoff) {
+    const size_t n = logits.size();
+    const float topLogit = janus_mask_max(logits.data(), types.data(), n, halve);
+
+    llama_token topToken = 0;
+    while (topToken < (llama_token) n - 1 && logits[topToken] != topLogit) {
+        topToken++;
+    }
+
+    std::vector<llama_token_data> candidates = { llama_token_data{topToken, topLogit, 0.0f} };
+    janus_survivors(logits.data(), n, topToken, topLogit, cutoff, candidates);
+
+    std::sort(candidates.begin() + 1, candidates.end(), [](const llama_token_data & a, const llama_token_data & b) {
+        return a.logit > b.logit;
+    });
+
+    return candidates;
+}
+
+static void test_janus_selection() {
+    std::mt19937 rng(42);
+    const int8_t kinds[] = { LANG_ZERO, LANG_EN, SPACE_EN, LANG_RU, SPACE_RU, LANG_OTHER, SPACE_OTHER };
+
+    // NB! Odd sizes leave the tail for scalar loops after the vector ones
+    for (size_t n : { 1, 7, 8, 9, 1003, 32000 }) {
+        std::vector<int8_t> types(n);
+        for (auto & type : types) {
+            type = kinds[rng() % (sizeof(kinds) / sizeof(kinds[0]))];
+        }
+
+        // positive top logit with most tokens far below it, then all logits negative
+        for (float shift : { 0.0f, -30.0f }) {
+            // distinct logits only, the top token of ties is not defined for the full sort
+            std::vector<float> logits(n);
+            for (size_t i = 0; i < n; i++) {
+                logits[i] = (float) i / (float) n * 20.0f - 5.0f + shift;
+            }
+            std::shuffle(logits.begin(), logits.end(), rng);
+
+            for (bool halve : { false, true }) {
+                for (float cutoff : { 0.5f, 0.82f, 0.99f, 1.0f }) {
+                    const auto expected = janus_full_sort(logits, types, halve, cutoff);
+                    const auto selected = janus_threshold(logits, types, halve, cutoff);
+
+                    assert(selected.size() == expected.size());
+                    assert(selected[0].id == expected[0].id);
+
+                    // NB! Halved logits might meet others, so only the same logits in the same order and the same tokens are expected
+                    std::vector<llama_token> selectedIDs, expectedIDs;
+                    for (size_t i = 0; i < expected.size(); i++) {
+                        assert(selected[i].logit == expected[i].logit);
+                        selectedIDs.push_back(selected[i].id);
+                        expectedIDs.push_back(expected[i].id);
+                    }
+                    std::sort(selectedIDs.begin(), selectedIDs.end());
+                    std::sort(expectedIDs.begin(), expectedIDs.end());
+                    assert(selectedIDs == expectedIDs);
+                }
+            }
+        }
+    }
+
+    // incompatible tokens are halved in place and the top one is found among the rest
+    std::vector<float>  logits = { 1.0f, 8.0f, 6.0f, 2.0f, -1.0f, 5.0f, 3.0f, 4.0f, 7.0f };
+    std::vector<int8_t> types  = { LANG_RU, LANG_EN, LANG_RU, LANG_OTHER, LANG_EN, SPACE_RU, LANG_ZERO, LANG_RU, LANG_OTHER };
+    assert(janus_mask_max(logits.data(), types.data(), logits.size(), true) == 6.0f);
+    assert(logits[1] == 4.0f && logits[3] == 1.0f && logits[4] == -0.5f && logits[8] == 3.5f);
+    assert(logits[0] == 1.0f && logits[2] == 6.0f && logits[5] == 5.0f);
+
+    // NaN logits are never picked as the top one, still they are kept as it was before
+    logits[3] = NAN;
+    assert(janus_mask_max(logits.data(), types.data(), logits.size(), false) == 6.0f);
+
+    std::vector<llama_token_data> candidates;
+    janus_survivors(logits.data(), logits.size(), 2, 6.0f, 0.5f, candidates);
+    assert(candidates.size() == 6); // 4.0, NaN, 5.0, 3.0, 4.0 and 3.5, NaN never fails the cutoff test
+    for (const auto & candidate : candidates) {
+        assert(candidate.id != 2);
+    }
+}
+
+int main() {
+    test_janus_selection();
+
+    fprintf(stderr, "All tests passed.\n");
+    return 0;
+}
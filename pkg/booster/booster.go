@@ -15,7 +15,6 @@ package booster
 /*
 #include <stdlib.h>
 #include <stdint.h>
-const char * status(char * jobID);
 uint32_t getSeed(char * jobID);
 int64_t getPromptTokenCount(char * jobID);
 */
@@ -32,6 +31,7 @@ import (
 	"strings"
 	"syscall"
 	"time"
+	"unsafe"
 
 	config "github.com/golobby/config/v3"
 	"github.com/golobby/config/v3/pkg/feeder"
@@ -86,6 +86,8 @@ type Options struct {
 	Ignore        bool    `long:"ignore" description:"Ignore server JSON and YAML configs, use only CLI params"`
 	Swap          string  `long:"swap" description:"Path for user session swap files [ only for CPU inference, up to 1Gb per each ]"`
 	MaxSessions   int     `long:"max-sessions" description:"How many sessions allowed to be stored on disk [ unlimited by default ]"`
+	Bulk          string  `long:"bulk" description:"Process all prompts of JSONL file like {\"id\":\"1\",\"prompt\":\"...\"} and exit"`
+	Output        string  `long:"output" description:"JSONL file for results of bulk processing [ input.out.jsonl by default ]"`
 }
 
 var (
@@ -282,6 +284,13 @@ func Run() {
 		)
 	}
 
+	// --- Bulk mode for processing prompts from file without the server
+
+	if opts.Bulk != "" {
+		server.Bulk(opts.Bulk, opts.Output)
+		return
+	}
+
 	// --- Interactive mode for chatting with models from command line
 
 	if !opts.Server {
@@ -297,8 +306,10 @@ func Run() {
 				prompt, _ := bufio.NewReader(os.Stdin).ReadString('\n')
 
 				jobID := uuid.New().String()
-				server.PlaceJob(jobID, "" /* payload.Model */, sessionID, prompt)
+				server.PlaceJob(jobID, "" /* payload.Model */, sessionID, prompt, "" /* grammar */, "" /* schema */, 0 /* priority */, "" /* tenant */, 1 /* n */, 0 /* timeout */)
 				prevOutput := ""
+				text := ""          // job output read so far
+				tokens := int64(-1) // output tokens seen with the last read
 				Colorize("\n[blue]<< [light_blue]")
 
 				for {
@@ -306,13 +317,13 @@ func Run() {
 					time.Sleep(1 * time.Second)
 					server.Mutex.Lock()
 
-					output := C.GoString(C.status(C.CString(jobID)))
-					// waiting while prompt history will be processed completely
-					if server.Jobs[jobID].Status == "processing" && len(output) < len(server.Jobs[jobID].FullPrompt) {
-						server.Mutex.Unlock()
-						continue
+					// read only new bytes and only when there new tokens
+					if count := server.OutputTokenCount(jobID); count != tokens || server.Jobs[jobID].Status != "processing" {
+						text += server.ReadOutput(jobID, len(text), 0)
+						tokens = count
 					}
-					output, _ = strings.CutPrefix(output, server.Jobs[jobID].FullPrompt)
+
+					output := text
 
 					if server.Jobs[jobID].Status == "finished" {
 						assistantTemplate := server.Prompts[server.Jobs[jobID].PromptID].Templates.Assistant
@@ -329,6 +340,7 @@ func Run() {
 					}
 
 					if server.Jobs[jobID].Status == "finished" {
+						server.ReleaseJob(jobID)
 						server.Mutex.Unlock()
 						break
 					}
@@ -368,7 +380,10 @@ func Run() {
 				// TODO: Show jobs in timing order (need extra slice)
 				for _, job := range server.Jobs {
 
-					output := C.GoString(C.status(C.CString(job.ID)))
+					output := job.Output
+					if job.Status == "processing" {
+						output = server.ReadOutput(job.ID, 0, 0)
+					}
 					// FIXME: Avoid LLaMA v2 leading space
 					//if len(output) > 0 && output[0] == ' ' {
 					//	output = output[1:]
@@ -379,16 +394,21 @@ func Run() {
 						podID = job.Pod.ID
 					}
 
+					id := C.CString(job.ID)
+					promptTokenCount := C.getPromptTokenCount(id)
+					seed := C.getSeed(id)
+					C.free(unsafe.Pointer(id))
+
 					Colorize("\n[light_magenta]%s [light_green][ %s ] [light_yellow][ %s ] [light_magenta][ %s ] [light_gray]TOKENS: IN [ %d => %d ] OUT || MILLISECONDS: IN [ %d => %d ] OUT || SEED: %d [light_blue]\n\n%s\n",
 						job.ID,
 						job.Status,
 						podID,
 						job.ModelID,
-						C.getPromptTokenCount(C.CString(job.ID)),
+						promptTokenCount,
 						job.OutputTokenCount,
 						job.PromptEval,
 						job.TokenEval,
-						C.getSeed(C.CString(job.ID)),
+						seed,
 						output)
 				}
 
@@ -3,7 +3,6 @@ package server
 /*
 #include <stdlib.h>
 #include <stdint.h>
-const char * status(char * jobID);
 uint32_t getSeed(char * jobID);
 int64_t getPromptTokenCount(char * jobID);
 */
@@ -47,6 +46,7 @@ func WireRoutes(app *fiber.App) {
 	// -- OpenAI compatible API
 
 	app.Post("/v1/chat/completions", NewChatCompletions)
+	app.Post("/v1/embeddings", NewEmbeddings)
 
 	// -- Ollama compatible API
 	//    https://github.com/ollama/ollama/blob/main/docs/api.md
@@ -104,31 +104,41 @@ func WireRoutes(app *fiber.App) {
 					JSON(fiber.Map{"error": "error parsing request body"})
 			}
 
+			schema, err := payload.Schema()
+			if err != nil {
+				return ctx.
+					Status(fiber.StatusBadRequest).
+					JSON(fiber.Map{"error": "wrong response format"})
+			}
+
 			sessionID := uuid.New().String()
 			jobID := uuid.New().String()
 			promptID := reflect.ValueOf(Prompts).MapKeys()[0].String()             // FIXME: using ANY available prompt for a while
 			Sessions[sessionID], _ = buildCompletion(sessionID, promptID, payload) // TODO: error handling
-			PlaceJob(jobID, "" /* payload.Model */, sessionID, "" /* prompt */)
+			PlaceJob(jobID, "" /* payload.Model */, sessionID, "" /* prompt */, payload.Grammar, schema, payload.Priority, payload.User, 1 /* n */, payload.Timeout)
 
 			ctx.Context().SetBodyStreamWriter(
 				fasthttp.StreamWriter(
 					func(w *bufio.Writer) {
 
 						prevOutput := ""
+						text := ""          // job output read so far
+						tokens := int64(-1) // output tokens seen with the last read
 						for {
 
 							time.Sleep(1 * time.Second)
 							Mutex.Lock()
 
-							output := C.GoString(C.status(C.CString(jobID)))
-							// waiting while prompt history will be processed completely
-							if Jobs[jobID].Status == "processing" && len(output) < len(Jobs[jobID].FullPrompt) {
-								Mutex.Unlock()
-								continue
+							// read only new bytes and only when there new tokens
+							if count := OutputTokenCount(jobID); count != tokens || Jobs[jobID].Status != "processing" {
+								text += ReadOutput(jobID, len(text), 0)
+								tokens = count
 							}
-							output, _ = strings.CutPrefix(output, Jobs[jobID].FullPrompt)
 
-							if Jobs[jobID].Status == "finished" {
+							output := text
+							status := Jobs[jobID].Status
+
+							if status == "finished" || status == "aborted" {
 								assistantTemplate := Prompts[Jobs[jobID].PromptID].Templates.Assistant
 								if strings.Contains(assistantTemplate, "{ASSISTANT}") {
 									cut := strings.Index(assistantTemplate, "{ASSISTANT}") + len("{ASSISTANT}")
@@ -158,7 +168,11 @@ func WireRoutes(app *fiber.App) {
 								prevOutput = output
 							}
 
-							if Jobs[jobID].Status == "finished" {
+							if status == "finished" || status == "aborted" {
+								doneReason := "stop"
+								if status == "aborted" {
+									doneReason = "aborted"
+								}
 								chunk := Chunk{
 									Message: &CompletionMessage{
 										Role:    "assistant",
@@ -166,13 +180,15 @@ func WireRoutes(app *fiber.App) {
 									},
 									CreatedAt:  time.Now(),
 									Done:       true,
-									DoneReason: "stop",
+									DoneReason: doneReason,
 								}
 
 								json, _ := json.Marshal(chunk)
 								w.Write(json)
 								w.Flush()
 
+								// the whole output was streamed already
+								ReleaseJob(jobID)
 								break
 							}
 						}
@@ -7,14 +7,24 @@ package server
 /*
 #include <stdlib.h>
 #include <stdint.h>
-void * init(char * swap, char * debug);
+void * init(char * swap, int64_t swapLimit, char * debug);
 void * initContext(
 	int idx,
 	char * modelName,
 	int threads,
+	int numa,
+	char * cpus,
 	int batch_size,
+	int budget,
+	int slots,
+	char * draftName,
+	int n_draft,
+	int lookup,
+	char * lookupStatic,
+	char * lookupDynamic,
 	int gpu1, int gpu2, int gpu3, int gpu4,
 	int context, int predict,
+	int keep, int window,
 	int32_t mirostat, float mirostat_tau, float mirostat_eta,
 	float temperature, int topK, float topP,
 	float typicalP,
@@ -22,21 +32,38 @@ void * initContext(
 	int32_t janus, int32_t depth, float scale, float hi, float lo,
 	uint32_t seed,
 	char * debug);
+void freeContext(int idx);
 int64_t doInference(
 	int idx,
 	void * ctx,
 	char * jobID,
 	char * sessionID,
-	char * prompt);
-void stopInference(int idx);
-const char * status(char * jobID);
+	char * prompt,
+	char * grammar,
+	char * schema,
+	int priority,
+	char * tenant,
+	int choices,
+	int64_t timeout);
+void setTenant(char * tenant, float weight);
+void stopInference(int idx, char * jobID);
+int64_t readOutput(char * jobID, int64_t from, char * buf, int64_t cap);
+int64_t getOutputTokenCount(char * jobID);
 int64_t timing(char * jobID);
 int64_t promptEval(char * jobID);
 int64_t getPromptTokenCount(char * jobID);
+int64_t getDraftTokenCount(char * jobID);
+int64_t getAcceptedTokenCount(char * jobID);
+int isAborted(char * jobID);
+void releaseJob(char * jobID);
+int64_t bulkInference(int pods, char * input, char * output);
+int embedSize(int idx);
+int64_t embedBatch(int idx, char ** texts, int n, float * out);
 */
 import "C"
 
 import (
+	"bytes"
 	"encoding/json"
 	"fmt"
 	"os"
@@ -44,6 +71,7 @@ import (
 	"path/filepath"
 	"reflect"
 	"runtime"
+	"sort"
 	"strconv"
 	"strings"
 	"sync"
@@ -92,6 +120,9 @@ type Model struct {
 
 	Context int
 	Predict int
+
+	Keep   int // tokens at the start of the context never evicted, like the system prompt
+	Window int // evict the oldest tokens in steps of Window instead of a half of the context, so sessions are never reset
 }
 
 type Templates struct {
@@ -161,7 +192,8 @@ type Config struct {
 	Port string
 	Log  string // path and name of logging file
 
-	Swap string // path to store session files
+	Swap      string // path to store session files
+	SwapLimit int64  // disk space for session files in megabytes, 0 = unlimited
 
 	Pods      map[string]*Pod
 	Models    map[string]*Model
@@ -169,6 +201,8 @@ type Config struct {
 	Samplings map[string]*Sampling
 
 	Deadline int64 // deadline in seconds after which unprocessed jobs will be deleted from the queue
+
+	Tenants map[string]float32 // fair-share weights of tenants within pods, 1 for tenants not listed
 }
 
 type Pod struct {
@@ -176,15 +210,26 @@ type Pod struct {
 	idx int    // pod index [ it vary due to undeterministic Go map iteration order ]
 
 	Threads  int64  // how many threads to use
+	Numa     *int   // optional NUMA node to bind the pod threads and its own replica of model weights
+	CPUs     string // optional CPUs for the pod threads like "0-15,32-47", CPUs of the NUMA node by default
 	GPUs     []int  // GPU split in percents
 	Model    string // model ID within config
 	Prompt   string // TODO: Allow any prompt on request
 	Sampling string // sampling ID within config (TODO: Allow any sampling method on request)
 
-	Batch int
+	Batch  int
+	Budget int // max tokens evaluated per step, so long prompts are split into chunks between decoding steps of other jobs
+	Slots  int // how many jobs the pod serves in parallel within the same context
+
+	Draft  string // optional ID of the small draft model within config for speculative decoding
+	NDraft int    // how many tokens to draft per step
+
+	Lookup       bool   // draft tokens with n-gram lookup within the prompt and output when there no draft model
+	LookupCache  string // optional file of the dynamic n-gram cache updated with every job of the pod
+	LookupStatic string // optional file of the n-gram cache built from a large corpus in advance
 
-	isBusy bool // do we doing some job righ not?
-	isGPU  bool // pod uses GPU resources
+	running int  // how many jobs the pod is doing right now
+	isGPU   bool // pod uses GPU resources
 
 	// model *Model // real model instance
 	Context unsafe.Pointer // *llama.Context
@@ -196,8 +241,15 @@ type Job struct {
 	Status     string
 	Prompt     string // exact user prompt, trimmed from spaces and newlines
 	Translate  string // translation direction like "en:ru" ask translate input to EN first, then output to RU
+	Grammar    string // optional GBNF grammar to constrain the output
+	Schema     string // optional JSON schema of the output, compacted
+	Priority   int    // jobs of higher priority go first and might preempt running jobs of lower priority
+	Tenant     string // jobs of the same priority share pods between tenants according to their weights
+	Timeout    int64  // milliseconds since the job was placed, after which it's aborted wherever it is [ zero = no limit ]
+	N          int    // how many outputs to sample from the same prompt, it's evaluated only once for all of them
 	FullPrompt string // full prompt with prefix / suffix
 	Output     string
+	Choices    []Choice // all outputs when there more than one requested, the first is the same as Output
 
 	CreatedAt  int64
 	StartedAt  int64
@@ -215,9 +267,21 @@ type Job struct {
 	PromptEval int64 // timing per token (prompt + output), ms
 	TokenEval  int64 // timing per token (prompt + output), ms
 
+	DraftTokenCount    int64 // tokens proposed by the draft model
+	AcceptedTokenCount int64 // drafted tokens accepted by the main model
+
 	Pod *Pod // we need pod.idx when stopping jobs
 }
 
+// Choice is one of outputs sampled from the same prompt
+type Choice struct {
+	Output  string
+	Aborted bool // the output is partial
+}
+
+// how many jobs per slot the pod takes, extra ones wait within its own priority queue
+const PodBacklog = 2
+
 const (
 	LLAMA_CPP = 0x00
 	LLAMA_GO  = 0x01
@@ -316,8 +380,8 @@ func Init(
 		Pods[pod] = &Pod{
 			idx: podNum,
 
-			isBusy: false,
-			isGPU:  gpu1+gpu2+gpu3+gpu4 > 0,
+			Slots: 1,
+			isGPU: gpu1+gpu2+gpu3+gpu4 > 0,
 
 			Model:    model,
 			Prompt:   "", // TODO FIXME
@@ -334,15 +398,22 @@ func Init(
 			os.Exit(0)
 		}
 
-		C.init(C.CString(swap), C.CString(Debug))
+		C.init(C.CString(swap), C.int64_t(0), C.CString(Debug))
 
 		ctx := C.initContext(
 			C.int(podNum),
 			C.CString(model),
 			C.int(threads),
-			C.int(0),                                           // TODO: BatchSize
+			C.int(-1),               // not bound to NUMA node
+			C.CString(""),           // any CPUs
+			C.int(0),                // TODO: BatchSize
+			C.int(0),                // no step budget
+			C.int(1),                // slots
+			C.CString(""), C.int(0), // no draft model
+			C.int(0), C.CString(""), C.CString(""), // no lookup decoding
 			C.int(gpu1), C.int(gpu2), C.int(gpu3), C.int(gpu4), // C.int(gpuLayers), // FIXME ASAP: TODO: Support more than 4 GPUs
 			C.int(context), C.int(predict),
+			C.int(0), C.int(0), // no sliding window
 			C.int32_t(mirostat), C.float(mirostatENT), C.float(mirostatLR),
 			C.float(temperature), C.int(topK), C.float(topP),
 			C.float(typicalP),
@@ -402,6 +473,10 @@ func InitFromConfig(conf *Config, zapLog *zap.SugaredLogger) {
 	log = zapLog
 	deadline = conf.Deadline
 
+	for tenant, weight := range conf.Tenants {
+		C.setTenant(C.CString(tenant), C.float(weight))
+	}
+
 	// -- some validations TODO: move to better place
 
 	//if conf.Pods != len(conf.Threads) {
@@ -486,6 +561,10 @@ func InitFromConfig(conf *Config, zapLog *zap.SugaredLogger) {
 		pod.idx = podNum
 		Pods[id] = pod
 
+		if pod.Slots <= 0 {
+			pod.Slots = 1
+		}
+
 		for _, layers := range pod.GPUs {
 			if layers > 0 {
 				pod.isGPU = true
@@ -498,6 +577,26 @@ func InitFromConfig(conf *Config, zapLog *zap.SugaredLogger) {
 			os.Exit(0)
 		}
 
+		draftPath := ""
+		if pod.Draft != "" {
+			draft, ok := Models[pod.Draft]
+			if !ok {
+				Colorize("\n[magenta][ ERROR ][white] Wrong draft model ID in config [magenta][ %s ]\n\n", pod.Draft)
+				os.Exit(0)
+			}
+			draftPath = draft.Path
+		}
+
+		lookup := 0
+		if pod.Lookup {
+			lookup = 1
+		}
+
+		numa := -1
+		if pod.Numa != nil {
+			numa = *pod.Numa
+		}
+
 		sampling, ok := Samplings[pod.Sampling]
 		if !ok {
 			Colorize("\n[magenta][ ERROR ][white] Wrong sampling ID in config [magenta][ %s ]\n\n", sampling.ID)
@@ -526,9 +625,16 @@ func InitFromConfig(conf *Config, zapLog *zap.SugaredLogger) {
 			C.int(podNum),
 			C.CString(model.Path),
 			C.int(pod.Threads),
+			C.int(numa),
+			C.CString(pod.CPUs),
 			C.int(pod.Batch),
+			C.int(pod.Budget),
+			C.int(pod.Slots),
+			C.CString(draftPath), C.int(pod.NDraft),
+			C.int(lookup), C.CString(pod.LookupStatic), C.CString(pod.LookupCache),
 			C.int(gpu1), C.int(gpu2), C.int(gpu3), C.int(gpu4), // FIXME: Slice of GPUs
 			C.int(model.Context), C.int(model.Predict),
+			C.int(model.Keep), C.int(model.Window),
 			C.int32_t(sampling.Mirostat), C.float(sampling.MirostatENT), C.float(sampling.MirostatLR),
 			C.float(sampling.Temperature), C.int(sampling.TopK), C.float(sampling.TopP),
 			C.float(sampling.TypicalP),
@@ -543,7 +649,7 @@ func InitFromConfig(conf *Config, zapLog *zap.SugaredLogger) {
 			os.Exit(0)
 		}
 
-		C.init(C.CString(Swap), C.CString(Debug))
+		C.init(C.CString(Swap), C.int64_t(conf.SwapLimit), C.CString(Debug))
 
 		// FIXME TODO: Allow only ONE MODEL instance per ONE POD
 		pod.Context = ctx
@@ -613,6 +719,15 @@ func Engine(app *fiber.App) {
 	for {
 
 		if GoShutdown && len(Queue) == 0 && RunningThreads == 0 {
+			// NB! Nothing is running anymore, so pods are stopped and their contexts and compute threads are freed
+			Mutex.Lock()
+			for _, pod := range Pods {
+				if pod.Context != nil {
+					C.freeContext(C.int(pod.idx))
+					pod.Context = nil
+				}
+			}
+			Mutex.Unlock()
 			if app != nil {
 				app.Shutdown()
 			}
@@ -623,11 +738,23 @@ func Engine(app *fiber.App) {
 		// TODO: Some better timing + use config?
 		time.Sleep(20 * time.Millisecond)
 
-		for jobID := range Queue {
+		// -- jobs of higher priority go first, then older ones
 
-			if RunningThreads >= MaxThreads {
-				break
+		Mutex.Lock()
+		queued := make([]string, 0, len(Queue))
+		for jobID := range Queue {
+			queued = append(queued, jobID)
+		}
+		sort.Slice(queued, func(i, j int) bool {
+			a, b := Jobs[queued[i]], Jobs[queued[j]]
+			if a.Priority != b.Priority {
+				return a.Priority > b.Priority
 			}
+			return a.CreatedAt < b.CreatedAt
+		})
+		Mutex.Unlock()
+
+		for _, jobID := range queued {
 
 			// -- move job from waiting queue to processing and assign it pod from idle pool
 			// TODO: Use different mutexes for Jobs map, Pods map and maybe for atomic counters
@@ -635,32 +762,40 @@ func Engine(app *fiber.App) {
 			now := time.Now().UnixMilli()
 			Mutex.Lock() // -- locked
 
+			// the job might be stopped while waiting
+			if _, ok := Queue[jobID]; !ok {
+				Mutex.Unlock()
+				continue
+			}
+
 			// ignore jobs placed more than [ deadline ] seconds ago
 			if deadline > 0 && (now-Jobs[jobID].CreatedAt) > deadline*1000 {
+				delete(Queue, jobID)
 				delete(Jobs, jobID)
 				Mutex.Unlock()
 				log.Infow("[ JOB ] Job was removed from queue after deadline", zap.String("jobID", jobID), zap.Int64("deadline", deadline))
 				continue
 			}
 
+			// NB! When all slots are busy, pods still take a few more jobs into their own queues,
+			//     where the scheduler might preempt running jobs of lower priority for them.
+			//     Jobs of the same pod share its threads, so only idle pods are limited with MaxThreads.
+			//     All choices of the job are sampled within the same pod, so it should have enough slots for them
+			job := Jobs[jobID]
+			fits := func(pod *Pod) bool {
+				return job.N <= pod.Slots && (pod.running > 0 || RunningThreads+pod.Threads <= MaxThreads)
+			}
 			var usePod *Pod
-			// TODO: Implement pod priority for better serving clients
 			for _, pod := range Pods {
-				if !pod.isBusy {
-					usePod = pod // Pods[id]
-					usePod.isBusy = true
-					break
+				if fits(pod) && pod.running < pod.Slots && (usePod == nil || pod.running-pod.Slots < usePod.running-usePod.Slots) {
+					usePod = pod
+				}
+			}
+			for _, pod := range Pods {
+				if usePod == nil && fits(pod) && pod.running < pod.Slots*PodBacklog {
+					usePod = pod
 				}
-
-				// "load" the model into pod
-				// WAS pod.model = Models[idx]
-
-				// FIXME ASAP: Do we need this ?
-				///// pod.model = Models[pod.Model] // TODO: more checks ( if !ok )
-
-				//break
 			}
-
 			if usePod == nil {
 				// FIXME: Something really wrong going here! We need to fix this ASAP
 				// TODO: Log this case!
@@ -669,13 +804,17 @@ func Engine(app *fiber.App) {
 				break
 			}
 
+			usePod.running++
 			delete(Queue, jobID)
 			Jobs[jobID].Status = "processing"
 
 			// FIXME: Check RunningPods one more time?
 			// TODO: Is it make sense to use atomic over just mutex here?
-			atomic.AddInt64(&RunningPods, 1)
-			atomic.AddInt64(&RunningThreads, usePod.Threads)
+			// NB! All jobs of the same pod share its threads, so count them only for the first one
+			if usePod.running == 1 {
+				atomic.AddInt64(&RunningPods, 1)
+				atomic.AddInt64(&RunningThreads, usePod.Threads)
+			}
 
 			Mutex.Unlock() // -- unlocked
 
@@ -688,8 +827,6 @@ func Engine(app *fiber.App) {
 
 func Do(jobID string, pod *Pod) {
 
-	defer atomic.AddInt64(&RunningPods, -1)
-	defer atomic.AddInt64(&RunningThreads, -pod.Threads)
 	defer runtime.GC() // TODO: GC or not GC?
 
 	now := time.Now().UnixMilli()
@@ -709,7 +846,10 @@ func Do(jobID string, pod *Pod) {
 
 	// -- check if we are possibly going to grow out of context limit and need to drop session data
 
-	if sessionID != "" {
+	// NB! The sliding window of the model context evicts the oldest tokens of the session itself,
+	//     so the history is kept as is and the cached part of it is reused instead of full evaluation
+
+	if sessionID != "" && Models[job.ModelID].Window == 0 {
 
 		///// var SessionFile string
 
@@ -818,44 +958,78 @@ func Do(jobID string, pod *Pod) {
 	// llama_load_session_file_internal : model hparams didn't match from session file!
 	// do_inference: error: failed to load session file './session.data.bin'
 
-	outputTokenCount := C.doInference(C.int(pod.idx), pod.Context, C.CString(jobID), C.CString(sessionID), C.CString(fullPrompt))
-	result := C.GoString(C.status(C.CString(jobID)))
-	promptTokenCount := C.getPromptTokenCount(C.CString(jobID))
+	// NB! The time spent within queues counts too, so the job expired on its way is aborted right away
+	timeout := int64(0)
+	if job.Timeout > 0 {
+		timeout = job.CreatedAt + job.Timeout - time.Now().UnixMilli()
+		if timeout < 1 {
+			timeout = 1
+		}
+	}
+
+	// NB! Other choices take other slots of the same pod, the engine places such jobs only on pods with enough slots
+	choices := job.N
+	if choices < 1 {
+		choices = 1
+	}
+
+	// NB! C strings are allocated once and freed when the job is done, the job record is read with the same ID
+	id := C.CString(jobID)
+	defer C.free(unsafe.Pointer(id))
+	args := []*C.char{C.CString(sessionID), C.CString(fullPrompt), C.CString(job.Grammar), C.CString(job.Schema), C.CString(job.Tenant)}
+	defer func() {
+		for _, arg := range args {
+			C.free(unsafe.Pointer(arg))
+		}
+	}()
+
+	outputTokenCount := C.doInference(C.int(pod.idx), pod.Context, id, args[0], args[1], args[2], args[3], C.int(job.Priority), args[4], C.int(choices), C.int64_t(timeout))
+	result := ReadOutput(jobID, 0, 0)
+	aborted := C.isAborted(id) != 0
+	promptTokenCount := C.getPromptTokenCount(id)
+
+	// other choices are available as jobID#1, jobID#2, etc and nobody polls them, so they are released right away
+	var others []Choice
+	for k := 1; k < choices; k++ {
+		choiceID := fmt.Sprintf("%s#%d", jobID, k)
+		cid := C.CString(choiceID)
+		others = append(others, Choice{
+			Output:  strings.Trim(ReadOutput(choiceID, 0, 0), "\n "),
+			Aborted: C.isAborted(cid) != 0,
+		})
+		C.releaseJob(cid)
+		C.free(unsafe.Pointer(cid))
+	}
 
 	//Colorize("\n=== HISTORY ===\n%s\n", history)
 	//Colorize("\n=== FULL PROMPT ===\n%s\n", fullPrompt)
 	//Colorize("\n=== RESULT ===\n%s\n", result)
 
-	// LLaMA(cpp) tokenizer might add leading space
-	if len(result) > 0 && len(fullPrompt) > 0 && fullPrompt[0] != ' ' && result[0] == ' ' {
-		result = result[1:]
-	}
-
 	// Save exact result as history for the future session work if storage enabled
+	// NB! The output does not include the prompt, so the history is exactly the prompt text followed by the output
 	if sessionID != "" {
 		Mutex.Lock()
-		Sessions[sessionID] = result
+		Sessions[sessionID] = fullPrompt + result
 		TokensCount[sessionID] = int(outputTokenCount)
 		Mutex.Unlock()
 	}
 
-	// NB! Do show nothing if output is shorter than the whole history before
-	if len(result) <= len(fullPrompt) {
-		result = ""
-	} else {
-		result = result[len(fullPrompt):]
-		result = strings.Trim(result, "\n ")
-	}
+	result = strings.Trim(result, "\n ")
 
 	now = time.Now().UnixMilli()
-	promptEval := int64(C.promptEval(C.CString(jobID)))
-	eval := int64(C.timing(C.CString(jobID)))
+	promptEval := int64(C.promptEval(id))
+	eval := int64(C.timing(id))
+	draftTokenCount := int64(C.getDraftTokenCount(id))
+	acceptedTokenCount := int64(C.getAcceptedTokenCount(id))
 
 	Mutex.Lock() // --
 
 	job.FinishedAt = now
 	if job.Status != "stopped" {
 		job.Status = "finished"
+		if aborted {
+			job.Status = "aborted" // deadline was reached before the output was complete
+		}
 	}
 
 	// remove suffix like <|im_end|> from the output BUT leave it for the session history
@@ -863,6 +1037,13 @@ func Do(jobID string, pod *Pod) {
 	if cut >= 0 {
 		ending := Prompts[job.PromptID].Templates.Assistant[cut+len("{ASSISTANT}"):]
 		result, _ = strings.CutSuffix(result, ending)
+		for k := range others {
+			others[k].Output, _ = strings.CutSuffix(others[k].Output, ending)
+		}
+	}
+
+	if len(others) > 0 {
+		job.Choices = append([]Choice{{Output: result, Aborted: aborted}}, others...)
 	}
 
 	// FIXME ASAP : Log all meaninful details !!!
@@ -870,10 +1051,16 @@ func Do(jobID string, pod *Pod) {
 	job.OutputTokenCount = int64(outputTokenCount)
 	job.PromptEval = promptEval
 	job.TokenEval = eval
+	job.DraftTokenCount = draftTokenCount
+	job.AcceptedTokenCount = acceptedTokenCount
 	job.Output = result
 	job.Pod = nil
 
-	pod.isBusy = false
+	pod.running--
+	if pod.running == 0 {
+		atomic.AddInt64(&RunningPods, -1)
+		atomic.AddInt64(&RunningThreads, -pod.Threads)
+	}
 	Mutex.Unlock() // --
 
 	// NB! Avoid division by zero
@@ -894,15 +1081,68 @@ func Do(jobID string, pod *Pod) {
 		"outMS", eval,
 		"inTPS", inTPS,
 		"outTPS", outTPS,
+		"draft", draftTokenCount,
+		"accepted", acceptedTokenCount,
 		"prompt", prompt, // TODO: it will be empty for OpenAI API calls
 		"output", result,
 		// "fullPrompt", fullPrompt,
 	)
 }
 
+// ReadOutput returns the job output starting from the byte offset, up to limit bytes [ 0 = till the end ]
+// Only the requested part is copied from C++ side, so pollers should remember what was already read
+func ReadOutput(jobID string, offset, limit int) string {
+
+	id := C.CString(jobID)
+	defer C.free(unsafe.Pointer(id))
+
+	size := 4096
+	if limit > 0 && limit < size {
+		size = limit
+	}
+
+	buf := make([]byte, size)
+	var out []byte
+
+	for limit <= 0 || len(out) < limit {
+		n := int(C.readOutput(id, C.int64_t(offset+len(out)), (*C.char)(unsafe.Pointer(&buf[0])), C.int64_t(size)))
+		out = append(out, buf[:n]...)
+		if n < size {
+			break
+		}
+	}
+
+	return string(out)
+}
+
+// OutputTokenCount returns how many tokens were generated for the job so far
+func OutputTokenCount(jobID string) int64 {
+	id := C.CString(jobID)
+	defer C.free(unsafe.Pointer(id))
+	return int64(C.getOutputTokenCount(id))
+}
+
+// ReleaseJob frees the job output and stats within C++ side, otherwise they are removed an hour after the job was finished
+func ReleaseJob(jobID string) {
+	id := C.CString(jobID)
+	defer C.free(unsafe.Pointer(id))
+	C.releaseJob(id)
+}
+
+// MaxChoices is how many choices a single job might ask for, all of them are sampled within the same pod
+func MaxChoices() int {
+	n := 1
+	for _, pod := range Pods {
+		if pod.Slots > n {
+			n = pod.Slots
+		}
+	}
+	return n
+}
+
 // --- Place new job into queue
 
-func PlaceJob(jobID, model, sessionID, prompt string) {
+func PlaceJob(jobID, model, sessionID, prompt, grammar, schema string, priority int, tenant string, n int, timeout int64) {
 
 	timing := time.Now().UnixMilli()
 
@@ -913,6 +1153,12 @@ func PlaceJob(jobID, model, sessionID, prompt string) {
 		ModelID:   model,
 		SessionID: sessionID,
 		Prompt:    prompt,
+		Grammar:   grammar,
+		Schema:    schema,
+		Priority:  priority,
+		Tenant:    tenant,
+		N:         n,
+		Timeout:   timeout,
 		// TODO: Sampling?
 		// TODO: PromptID?
 		Status:    "queued",
@@ -942,11 +1188,16 @@ func NewJob(ctx *fiber.Ctx) error {
 	}
 
 	payload := struct {
-		ID        string `json:"id"`
-		Session   string `json:"session,omitempty"`
-		Model     string `json:"model,omitempty"`
-		Prompt    string `json:"prompt"`
-		Translate string `json:"translate"`
+		ID        string          `json:"id"`
+		Session   string          `json:"session,omitempty"`
+		Model     string          `json:"model,omitempty"`
+		Prompt    string          `json:"prompt"`
+		Translate string          `json:"translate"`
+		Grammar   string          `json:"grammar,omitempty"`
+		Schema    json.RawMessage `json:"schema,omitempty"`
+		Priority  int             `json:"priority,omitempty"`
+		Tenant    string          `json:"tenant,omitempty"`
+		Timeout   int64           `json:"timeout,omitempty"` // milliseconds
 	}{}
 
 	if err := ctx.BodyParser(&payload); err != nil {
@@ -1008,7 +1259,14 @@ func NewJob(ctx *fiber.Ctx) error {
 	//}
 
 	// TODO: Use payload Model selector
-	PlaceJob(payload.ID, "" /* payload.Model */, payload.Session, payload.Prompt)
+	schema, err := compactSchema(payload.Schema)
+	if err != nil {
+		return ctx.
+			Status(fiber.StatusBadRequest).
+			JSON(fiber.Map{"error": "wrong JSON schema"})
+	}
+
+	PlaceJob(payload.ID, "" /* payload.Model */, payload.Session, payload.Prompt, payload.Grammar, schema, payload.Priority, payload.Tenant, 1 /* n */, payload.Timeout)
 
 	log.Infow("[JOB] New job", "jobID", payload.ID /*"mode", payload.Mode,*/, "model", payload.Model, "session", payload.Session, "prompt", payload.Prompt)
 
@@ -1057,7 +1315,9 @@ func StopJob(ctx *fiber.Ctx) error {
 	Jobs[jobID].Status = "stopped"
 
 	if Jobs[jobID].Pod != nil {
-		C.stopInference(C.int(Jobs[jobID].Pod.idx))
+		id := C.CString(jobID)
+		C.stopInference(C.int(Jobs[jobID].Pod.idx), id)
+		C.free(unsafe.Pointer(id))
 	}
 
 	Mutex.Unlock() // --
@@ -1125,23 +1385,8 @@ func GetJob(ctx *fiber.Ctx) error {
 	//fullPrompt = strings.Trim(fullPrompt, "\n ")
 
 	if status == "processing" {
-		output = C.GoString(C.status(C.CString(jobID)))
-
-		// LLaMA(cpp) tokenizer might add leading space
-		if len(output) > 0 && len(fullPrompt) > 0 && fullPrompt[0] != ' ' && output[0] == ' ' {
-			output = output[1:]
-		}
-
-		//fmt.Printf("\n\nOUTPUT: [[[%s]]]", output)
-		//fmt.Printf("\n\nPROMPT: [[[%s]]]", fullPrompt)
-
-		// NB! Do show nothing if output is shorter than the whole history before
-		if len(output) <= len(fullPrompt) {
-			output = ""
-		} else {
-			output = output[len(fullPrompt):]
-			output = strings.Trim(output, "\n ")
-		}
+		output = ReadOutput(jobID, 0, 0)
+		output = strings.Trim(output, "\n ")
 
 		//fmt.Printf("\n\nOUTPUT: [[[%s]]]", output)
 		//fmt.Printf("\n\nPROMPT: [[[%s]]]", fullPrompt)
@@ -1185,6 +1430,54 @@ type CompletionPayload struct {
 	Messages    []*CompletionMessage `json:"messages"`
 	Options     *map[string]string   `json:"options,omitempty"`     // TODO
 	Temperature string               `json:"temperature,omitempty"` // TODO
+	Grammar     string               `json:"grammar,omitempty"`     // optional GBNF grammar to constrain the output
+	Priority    int                  `json:"priority,omitempty"`    // jobs of higher priority go first
+	User        string               `json:"user,omitempty"`        // end-user ID, the tenant for fair share of pods
+	N           int                  `json:"n,omitempty"`           // how many choices to sample, the prompt is evaluated once for all of them
+	Timeout     int64                `json:"timeout,omitempty"`     // milliseconds for the job to be done since it was placed [ zero = no limit ]
+
+	ResponseFormat *ResponseFormat `json:"response_format,omitempty"`
+}
+
+// OpenAI compatible structured output
+//
+//	{ "type": "json_schema", "json_schema": { "name": "...", "schema": { ... } } }
+type ResponseFormat struct {
+	Type       string `json:"type"` // text | json_object | json_schema
+	JSONSchema *struct {
+		Name   string          `json:"name"`
+		Schema json.RawMessage `json:"schema"`
+		Strict bool            `json:"strict,omitempty"`
+	} `json:"json_schema,omitempty"`
+}
+
+// JSON schema of the output requested with response_format, empty if there no any
+func (payload *CompletionPayload) Schema() (string, error) {
+	if payload.ResponseFormat == nil {
+		return "", nil
+	}
+	switch payload.ResponseFormat.Type {
+	case "json_object":
+		return `{"type":"object"}`, nil
+	case "json_schema":
+		if payload.ResponseFormat.JSONSchema == nil {
+			return "", fmt.Errorf("json_schema is missing")
+		}
+		return compactSchema(payload.ResponseFormat.JSONSchema.Schema)
+	}
+	return "", nil
+}
+
+// NB! Schemas are cached by their text on C++ side, so the same schema should always look the same
+func compactSchema(schema json.RawMessage) (string, error) {
+	if len(schema) == 0 {
+		return "", nil
+	}
+	var buf bytes.Buffer
+	if err := json.Compact(&buf, schema); err != nil {
+		return "", err
+	}
+	return buf.String(), nil
 }
 
 func NewChatCompletions(ctx *fiber.Ctx) error {
@@ -1203,6 +1496,21 @@ func NewChatCompletions(ctx *fiber.Ctx) error {
 			JSON(fiber.Map{"error": "error parsing request body"})
 	}
 
+	schema, err := payload.Schema()
+	if err != nil {
+		return ctx.
+			Status(fiber.StatusBadRequest).
+			JSON(fiber.Map{"error": "wrong response format"})
+	}
+
+	// NB! All choices are sampled within parallel slots of the same pod, so the request asking for more choices
+	//     than any pod could serve is rejected instead of queueing the extra ones or returning fewer choices
+	if payload.N > MaxChoices() {
+		return ctx.
+			Status(fiber.StatusBadRequest).
+			JSON(fiber.Map{"error": fmt.Sprintf("n should not be more than %d", MaxChoices())})
+	}
+
 	jobID := uuid.New().String()
 
 	//if _, err := uuid.Parse(payload.ID); err != nil {
@@ -1247,7 +1555,7 @@ func NewChatCompletions(ctx *fiber.Ctx) error {
 
 	// TODO: Use payload Model selector !!!
 	// NB! Empty prompt! Only history is filled
-	PlaceJob(jobID, "" /* payload.Model */, sessionID, "" /* prompt */)
+	PlaceJob(jobID, "" /* payload.Model */, sessionID, "" /* prompt */, payload.Grammar, schema, payload.Priority, payload.User, payload.N, payload.Timeout)
 
 	log.Infow("[ JOB ] New job just queued", "id", jobID, "session", "", "model", payload.Model, "prompt", "") // TODO: last prompt of conversation
 
@@ -1255,6 +1563,7 @@ func NewChatCompletions(ctx *fiber.Ctx) error {
 	output := ""
 	status := ""
 	created := int64(0)
+	var choices []Choice
 
 	for time.Now().Before(finish) {
 
@@ -1274,8 +1583,9 @@ func NewChatCompletions(ctx *fiber.Ctx) error {
 		}
 
 		status = job.Status
-		if status == "finished" {
+		if status == "finished" || status == "aborted" {
 			output = job.Output
+			choices = job.Choices
 			created = job.CreatedAt
 
 			Mutex.Unlock()
@@ -1285,6 +1595,28 @@ func NewChatCompletions(ctx *fiber.Ctx) error {
 		Mutex.Unlock()
 	}
 
+	// the only output of the job, partial when the job was aborted after deadline
+	if len(choices) == 0 {
+		choices = []Choice{{Output: output, Aborted: status == "aborted"}}
+	}
+
+	list := make([]fiber.Map, len(choices))
+	for k, choice := range choices {
+		finishReason := "stop"
+		if choice.Aborted {
+			finishReason = "aborted"
+		}
+		list[k] = fiber.Map{
+			"message": fiber.Map{
+				"role":    "assistant",
+				"content": choice.Output,
+			},
+			"logprobs":      nil,
+			"finish_reason": finishReason,
+			"index":         k,
+		}
+	}
+
 	return ctx.JSON(fiber.Map{
 		"id":      jobID,
 		"created": created,
@@ -1296,17 +1628,7 @@ func NewChatCompletions(ctx *fiber.Ctx) error {
 			"total_tokens":      0, // TODO
 		},
 
-		"choices": []fiber.Map{
-			{
-				"message": fiber.Map{
-					"role":    "assistant",
-					"content": output,
-				},
-				"logprobs":      nil,
-				"finish_reason": "stop",
-				"index":         0, // TODO
-			},
-		},
+		"choices": list,
 
 		//"session": payload.Session,
 		//"prompt": payload.Prompt,
@@ -1381,6 +1703,177 @@ func buildCompletion(sessionID, promptID string, payload *CompletionPayload) (st
 	return history, nil
 }
 
+// --- POST v1/embeddings
+
+// {
+//		"model": "default",
+//		"input": [ "The food was delicious", "The waiter was friendly" ]
+// }
+
+type EmbeddingPayload struct {
+	Model          string          `json:"model,omitempty"`
+	Input          json.RawMessage `json:"input"`                     // either string or array of strings
+	EncodingFormat string          `json:"encoding_format,omitempty"` // only float is supported
+}
+
+// texts of the input whether it's a single string or an array of them
+func (payload *EmbeddingPayload) Texts() ([]string, error) {
+	var texts []string
+	if err := json.Unmarshal(payload.Input, &texts); err == nil {
+		return texts, nil
+	}
+	var text string
+	if err := json.Unmarshal(payload.Input, &text); err != nil {
+		return nil, err
+	}
+	return []string{text}, nil
+}
+
+// the first pod of the model requested, or just the first one when there no such model
+func embeddingPod(model string) *Pod {
+	var found *Pod
+	for _, pod := range Pods {
+		better := found == nil || pod.idx < found.idx
+		if found != nil && (pod.Model == model) != (found.Model == model) {
+			better = pod.Model == model
+		}
+		if better {
+			found = pod
+		}
+	}
+	return found
+}
+
+// Embed computes L2 normalised embeddings of all texts with the model of the pod at once
+// NB! Texts are packed into full batches on C++ side, so it's better to send as many of them as possible
+func Embed(pod *Pod, texts []string) ([][]float32, int64, error) {
+	size := int(C.embedSize(C.int(pod.idx)))
+	if size <= 0 || len(texts) == 0 {
+		return nil, 0, fmt.Errorf("no embeddings")
+	}
+
+	out := make([]float32, len(texts)*size)
+	list := make([]*C.char, len(texts))
+	for i, text := range texts {
+		list[i] = C.CString(text)
+	}
+	// NB! The array of C pointers is allocated with C, as Go memory passed to C can't hold Go pointers
+	ptrs := (**C.char)(C.malloc(C.size_t(len(list)) * C.size_t(unsafe.Sizeof(list[0]))))
+	copy(unsafe.Slice(ptrs, len(list)), list)
+
+	n := int64(C.embedBatch(C.int(pod.idx), ptrs, C.int(len(texts)), (*C.float)(unsafe.Pointer(&out[0]))))
+
+	C.free(unsafe.Pointer(ptrs))
+	for _, text := range list {
+		C.free(unsafe.Pointer(text))
+	}
+
+	if n < 0 {
+		return nil, 0, fmt.Errorf("failed to compute embeddings")
+	}
+
+	vectors := make([][]float32, len(texts))
+	for i := range vectors {
+		vectors[i] = out[i*size : (i+1)*size : (i+1)*size]
+	}
+	return vectors, n, nil
+}
+
+func NewEmbeddings(ctx *fiber.Ctx) error {
+
+	if GoShutdown {
+		return ctx.
+			Status(fiber.StatusServiceUnavailable).
+			JSON(fiber.Map{"error": "service is shutting down"})
+	}
+
+	payload := &EmbeddingPayload{}
+	if err := json.Unmarshal(ctx.Body(), payload); err != nil {
+		return ctx.
+			Status(fiber.StatusBadRequest).
+			JSON(fiber.Map{"error": "error parsing request body"})
+	}
+
+	texts, err := payload.Texts()
+	if err != nil || len(texts) == 0 {
+		return ctx.
+			Status(fiber.StatusBadRequest).
+			JSON(fiber.Map{"error": "input should be either string or array of strings"})
+	}
+
+	if payload.EncodingFormat != "" && payload.EncodingFormat != "float" {
+		return ctx.
+			Status(fiber.StatusBadRequest).
+			JSON(fiber.Map{"error": "only float encoding format is supported"})
+	}
+
+	pod := embeddingPod(payload.Model)
+	if pod == nil {
+		return ctx.
+			Status(fiber.StatusServiceUnavailable).
+			JSON(fiber.Map{"error": "no pods to compute embeddings"})
+	}
+
+	vectors, tokens, err := Embed(pod, texts)
+	if err != nil {
+		log.Infow("[ ERROR ] Embeddings failed", "pod", pod.ID, "texts", len(texts), "error", err)
+		return ctx.
+			Status(fiber.StatusInternalServerError).
+			JSON(fiber.Map{"error": err.Error()})
+	}
+
+	data := make([]fiber.Map, len(vectors))
+	for i, vector := range vectors {
+		data[i] = fiber.Map{
+			"object":    "embedding",
+			"index":     i,
+			"embedding": vector,
+		}
+	}
+
+	return ctx.JSON(fiber.Map{
+		"object": "list",
+		"data":   data,
+		"model":  pod.Model,
+
+		"usage": fiber.Map{
+			"prompt_tokens": tokens,
+			"total_tokens":  tokens,
+		},
+	})
+}
+
+// --- Bulk inference
+
+// Bulk processes all prompts of the JSONL input file with all pods at once, writing results as they done
+// NB! Prompts are passed to the model as is, so they should already follow the model chat template
+func Bulk(input, output string) int64 {
+
+	if output == "" {
+		output = strings.TrimSuffix(input, ".jsonl") + ".out.jsonl"
+	}
+
+	Colorize("\n[magenta][ BULK ][light_blue] Processing prompts from [light_magenta]%s[light_blue] into [light_magenta]%s", input, output)
+	log.Infof("[ BULK ] Processing prompts from %s into %s", input, output)
+
+	start := time.Now()
+	cInput, cOutput := C.CString(input), C.CString(output)
+	count := int64(C.bulkInference(C.int(len(Pods)), cInput, cOutput))
+	C.free(unsafe.Pointer(cInput))
+	C.free(unsafe.Pointer(cOutput))
+
+	if count < 0 {
+		Colorize("\n[magenta][ ERROR ][white] Failed to process prompts from %s\n\n", input)
+		log.Infof("[ ERROR ] Failed to process prompts from %s", input)
+		return count
+	}
+
+	elapsed := time.Since(start).Seconds()
+	Colorize("\n[magenta][ BULK ][light_blue] Done %d prompts in %.1f seconds\n", count, elapsed)
+	log.Infof("[ BULK ] Done %d prompts in %.1f seconds", count, elapsed)
+	return count
+}
+
 // --- GET /health
 
 func GetHealth(ctx *fiber.Ctx) error {